@@ -0,0 +1,135 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include <SimpleSNMP.h>
+#include <SnmpPosixUdp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/**
+ * LinuxAgent.cpp
+ *
+ * Runs SimpleSNMP as a normal program on a Linux host, using the batched udp socket transport
+ * Handy for trying out oid handlers and testing managers without a board
+ *
+ * Build with
+ *   g++ -O2 -Isrc src/SimpleSNMP.cpp src/SnmpHost.cpp src/SnmpPosixUdp.cpp examples/LinuxAgent.cpp -o snmpagent
+ * then
+ *   ./snmpagent [address] [port] [trap receiver]
+ *   snmpwalk -v2c -c public 127.0.0.1:1161 1.3.6.1.2.1
+ *
+ * Port 161 needs root, so the default is 1161 on the loopback address
+ * Given a trap receiver's address a coldStart trap is sent to it's port 162 when the agent starts, eg to snmptrapd
+ * ifTable lists the host's network interfaces, it's registered as a table so interfaces that come and go show up straight away
+ * The agent's counters are exported too, snmpwalk -v2c -c public 127.0.0.1:1161 1.3.6.1.4.1.55577.2.3 lists the requests each oid has answered
+ **/
+
+void getSystemDescription(void);       // 1.3.6.1.2.1.1.1.0
+bool getSystemUptime(SnmpValue *value); // 1.3.6.1.2.1.1.3.0
+void getSystemName(void);              // 1.3.6.1.2.1.1.5.0
+int32_t nextInterface(int32_t after);  // ifTable rows, 1.3.6.1.2.1.2.2.1
+bool getInterface(byte column, int32_t row, SnmpValue *value);
+
+const byte ifColumns[] PROGMEM = {1, 2, 4, 8}; // ifIndex, ifDescr, ifMtu, ifOperStatus
+
+SnmpPosixUdp transport;    // The socket, set up before the agent uses it
+SimpleSNMP snmp(&transport); // Define an instance of the main snmp suppport class
+
+int main(int argc, char **argv)
+{
+    const char *address = argc > 1 ? argv[1] : "127.0.0.1";
+    uint16_t port = argc > 2 ? atoi(argv[2]) : 1161;
+    if (!transport.begin(address, port))
+        return 1;
+
+    snmp.insertNode(PSTR("1.3.6.1.2.1.1.1.0"), getSystemDescription); // System Description
+    snmp.insertNode(PSTR("1.3.6.1.2.1.1.3.0"), getSystemUptime);      // System up time in 1/100th seconds
+    snmp.insertNode(PSTR("1.3.6.1.2.1.1.5.0"), getSystemName);        // System Name
+    snmp.addTable(PSTR("1.3.6.1.2.1.2.2.1"), ifColumns, sizeof(ifColumns), nextInterface, getInterface); // ifTable
+    if (!snmp.exportStatistics()) // The snmp group at 1.3.6.1.2.1.11, the agent's own counters and requests per oid
+        printf("Statistics not exported\n");
+    printf("SNMP agent listening on %s:%u\n", address, port);
+
+#if SNMP_NOTIFY_QUEUE_SIZE // Notifications are compiled out when it's 0
+    struct in_addr receiver;
+    if (argc > 3 && inet_pton(AF_INET, argv[3], &receiver) == 1)
+    {
+        snmp.addNotifyDestination(IPAddress(receiver.s_addr)); // Traps to port 162 with the public community
+        snmp.sendNotification(PSTR("1.3.6.1.6.3.1.1.5.1"), NULL, 0); // coldStart, sent by the first action()
+    }
+#endif
+
+    while (true)
+    {
+        transport.wait(1000); // Sleep until a request arrives, or a second passes so deferred requests can time out
+        snmp.action();        // Process snmp
+    }
+}
+
+/**************************************************
+ * Supporting functions for standard Mib II values
+ * ************************************************/
+
+void getSystemDescription(void) // 1.3.6.1.2.1.1.1.0
+{
+    snmp.sendResponse((char *)PSTR("Linux"));
+}
+
+bool getSystemUptime(SnmpValue *value) // 1.3.6.1.2.1.1.3.0
+{
+    value->setTimeTicks(millis() / 10); // timeticks are 1/100th seconds
+    return true;
+}
+
+void getSystemName(void) // 1.3.6.1.2.1.1.5.0
+{
+    snmp.sendResponse((char *)PSTR("SimpleSNMP"));
+}
+
+/**************************************************
+ * ifTable, one row per network interface
+ * ************************************************/
+
+int32_t nextInterface(int32_t after) // Returns the lowest interface index above after, -1 if there isn't one
+{
+    struct if_nameindex *list = if_nameindex();
+    int32_t next = -1;
+    for (struct if_nameindex *i = list; i && i->if_index; i++)
+    {
+        if ((int32_t)i->if_index > after && (next < 0 || (int32_t)i->if_index < next))
+            next = i->if_index;
+    }
+    if_freenameindex(list);
+    return next;
+}
+
+bool getInterface(byte column, int32_t row, SnmpValue *value)
+{
+    static char name[IF_NAMESIZE]; // Strings are copied once the callback returns
+    if (!if_indextoname(row, name)) // Gone since it was listed
+        return false;
+    struct ifreq req;
+    memset(&req, 0, sizeof(req));
+    memcpy(req.ifr_name, name, sizeof(req.ifr_name));
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    switch (column)
+    {
+    case 1: // ifIndex
+        value->setInteger(row);
+        break;
+    case 2: // ifDescr
+        value->setString(name);
+        break;
+    case 4: // ifMtu
+        if (ioctl(fd, SIOCGIFMTU, &req) == 0)
+            value->setInteger(req.ifr_mtu);
+        break;
+    case 8: // ifOperStatus, up(1) or down(2)
+        if (ioctl(fd, SIOCGIFFLAGS, &req) == 0)
+            value->setInteger(req.ifr_flags & IFF_RUNNING ? 1 : 2);
+        break;
+    }
+    close(fd);
+    return value->type != SNMP_DATATYPE_NOTSET;
+}
+#endif
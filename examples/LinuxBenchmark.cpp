@@ -0,0 +1,284 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include <SimpleSNMP.h>
+#include <chrono>
+#include <new>
+
+/**
+ * LinuxBenchmark.cpp
+ *
+ * Times the request path on a Linux host, a baseline to catch performance regressions against
+ * Each stage is run on every request in the corpus below with registries of 10, 100, 1000 and 10000 oids
+ * and the time and heap allocations per operation reported
+ *
+ *   parse     parsepdu() on a copy of the request
+ *   lookup    findNode() for each varbind oid
+ *   process   beginResponse() and the get, getnext, getbulk or set processing, read functions included
+ *   headers   beginResponse() and finishResponse() with no varbinds, the message headers
+ *   cycle     the whole request, from the transport through action() to the response being sent
+ *   char2oid  and oid2char, the oid text conversions used when registering and logging
+ *   register  building the registry one oid at a time with insertNode() and in one go with registerMib()
+ *
+ * Build with
+ *   g++ -O2 -Isrc src/SimpleSNMP.cpp src/SnmpHost.cpp examples/LinuxBenchmark.cpp -o snmpbench
+ * then
+ *   ./snmpbench [ms per measurement]
+ **/
+
+// The corpus, v1 and v2c requests as sent by the net-snmp tools
+const byte getDescr[] = { // snmpget -v2c -c public sysDescr.0
+    0x30, 0x29, 0x02, 0x01, 0x01, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6C, 0x69, 0x63, 0xA0, 0x1C, 0x02,
+    0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x0E, 0x30, 0x0C, 0x06,
+    0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00, 0x05, 0x00};
+const byte getSystem[] = { // snmpget -v2c -c public sysDescr.0 sysUpTime.0 sysName.0
+    0x30, 0x45, 0x02, 0x01, 0x01, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6C, 0x69, 0x63, 0xA0, 0x38, 0x02,
+    0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x2A, 0x30, 0x0C, 0x06,
+    0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00, 0x05, 0x00, 0x30, 0x0C, 0x06, 0x08, 0x2B,
+    0x06, 0x01, 0x02, 0x01, 0x01, 0x03, 0x00, 0x05, 0x00, 0x30, 0x0C, 0x06, 0x08, 0x2B, 0x06, 0x01,
+    0x02, 0x01, 0x01, 0x05, 0x00, 0x05, 0x00};
+const byte getEnterprise[] = { // snmpget -v2c -c public 1.3.6.1.4.1.55555.1.5.0
+    0x30, 0x2C, 0x02, 0x01, 0x01, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6C, 0x69, 0x63, 0xA0, 0x1F, 0x02,
+    0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x11, 0x30, 0x0F, 0x06,
+    0x0B, 0x2B, 0x06, 0x01, 0x04, 0x01, 0x83, 0xB2, 0x03, 0x01, 0x05, 0x00, 0x05, 0x00};
+const byte getNext[] = { // snmpgetnext -v1 -c public sysUpTime.0
+    0x30, 0x29, 0x02, 0x01, 0x00, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6C, 0x69, 0x63, 0xA1, 0x1C, 0x02,
+    0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x0E, 0x30, 0x0C, 0x06,
+    0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x03, 0x00, 0x05, 0x00};
+const byte getBulk[] = { // snmpbulkget -v2c -c public -Cr10 1.3.6.1.4.1.55555.1
+    0x30, 0x2A, 0x02, 0x01, 0x01, 0x04, 0x06, 0x70, 0x75, 0x62, 0x6C, 0x69, 0x63, 0xA5, 0x1D, 0x02,
+    0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x0A, 0x30, 0x0F, 0x30, 0x0D, 0x06,
+    0x09, 0x2B, 0x06, 0x01, 0x04, 0x01, 0x83, 0xB2, 0x03, 0x01, 0x05, 0x00};
+const byte setLocation[] = { // snmpset -v2c -c private sysLocation.0 s "Rack 12"
+    0x30, 0x31, 0x02, 0x01, 0x01, 0x04, 0x07, 0x70, 0x72, 0x69, 0x76, 0x61, 0x74, 0x65, 0xA3, 0x23,
+    0x02, 0x04, 0x01, 0x23, 0x45, 0x67, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x15, 0x30, 0x13,
+    0x06, 0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x06, 0x00, 0x04, 0x07, 0x52, 0x61, 0x63, 0x6B,
+    0x20, 0x31, 0x32};
+
+struct benchRequest
+{
+    const char *name;
+    const byte *pdu;
+    uint16_t len;
+};
+const benchRequest corpus[] = {
+    {"get sysDescr", getDescr, sizeof(getDescr)},
+    {"get system x3", getSystem, sizeof(getSystem)},
+    {"get enterprise", getEnterprise, sizeof(getEnterprise)},
+    {"getnext v1", getNext, sizeof(getNext)},
+    {"getbulk x10", getBulk, sizeof(getBulk)},
+    {"set sysLocation", setLocation, sizeof(setLocation)},
+};
+
+// Heap allocations are counted by replacing the global operator new, the library allocates with new
+unsigned long allocations = 0;
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// class SnmpMemoryTransport hands SimpleSNMP one request at a time from memory and keeps the response
+class SnmpMemoryTransport : public SnmpTransport
+{
+public:
+    const byte *request = NULL; // request to hand out, NULL once it's been received
+    uint16_t requestLen = 0;
+    uint16_t responseLen = 0; // length of the last response sent
+
+    int available(void) { return request ? requestLen : 0; }
+    int receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port)
+    {
+        uint16_t len = requestLen < size ? requestLen : size;
+        memcpy(buff, request, len);
+        request = NULL;
+        *ip = IPAddress(127, 0, 0, 1);
+        *port = 40000;
+        return len;
+    }
+    bool send(const byte *, uint16_t len, IPAddress, uint16_t)
+    {
+        responseLen = len;
+        return true;
+    }
+};
+
+static char location[32] = "Lab";
+SimpleSNMP *snmp; // Registry being timed
+
+void getSystemDescription(void) { snmp->sendResponse((char *)PSTR("SimpleSNMP benchmark")); }
+bool getSystemUptime(SnmpValue *value)
+{
+    value->setTimeTicks(123456);
+    return true;
+}
+bool getSystemName(SnmpValue *value)
+{
+    value->setString(PSTR("bench"));
+    return true;
+}
+void getSystemLocation(void) { snmp->sendResponse(location); }
+void setSystemLocation(void)
+{
+    int len = snmp->getUserData(snmp->workingpdu.setvalueasn1, (byte *)location, sizeof(location) - 1);
+    location[len > (int)sizeof(location) - 1 ? (int)sizeof(location) - 1 : len] = '\0';
+    snmp->sendResponse(location);
+}
+bool getEnterpriseCounter(SnmpValue *value)
+{
+    value->setCounter32(42);
+    return true;
+}
+
+// class SnmpBenchmark runs the timings, it's a friend of SimpleSNMP so it can call the request stages one at a time
+class SnmpBenchmark
+{
+public:
+    SnmpBenchmark(unsigned long runMillis) : runMillis(runMillis) {}
+
+    // Times op until runMillis has passed, prints the ns and allocations per call
+    template <typename Op>
+    void measure(const char *stage, const char *request, uint16_t size, Op op)
+    {
+        unsigned long iterations = 0;
+        unsigned long batch = 64;
+        unsigned long startAllocations = allocations;
+        auto start = std::chrono::steady_clock::now();
+        auto end = start + std::chrono::milliseconds(runMillis);
+        auto now = start;
+        while (now < end)
+        {
+            for (unsigned long i = 0; i < batch; i++)
+                op();
+            iterations += batch;
+            batch *= 2;
+            now = std::chrono::steady_clock::now();
+        }
+        double ns = std::chrono::duration<double, std::nano>(now - start).count() / iterations;
+        printf("%-9s %-16s %6u %10.1f %10.3f\n", stage, request, size, ns, (double)(allocations - startAllocations) / iterations);
+    }
+
+    // Runs every stage against a registry of size oids
+    void run(uint16_t size)
+    {
+        SnmpMemoryTransport transport;
+        snmp = new SimpleSNMP(&transport);
+        snmp->insertNode(PSTR("1.3.6.1.2.1.1.1.0"), getSystemDescription);
+        snmp->insertNode(PSTR("1.3.6.1.2.1.1.3.0"), getSystemUptime);
+        snmp->insertNode(PSTR("1.3.6.1.2.1.1.5.0"), getSystemName);
+        snmp->insertNode(PSTR("1.3.6.1.2.1.1.6.0"), getSystemLocation);
+        snmp->addRWaction(PSTR("1.3.6.1.2.1.1.6.0"), setSystemLocation);
+        char oidtext[40];
+        for (uint16_t i = 0; i < size - 4; i++) // Fill up the registry with enterprise oids
+        {
+            snprintf(oidtext, sizeof(oidtext), "1.3.6.1.4.1.55555.1.%u.0", i);
+            snmp->insertNode(oidtext, getEnterpriseCounter);
+        }
+        snmp->setActionBudget(1, 0);
+
+        byte buff[SNMP_MAX_PACKET_SIZE];
+        for (const benchRequest &req : corpus)
+        {
+            measure("parse", req.name, size, [&]() {
+                memcpy(buff, req.pdu, req.len);
+                snmp->parsepdu(buff, req.len);
+            });
+
+            memcpy(buff, req.pdu, req.len);
+            snmp->parsepdu(buff, req.len);
+            measure("lookup", req.name, size, [&]() {
+                bool exact;
+                for (byte vb = 0; vb < snmp->workingpdu.vbcount; vb++)
+                    snmp->findNode(snmp->selectVarbind(vb), &exact);
+            });
+
+            measure("process", req.name, size, [&]() {
+                memcpy(buff, req.pdu, req.len);
+                snmp->parsepdu(buff, req.len);
+                snmp->beginResponse();
+                switch (snmp->workingpdu.requesttype)
+                {
+                case SNMP_TYPECODE_GETREQ:
+                    snmp->processGetRequest();
+                    break;
+                case SNMP_TYPECODE_GETNEXTREQ:
+                    snmp->processGetNextRequest();
+                    break;
+                case SNMP_TYPECODE_GETBULKREQ:
+                    snmp->processGetBulkRequest();
+                    break;
+                case SNMP_TYPECODE_GSETREQ:
+                    snmp->processSetRequest();
+                    break;
+                }
+                byte *response;
+                snmp->finishResponse(&response);
+            });
+
+            memcpy(buff, req.pdu, req.len);
+            snmp->parsepdu(buff, req.len);
+            measure("headers", req.name, size, [&]() {
+                snmp->beginResponse();
+                byte *response;
+                snmp->finishResponse(&response);
+            });
+
+            byte cycle[SNMP_MAX_PACKET_SIZE];
+            memcpy(cycle, req.pdu, req.len);
+            byte *reqid = cycle + (req.pdu[6] == 0x06 ? 20 : 21); // Last request id byte, after the community string
+            measure("cycle", req.name, size, [&]() {
+                (*reqid)++; // A new request id each time so the retransmit cache doesn't answer it
+                transport.request = cycle;
+                transport.requestLen = req.len;
+                snmp->action();
+            });
+            if (!transport.responseLen)
+                printf("%s got no response\n", req.name);
+        }
+
+        byte oidbuff[MAX_OID_SIZE];
+        measure("char2oid", "sysLocation.0", size, [&]() { snmp->char2oid("1.3.6.1.2.1.1.6.0", oidbuff); });
+        measure("oid2char", "sysLocation.0", size, [&]() { snmp->oid2char(oidbuff); });
+        delete snmp;
+
+        char(*texts)[32] = new char[size][32]; // The enterprise oids as a list for registerMib()
+        snmpMibObject *list = new snmpMibObject[size];
+        for (uint16_t i = 0; i < size; i++)
+        {
+            snprintf(texts[i], sizeof(texts[i]), "1.3.6.1.4.1.55555.1.%u.0", i);
+            list[i] = snmpObject(texts[i], getEnterpriseCounter);
+        }
+        measure("register", "insertNode", size, [&]() {
+            SimpleSNMP registry(NULL);
+            for (uint16_t i = 0; i < size; i++)
+                registry.insertNode(texts[i], getEnterpriseCounter);
+        });
+        measure("register", "registerMib", size, [&]() {
+            SimpleSNMP registry(NULL);
+            registry.registerMib(list, size);
+        });
+        delete[] list;
+        delete[] texts;
+    }
+
+private:
+    unsigned long runMillis;
+};
+
+int main(int argc, char **argv)
+{
+    unsigned long runMillis = argc > 1 ? atol(argv[1]) : 100;
+    SnmpBenchmark bench(runMillis);
+    printf("%-9s %-16s %6s %10s %10s\n", "stage", "request", "oids", "ns/op", "allocs/op");
+    const uint16_t sizes[] = {10, 100, 1000, 10000};
+    for (uint16_t size : sizes)
+        bench.run(size);
+    return 0;
+}
+#endif
@@ -0,0 +1,180 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include <SimpleSNMP.h>
+#include <SnmpPosixUdp.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <poll.h>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * LinuxLoadTest.cpp
+ *
+ * Loopback load test for a multi-threaded agent, shows how throughput scales with the number of worker threads
+ * Each worker has it's own SO_REUSEPORT socket and SimpleSNMP instance, all sharing one registry
+ * A set of manager threads keep a window of get requests in flight and count the responses
+ *
+ * Build with
+ *   g++ -O2 -pthread -Isrc src/SimpleSNMP.cpp src/SnmpHost.cpp src/SnmpPosixUdp.cpp examples/LinuxLoadTest.cpp -o snmpload
+ * then
+ *   ./snmpload [most workers] [seconds per run] [managers]
+ *
+ * The managers run on the same host so they compete with the workers for cores, leave some spare
+ **/
+
+#define LOAD_PORT 1161  // Agent port on 127.0.0.1
+#define LOAD_WINDOW 16  // Requests each manager keeps in flight
+#define MAX_WORKERS 64  //
+#define MAX_MANAGERS 64 //
+
+void getSystemDescription(void);       // 1.3.6.1.2.1.1.1.0
+bool getSystemUptime(SnmpValue *value); // 1.3.6.1.2.1.1.3.0
+bool getSnmpInPkts(SnmpValue *value);  // 1.3.6.1.2.1.11.1.0
+
+SimpleSNMP mib(NULL); // Holds the registry, the workers serve it
+
+std::atomic<bool> running;
+std::atomic<unsigned long> responses;
+
+// One agent thread, serves requests until running is cleared
+void worker(SimpleSNMP *snmp, SnmpPosixUdp *transport)
+{
+    while (running)
+    {
+        transport->wait(10);
+        snmp->action();
+    }
+}
+
+// Builds a get request for sysDescr, sysUpTime and snmpInPkts with request id rid
+int buildRequest(byte *buff, uint16_t rid)
+{
+    static const byte request[] = {
+        0x30, 0x44, 0x02, 0x01, 0x01, 0x04, 0x06, 'p', 'u', 'b', 'l', 'i', 'c',
+        0xA0, 0x37, 0x02, 0x03, 0x00, 0x00, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00,
+        0x30, 0x2A,
+        0x30, 0x0C, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x01, 0x00, 0x05, 0x00,
+        0x30, 0x0C, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x01, 0x03, 0x00, 0x05, 0x00,
+        0x30, 0x0C, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x0B, 0x01, 0x00, 0x05, 0x00};
+    memcpy(buff, request, sizeof(request));
+    buff[18] = rid >> 8; // Request id, three bytes so the top bit is never set
+    buff[19] = rid & 0xFF;
+    return sizeof(request);
+}
+
+// One manager, keeps LOAD_WINDOW requests in flight, a lost request is replaced after 100ms
+void manager(int id)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in agent;
+    memset(&agent, 0, sizeof(agent));
+    agent.sin_family = AF_INET;
+    agent.sin_port = htons(LOAD_PORT);
+    agent.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, (struct sockaddr *)&agent, sizeof(agent));
+
+    byte buff[SNMP_MAX_PACKET_SIZE];
+    uint16_t rid = id << 8;
+    unsigned long count = 0;
+    while (running)
+    {
+        for (int i = 0; i < LOAD_WINDOW; i++)
+            send(fd, buff, buildRequest(buff, rid++), 0);
+        for (int i = 0; i < LOAD_WINDOW && running; i++)
+        {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) // Lost, start a new window
+                break;
+            if (recv(fd, buff, sizeof(buff), 0) > 0)
+                count++;
+        }
+    }
+    responses += count;
+    close(fd);
+}
+
+// Runs the managers against workers threads for seconds, returns the responses per second
+double runLoad(int workers, int managers, int seconds)
+{
+    SnmpPosixUdp *transports = new SnmpPosixUdp[workers];
+    SimpleSNMP *agents[MAX_WORKERS];
+    std::thread threads[MAX_WORKERS + MAX_MANAGERS];
+    for (int i = 0; i < workers; i++)
+    {
+        if (!transports[i].begin("127.0.0.1", LOAD_PORT, true))
+            exit(1);
+        agents[i] = new SimpleSNMP(&transports[i], &mib);
+        agents[i]->setActionBudget(SNMP_POSIX_BATCH, 0);
+    }
+
+    running = true;
+    responses = 0;
+    for (int i = 0; i < workers; i++)
+        threads[i] = std::thread(worker, agents[i], &transports[i]);
+    for (int i = 0; i < managers; i++)
+        threads[workers + i] = std::thread(manager, i);
+    unsigned long start = millis();
+    sleep(seconds);
+    running = false;
+    for (int i = 0; i < workers + managers; i++)
+        threads[i].join();
+    double rate = responses * 1000.0 / (millis() - start);
+
+    for (int i = 0; i < workers; i++)
+        delete agents[i];
+    delete[] transports;
+    return rate;
+}
+
+int main(int argc, char **argv)
+{
+    int most = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+    int managers = argc > 3 ? atoi(argv[3]) : 16;
+    if (most < 1)
+        most = 1;
+    if (most > MAX_WORKERS)
+        most = MAX_WORKERS;
+    if (managers > MAX_MANAGERS)
+        managers = MAX_MANAGERS;
+
+    mib.insertNode(PSTR("1.3.6.1.2.1.1.1.0"), getSystemDescription); // System Description
+    mib.insertNode(PSTR("1.3.6.1.2.1.1.3.0"), getSystemUptime);      // System up time in 1/100th seconds
+    mib.insertNode(PSTR("1.3.6.1.2.1.11.1.0"), getSnmpInPkts);       // snmpInPkts, of the worker that answers
+
+    printf("%d managers, %d requests in flight each, %u cores\n", managers, LOAD_WINDOW, std::thread::hardware_concurrency());
+    printf("workers  responses/s  speedup\n");
+    double single = 0;
+    for (int workers = 1; workers <= most; workers *= 2)
+    {
+        double rate = runLoad(workers, managers, seconds);
+        if (workers == 1)
+            single = rate;
+        printf("%7d  %11.0f  %7.2f\n", workers, rate, rate / single);
+        if (workers < most && workers * 2 > most) // Always finish with the most workers asked for
+            workers = most / 2;
+    }
+    return 0;
+}
+
+/**************************************************
+ * Supporting functions, called by all the workers
+ * ************************************************/
+
+void getSystemDescription(void) // 1.3.6.1.2.1.1.1.0
+{
+    SimpleSNMP::serving()->sendResponse((char *)PSTR("Linux")); // The worker processing the request, not a global instance
+}
+
+bool getSystemUptime(SnmpValue *value) // 1.3.6.1.2.1.1.3.0
+{
+    value->setTimeTicks(millis() / 10); // timeticks are 1/100th seconds
+    return true;
+}
+
+bool getSnmpInPkts(SnmpValue *value) // 1.3.6.1.2.1.11.1.0
+{
+    value->setCounter32(SimpleSNMP::serving()->snmpPacketsRecv);
+    return true;
+}
+#endif
@@ -0,0 +1,114 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include <SimpleSNMP.h>
+#include <SnmpMib.h>
+#include <SnmpSimulator.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+/**
+ * LinuxSimulator.cpp
+ *
+ * Simulates a network of SNMP devices for testing a management system, every device has it's own port on 127.0.0.1
+ * All the devices share one Mib II registry, sysName is worked out from the device number and every tenth device
+ * has it's sysLocation overridden
+ * The registry is built by the compiler with SNMP_MIB() so it's read only and nothing is registered at startup
+ *
+ * Build with
+ *   g++ -O2 -Isrc src/SimpleSNMP.cpp src/SnmpHost.cpp src/SnmpPosixUdp.cpp src/SnmpSimulator.cpp examples/LinuxSimulator.cpp -o snmpsim
+ * then
+ *   ./snmpsim [devices] [first port]
+ *   snmpget -v2c -c public 127.0.0.1:20042 1.3.6.1.2.1.1.5.0
+ *
+ * Each device needs a file descriptor, the soft limit is raised as far as the hard limit allows
+ **/
+
+void getSystemDescription(void);        // 1.3.6.1.2.1.1.1.0
+bool getSystemUptime(SnmpValue *value); // 1.3.6.1.2.1.1.3.0
+void getSystemName(void);               // 1.3.6.1.2.1.1.5.0
+bool getSystemLocation(SnmpValue *value); // 1.3.6.1.2.1.1.6.0
+bool getSnmpInPkts(SnmpValue *value);   // 1.3.6.1.2.1.11.1.0
+
+SNMP_MIB(mib2, snmpObject("1.3.6.1.2.1.1.1.0", getSystemDescription), // System Description
+              snmpObject("1.3.6.1.2.1.1.3.0", getSystemUptime),      // System up time in 1/100th seconds
+              snmpObject("1.3.6.1.2.1.1.5.0", getSystemName),        // System Name
+              snmpObject("1.3.6.1.2.1.1.6.0", getSystemLocation),    // System Location
+              snmpObject("1.3.6.1.2.1.11.1.0", getSnmpInPkts));      // snmpInPkts, for all the devices
+
+SimpleSNMP mib(NULL); // The registry every device answers from
+SnmpSimulator *sim;
+
+int main(int argc, char **argv)
+{
+    int devices = argc > 1 ? atoi(argv[1]) : 1000;
+    int port = argc > 2 ? atoi(argv[2]) : 20000;
+
+    struct rlimit files; // A socket per device
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    mib.useMib(mib2.nodes, mib2.count);
+
+    sim = new SnmpSimulator(&mib);
+    size_t before = mallinfo2().uordblks;
+    for (int i = 0; i < devices; i++)
+    {
+        if (sim->addAgent("127.0.0.1", port + i) < 0)
+        {
+            printf("Only %d devices could be started\n", i);
+            break;
+        }
+        if (i % 10 == 0) // Every tenth device is somewhere else
+        {
+            SnmpValue location;
+            location.setString(PSTR("Remote site"));
+            sim->setValue(i, PSTR("1.3.6.1.2.1.1.6.0"), &location);
+        }
+    }
+    size_t used = mallinfo2().uordblks - before;
+    printf("%u devices on 127.0.0.1:%d-%d, %zu bytes of heap, %zu per device\n", sim->agents(), port, port + sim->agents() - 1,
+           used, sim->agents() ? used / sim->agents() : 0);
+    printf("shared buffers %zu bytes\n", sizeof(SnmpSimulator));
+    fflush(stdout);
+
+    while (true)
+    {
+        sim->wait(1000); // Sleep until a request arrives for any device
+        sim->action();
+    }
+}
+
+/**************************************************
+ * Supporting functions, shared by all the devices
+ * ************************************************/
+
+void getSystemDescription(void) // 1.3.6.1.2.1.1.1.0
+{
+    SimpleSNMP::serving()->sendResponse((char *)PSTR("SimpleSNMP simulated device"));
+}
+
+bool getSystemUptime(SnmpValue *value) // 1.3.6.1.2.1.1.3.0
+{
+    value->setTimeTicks(millis() / 10); // timeticks are 1/100th seconds
+    return true;
+}
+
+void getSystemName(void) // 1.3.6.1.2.1.1.5.0
+{
+    char name[20];
+    snprintf(name, sizeof(name), "device-%u", sim->current()); // The device the request was sent to
+    SimpleSNMP::serving()->sendResponse(name);
+}
+
+bool getSystemLocation(SnmpValue *value) // 1.3.6.1.2.1.1.6.0, unless overridden
+{
+    value->setString(PSTR("Lab"));
+    return true;
+}
+
+bool getSnmpInPkts(SnmpValue *value) // 1.3.6.1.2.1.11.1.0
+{
+    value->setCounter32(SimpleSNMP::serving()->snmpPacketsRecv);
+    return true;
+}
+#endif
@@ -11,6 +11,8 @@
  *
  * Read OID support functions should assemble the response data and then call snmp.sendresponse() to send it.
  * Write OID support should make the appropriate change then call snmp.sendrespomse() with the actual data that was changed
+ * Read OID value callbacks set the value in the slot they are passed and return true, SimpleSNMP encodes and sends it
+ * Values already held in a variable or constant are bound to their oid and read directly, there's no function to write
  * All functions can access SimpleSNMP.workingpdu struct as required which contains pointers to the main elements of the received snmp frame
  *
  * ToDo: Add suport oid 1.3.6.1.2.1.2.2.1.1 uptime 64 bit
@@ -20,13 +22,12 @@
 void getSystemDescription(void); // 1.3.6.1.2.1.1.1.0
 void getSystemOid(void);         // 1.3.6.1.2.1.1.2.0
 void getSystemUptime(void);      // 1.3.6.1.2.1.1.3.0
-void getSystemContact(void);     // 1.3.6.1.2.1.1.4.0
 void getSystemName(void);        // 1.3.6.1.2.1.1.5.0
 void getSystemLocation(void);    // 1.3.6.1.2.1.1.6.0
 void setSystemLocation(void);    // 1.3.6.1.2.1.1.6.0
 void getSystemServices(void);    // 1.3.6.1.2.1.1.7.0
-void getSnmpInPkts(void);        // 1.3.6.1.2.1.11.1
-void getSnmpOutPkts(void);       // 1.3.6.1.2.1.11.2
+
+static const char systemContact[] PROGMEM = "SimpleSNMP@m1cje.uk"; // 1.3.6.1.2.1.1.4.0
 
 SimpleSNMP snmp; // Define an instance of the main snmp suppport class
 
@@ -60,15 +61,17 @@ void setup(void)
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.1.0"), getSystemDescription); // System Description
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.2.0"), getSystemOid);         // System OID
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.3.0"), getSystemUptime);      // System up time in 1/100th seconds
-    snmp.insertNode(PSTR("1.3.6.1.2.1.1.4.0"), getSystemContact);     // System Contact
+    snmp.bindVariable(PSTR("1.3.6.1.2.1.1.4.0"), systemContact);      // System Contact, read straight from flash
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.5.0"), getSystemName);        // System Name
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.6.0"), getSystemLocation);    // System Location
     snmp.insertNode(PSTR("1.3.6.1.2.1.1.7.0"), getSystemServices);    // System Services
 
     snmp.addRWaction(PSTR("1.3.6.1.2.1.1.6.0"), setSystemLocation); // Set system location
 
-    snmp.insertNode(PSTR("1.3.6.1.2.1.11.1.0"), getSnmpInPkts);  // snmpInPkts
-    snmp.insertNode(PSTR("1.3.6.1.2.1.11.2.0"), getSnmpOutPkts); // snmpOutPkts
+    if (!snmp.exportStatistics()) // snmpInPkts, snmpOutPkts and the rest of the snmp group, plus the agent's own counters
+        Serial.println("Statistics not exported");
+    snmp.setRateLimit(20, 10, 100); // Drop packets over 20 a second from any one address, or 100 a second in all
+    snmp.setActionBudget(4, 0, 50);  // Leave at least half the time for loop() however busy snmp gets
 
     Serial.println("SNMP OIDs registered");
 }
@@ -109,11 +112,6 @@ void getSystemUptime(void) // 1.3.6.1.2.1.1.3.0
                                                         // See OID .1.3.6.1.6.3.10.2.1.3 for 64 bit uptime
 }
 
-void getSystemContact(void) // 1.3.6.1.2.1.1.4.0
-{
-    snmp.sendResponse((char *)PSTR("SimpleSNMP@m1cje.uk"));
-}
-
 void getSystemName(void) // 1.3.6.1.2.1.1.5.0
 {
 #ifndef __PROJECT
@@ -162,11 +160,3 @@ void getSystemServices(void) // 1.3.6.1.2.1.1.7.0
                              */
 }
 
-void getSnmpInPkts(void) // 1.3.6.1.2.1.11.1
-{
-    snmp.sendResponse(snmp.snmpPacketsRecv, SNMP_DATATYPE_COUNTER32); // Send it
-}
-void getSnmpOutPkts(void) // 1.3.6.1.2.1.11.2
-{
-    snmp.sendResponse(snmp.snmpPacketsSent, SNMP_DATATYPE_COUNTER32); // Send it
-}
@@ -1,17 +1,26 @@
-#include <Arduino.h>
-#include <WiFiUdp.h>
 #include <SimpleSNMP.h>
 
 #ifndef myLog_P
 #define myLog_P Serial.printf_P
 #endif
 
+// Log messages by level, a message more detailed than SNMP_LOG_LEVEL isn't compiled
+#if SNMP_LOG_LEVEL >= SNMP_LOG_ERROR
+#define snmpLogError(...) myLog_P(__VA_ARGS__)
+#else
+#define snmpLogError(...)
+#endif
+#if SNMP_LOG_LEVEL >= SNMP_LOG_WARN
+#define snmpLogWarn(...) myLog_P(__VA_ARGS__)
+#else
+#define snmpLogWarn(...)
+#endif
+
 /********************************************
  * 27 Mar 2022 - Initial build
  *
  * To Do.-
  * snmp v3
- * snmp traps
  * package and publish
  *
  *******************************************/
@@ -19,44 +28,203 @@
 /***********************************
  * Global variables
  * *********************************/
-WiFiUDP snmpudp;           // udp port object
-byte gpbuff[MAX_OID_SIZE]; // General purpose buffer space, always assume it's invalid before use
+#if defined(__linux__) && !defined(ARDUINO)
+static thread_local SimpleSNMP *servingAgent = NULL; // the instance processing a request, each worker thread has it's own
+#else
+static SimpleSNMP *servingAgent = NULL; // the instance processing a request
+#endif
+
+// Tracepoints for the request stage times, they compile to nothing unless SNMP_STAGE_TIMING is set
+#if SNMP_STAGE_TIMING
+#define SNMP_TIMING_START(start) uint32_t start = ESP.getCycleCount()
+#define SNMP_TIMING_STOP(stage, start) recordStage(stage, ESP.getCycleCount() - start)
+#define SNMP_TIMING_CALLBACK(start)                       \
+    {                                                     \
+        uint32_t cycles = ESP.getCycleCount() - start;    \
+        callbackCycles += cycles;                         \
+        recordStage(SNMP_STAGE_CALLBACK, cycles);         \
+    }
+#else
+#define SNMP_TIMING_START(start)
+#define SNMP_TIMING_STOP(stage, start)
+#define SNMP_TIMING_CALLBACK(start)
+#endif
 
 /**************************************************************************************************************************************************************
- * public snmpnode support functions
+ * public SimpleSNMP support functions
  **************************************************************************************************************************************************************/
 
-snmpNode::snmpNode(const char *oidtext, void (*action)()) // Default constructor
+#ifdef ARDUINO
+///////////////////////////////////////////////////////////////////////////
+// Constructor, initialise efault values and listen on the WiFi udp port
+///////////////////////////////////////////////////////////////////////////
+SimpleSNMP::SimpleSNMP(void)
 {
-    this->oid = oidtext;            // Store pointer to command text
-    this->RWcommandAction = NULL;   // Init pointer to RW function
-    this->ROcommandAction = action; // Store pointer to function to read the value
-                                    //    this->SNMPreqtype = SNMP_TYPECODE_NOTSET; // Store the request type, RO or RW (0xA0 or 0xA3)
-    this->next = NULL;              // Init pointer to next item in the list
+    initialise(&wifiTransport);
+    wifiTransport.begin(161); // SNMP is always on port 161
 }
+#endif
 
-/**************************************************************************************************************************************************************
- * public SimpleSNMP support functions
- **************************************************************************************************************************************************************/
+///////////////////////////////////////////////////////////////////////////
+// Constructor, initialise default values and use a transport set up by the caller
+// The transport must already be listening and must outlast this object
+// With no transport the object only holds a registry for workers to share, action() does nothing
+///////////////////////////////////////////////////////////////////////////
+SimpleSNMP::SimpleSNMP(SnmpTransport *snmpTransport)
+{
+    initialise(snmpTransport);
+}
 
 ///////////////////////////////////////////////////////////////////////////
-// Constructor, initialise efault values
+// Constructor for a worker that serves the registry of another instance, on Linux each worker thread has it's own
+// Requests are parsed and answered with this object's buffers, the oids and functions come from registry
+// registry's oids must all be registered first, once it's shared it can't be changed and the value caches aren't used
+// The community names, priority managers and rate limits are copied from registry
 ///////////////////////////////////////////////////////////////////////////
-SimpleSNMP::SimpleSNMP(void)
+SimpleSNMP::SimpleSNMP(SnmpTransport *snmpTransport, SimpleSNMP *registry)
+{
+    initialise(snmpTransport);
+    nodes = registry->nodes; // Use the shared registry, it isn't ours to change or delete
+    nodeCount = registry->nodeCount;
+    nodeCapacity = registry->nodeCount;
+    ownRegistry = false;
+    registryShared = true;
+    registry->registryShared = true;
+    registry->mibRegistry = false; // Can't be copied now we're using it
+    strcpy(ROcommunity, registry->ROcommunity);
+    strcpy(RWcommunity, registry->RWcommunity);
+    for (byte i = 0; i < registry->priorityManagerCount; i++)
+        priorityManagers[i] = registry->priorityManagers[i];
+    priorityManagerCount = registry->priorityManagerCount;
+#if SNMP_RATE_SOURCES
+    setRateLimit(registry->sourceRate, registry->sourceBurst, registry->globalRate);
+#endif
+    if (registry->nodeHits) // Statistics are exported, the worker counts the requests it answers
+        nodeHits = new uint32_t[nodeCount]();
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Returns the instance processing the current request, NULL if there isn't one
+// Read and write functions for a registry shared by several workers use this in place of a global instance
+///////////////////////////////////////////////////////////////////////////
+SimpleSNMP *SimpleSNMP::serving(void)
+{
+    return servingAgent;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sets a function that can supply a registered oid's value in place of it's read function, eg per device values in a simulator
+// lookup is passed context and the asn.1 oid, it returns the encoded asn.1 value or NULL to call the read function as normal
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::setValueOverride(const byte *(*lookup)(void *context, const byte *oidasn1), void *context)
 {
-    head = NULL;                            // Initialise liked list
+    valueOverride = lookup;
+    overrideContext = context;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sets the default values, shared by the constructors
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::initialise(SnmpTransport *snmpTransport)
+{
+    transport = snmpTransport;
+    nodes = NULL;                           // Initialise the registry, allocated as oids are inserted
+    nodeCount = 0;
+    nodeCapacity = 0;
+    ownRegistry = true;
+    registryShared = false;
+    mibRegistry = false;
+    keyBlocks = NULL;
+    nodeHits = NULL; // Not counted until exportStatistics()
+#if SNMP_REGISTRY_POOL_SIZE
+    nodes = nodePool; // Fixed size registry, nothing is allocated
+    nodeCapacity = SNMP_REGISTRY_POOL_SIZE;
+    keyFree = keyPool;
+    keyEnd = keyPool + sizeof(keyPool);
+#else
+    keyFree = NULL; // Allocated as oids are inserted
+    keyEnd = NULL;
+#endif
+    responseEnd = NULL;                     // No response being built
+    for (byte i = 0; i < SNMP_RX_POOL_SIZE; i++) // All receive buffers are free
+        rxQueue[i].len = 0;
+    rxSeq = 0;
+    priorityManagerCount = 0;
+    actionMaxPackets = SNMP_ACTION_MAX_PACKETS;
+    actionMaxMicros = SNMP_ACTION_MAX_MICROS;
+    actionMaxShare = SNMP_ACTION_CPU_SHARE;
+    actionCredit = 0;
+    actionLastEnd = micros();
+#if SNMP_RATE_SOURCES
+    setRateLimit(SNMP_SOURCE_RATE, SNMP_SOURCE_BURST, SNMP_GLOBAL_RATE);
+#endif
+    responseDeferred = false;
+    requestEndpoint = 0;
+    valueOverride = NULL;
+    overrideContext = NULL;
+#if SNMP_DEFER_TABLE_SIZE
+    for (byte i = 0; i < SNMP_DEFER_TABLE_SIZE; i++) // No requests deferred
+        deferTable[i].id = 0;
+    deferSeq = 0;
+#endif
+#if SNMP_DEDUP_CACHE_SIZE
+    for (byte i = 0; i < SNMP_DEDUP_CACHE_SIZE; i++) // No responses kept yet
+        dedupCache[i].len = 0;
+    dedupNext = 0;
+#endif
+#if SNMP_NOTIFY_QUEUE_SIZE
+    notifyDestinationCount = 0;
+    for (byte i = 0; i < SNMP_NOTIFY_QUEUE_SIZE; i++) // Nothing to send
+        notifyQueue[i].len = 0;
+    notifyQueued = 0;
+    notifySeq = 0;
+    notifyRequestId = micros() & 0x3FFFFFFF; // So informs sent after a restart don't reuse the ids of the last run
+    notifyBurst = SNMP_NOTIFY_BURST;
+    notifyInterval = SNMP_NOTIFY_INTERVAL;
+#endif
+#if SNMP_REJECT_LOG_SIZE
+    rejectSeq = 0; // Nothing rejected yet
+    rejectRead = 0;
+#endif
+#if SNMP_STAGE_TIMING
+    resetStageTiming();
+#endif
     strcpy_P(ROcommunity, PSTR("public"));  // Default community names
     strcpy_P(RWcommunity, PSTR("private")); // Default community names
-    snmpudp.begin(161);                     // SNMP is always on port 161
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Destructor, stop the udp session
+// Destructor, stop the udp session if we started it and release the registry
 ///////////////////////////////////////////////////////////////////////////
 SimpleSNMP::~SimpleSNMP(void)
 {
-    snmpudp.flush();
-    snmpudp.stop();
+    if (transport)
+        transport->flush();
+#ifdef ARDUINO
+    if (transport == &wifiTransport)
+        wifiTransport.stop();
+#endif
+    while (keyBlocks) // Remove the encoded oid keys
+    {
+        snmpKeyBlock *next = keyBlocks->next;
+        delete[] (byte *)keyBlocks;
+        keyBlocks = next;
+    }
+    delete[] nodeHits; // Each instance has it's own counts
+    if (!ownRegistry) // A worker, the registry belongs to someone else
+        return;
+    for (uint16_t i = 0; i < nodeCount; i++)
+    {
+        if (nodes[i].cache) // Remove the value cache
+        {
+            delete[] nodes[i].cache->value;
+            delete nodes[i].cache;
+        }
+        delete nodes[i].table; // and the table description
+    }
+#if !SNMP_REGISTRY_POOL_SIZE
+    delete[] nodes; // Remove the registry
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -64,7 +232,8 @@ SimpleSNMP::~SimpleSNMP(void)
 ///////////////////////////////////////////////////////////////////////////
 void SimpleSNMP::setROcommunity(const char *name) // Set the RO community name
 {
-    strncpy_P(ROcommunity, name, MAX_COMSTR_SIZE);
+    strncpy_P(ROcommunity, name, MAX_COMSTR_SIZE - 1);
+    ROcommunity[MAX_COMSTR_SIZE - 1] = '\0'; // Make sure it's terminated, it's compared against the received community
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -72,7 +241,8 @@ void SimpleSNMP::setROcommunity(const char *name) // Set the RO community name
 ///////////////////////////////////////////////////////////////////////////
 void SimpleSNMP::setRWcommunity(const char *name) // Set the RW community name
 {
-    strncpy_P(RWcommunity, name, MAX_COMSTR_SIZE);
+    strncpy_P(RWcommunity, name, MAX_COMSTR_SIZE - 1);
+    RWcommunity[MAX_COMSTR_SIZE - 1] = '\0'; // Make sure it's terminated, it's compared against the received community
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -86,117 +256,1062 @@ byte SimpleSNMP::getUserData(byte *asn, byte *buff, byte len)
 
 ///////////////////////////////////////////////////////////////////////////
 // Main loop() function, needs to be called regularly from main()
-// Checks  if a frame has been received and processes it if found
+// Moves any received frames into the ingress queue then processes them, highest priority first
+// Stops after the packet or time budget set by setActionBudget(), anything left is processed on the next call
 ///////////////////////////////////////////////////////////////////////////
 void SimpleSNMP::action(void)
 {
-    int packetSize = snmpudp.parsePacket();
-
-    if (packetSize)
+    if (!transport) // Only holding a registry
+        return;
+    unsigned long start = micros();
+    if (actionMaxShare < 100) // Earn processing time for the time the rest of loop() has had since the last call
+    {
+        unsigned long idle = start - actionLastEnd;
+        if (idle > SNMP_ACTION_CREDIT_MAX * 100UL) // Enough to fill the credit at any share, keeps the sum within 32 bits
+            idle = SNMP_ACTION_CREDIT_MAX * 100UL;
+        actionCredit += idle * actionMaxShare / (100 - actionMaxShare);
+        if (actionCredit > SNMP_ACTION_CREDIT_MAX)
+            actionCredit = SNMP_ACTION_CREDIT_MAX;
+    }
+    // Timed with the requests, their time comes out of the same budget and credit
+#if SNMP_DEFER_TABLE_SIZE
+    sendDeferredResponses(); // Answers to deferred requests, or their timeouts
+#endif
+#if SNMP_NOTIFY_QUEUE_SIZE
+    if (notifyQueued)
+        sendNotifications(); // Traps and informs, they go out with the responses when the transport batches
+#endif
+    for (byte served = 0; served < actionMaxPackets; served++)
     {
-        snmpPacketsRecv++;                                  // increment packet count
-        byte *packetBuffer = new byte[packetSize + 1];      // Add one to size just in case
-        int rxlen = snmpudp.read(packetBuffer, packetSize); // Read incoming data
+        if (actionMaxShare < 100 && (long)(micros() - start) >= actionCredit) // loop()'s share is used up, the requests wait in the udp stack
+            break;
+        receivePackets(); // Top up the queue, a higher priority request may have arrived
+        int slot = nextQueued();
+        if (slot < 0) // Nothing waiting
+            break;
+        processPacket(slot);
+        if (actionMaxMicros && micros() - start >= actionMaxMicros)
+            break;
+    }
+    transport->flush(); // Send any responses the transport is batching
+    unsigned long end = micros();
+    if (actionMaxShare < 100)
+        actionCredit -= end - start;
+    actionLastEnd = end;
+#if SNMP_REJECT_LOG_SIZE && SNMP_LOG_LEVEL >= SNMP_LOG_WARN
+    if (!snmpQueueDepth && rejectRead != rejectSeq) // Only when there's nothing waiting, and one at a time so a flood can't hold up loop()
+        logRejected();
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sets how much work each call to action() can do
+// maxPackets is the most requests processed per call, maxMicros stops it early once that many microseconds have been used, 0 for no time limit
+// maxShare is the most percent of the time action() spends processing requests, the time between calls earns it time to use so the rest
+// of loop() keeps at least 100 - maxShare percent under a flood, 100 for no limit
+// At least one waiting request is always processed, unless maxShare is used up
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::setActionBudget(byte maxPackets, unsigned long maxMicros, byte maxShare)
+{
+    actionMaxPackets = maxPackets ? maxPackets : 1;
+    actionMaxMicros = maxMicros;
+    actionMaxShare = maxShare == 0 ? 1 : maxShare > 100 ? 100 : maxShare;
+    actionCredit = 0;
+}
+
+#if SNMP_RATE_SOURCES
+///////////////////////////////////////////////////////////////////////////
+// Sets the admission control applied to each packet as it's received, before it's queued or parsed
+// sourceRate is the packets per second accepted from each source address, after a burst of sourceBurst, 0 for no limit
+// globalRate is the packets per second accepted from all sources together, up to a second's worth back to back, 0 for no limit
+// Up to SNMP_RATE_SOURCES sources are tracked, the least recently seen is replaced by a new one, priority managers aren't limited
+// Packets over a limit are dropped without being parsed or answered and counted in snmpRateDrops or snmpGlobalRateDrops
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::setRateLimit(uint16_t perSource, uint16_t burst, uint16_t total)
+{
+    sourceRate = perSource;
+    sourceBurst = burst ? burst : 1;
+    globalRate = total;
+    for (byte i = 0; i < SNMP_RATE_SOURCES; i++) // Every source starts again with a full bucket
+        rateBuckets[i].ip = 0;
+    globalTokens = (uint32_t)globalRate * 1000;
+    globalLast = millis();
+}
 
-        SNMP_PARSE_STAT_CODES parse_error = parsepdu(packetBuffer, rxlen); // Parse the pdu and check data is a valid snmp record, store relevant fields into public variables
-        if (parse_error == SNMP_PACKET_SUCCESS)
+///////////////////////////////////////////////////////////////////////////
+// Decides whether a received packet is processed, takes a token from the source's bucket then from the global bucket
+// The source table is a hash table, a source is held in one of the SNMP_RATE_PROBE entries from the one it hashes to
+// A new source replaces the least recently seen of them and starts with a full bucket
+// Returns false if the packet is to be dropped
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::admitPacket(IPAddress ip)
+{
+    if (!sourceRate && !globalRate)
+        return true;
+    for (byte i = 0; i < priorityManagerCount; i++) // Managers that matter are never held back
+    {
+        if (priorityManagers[i] == ip)
+            return true;
+    }
+    unsigned long now = millis();
+    if (sourceRate)
+    {
+        uint32_t addr = (uint32_t)ip;
+        byte first = ((uint32_t)(addr * 2654435761u) >> 24) % SNMP_RATE_SOURCES; // Multiplicative hash, spreads the addresses of a subnet
+        snmpRateBucket *bucket = NULL;
+        snmpRateBucket *oldest = NULL;
+        for (byte i = 0; i < SNMP_RATE_PROBE && i < SNMP_RATE_SOURCES; i++)
         {
-            oid2char(); // Store oid decode into gpbuff
-            switch (workingpdu.requesttype)
+            snmpRateBucket *entry = rateBuckets + (first + i) % SNMP_RATE_SOURCES;
+            if (entry->ip == addr)
             {
-            case SNMP_TYPECODE_GETREQ:
-            case SNMP_TYPECODE_GETBULKREQ:
-                processGetRequest((const char *)gpbuff); // search list for oid matching received values and call processing function attached
-                break;
-            case SNMP_TYPECODE_GETNEXTREQ:
-                processGetNextRequest((const char *)gpbuff); // search list for oid matching received values and call processing function attached
-                break;
-            case SNMP_TYPECODE_GSETREQ:
-                processSetRequest((const char *)gpbuff); // search list for oid matching received values and call processing function attached
-                break;
-            default:
+                bucket = entry;
                 break;
             }
+            if (!oldest || !entry->ip || (oldest->ip && now - entry->last > now - oldest->last)) // Unused, or seen longest ago
+                oldest = entry;
         }
-        else
+        if (!bucket) // A new source, or one that's been replaced since it was seen
+        {
+            bucket = oldest;
+            bucket->ip = addr;
+            bucket->tokens = (uint32_t)sourceBurst * 1000;
+            bucket->last = now;
+        }
+        if (!takeToken(&bucket->tokens, &bucket->last, sourceRate, sourceBurst, now))
         {
-            myLog_P(PSTR("Receive packet rejected (error %d) %s\r\n"), parse_error, FPSTR(getErrorText(parse_error)));
-            dumpRaw(packetBuffer);
-            dumpData(packetBuffer, rxlen, 1); // list fields
+            snmpRateDrops++;
+            return false;
         }
-        memset(&workingpdu, 0, sizeof(workingpdu)); // Remove all links to the rx data buffer
-        delete[] packetBuffer;                      // Remove the rx data buffer
     }
+    if (globalRate && !takeToken(&globalTokens, &globalLast, globalRate, globalRate, now))
+    {
+        snmpGlobalRateDrops++;
+        return false;
+    }
+    return true;
 }
 
-///////////////////////////////////////////////////
-// Send response functions
-///////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////
+// Adds the tokens earned since the bucket was last refilled, up to burst, and takes one if there's a whole one
+// Tokens are kept in 1/1000ths so a rate of n packets a second adds n each ms
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::takeToken(uint32_t *tokens, unsigned long *last, uint16_t rate, uint16_t burst, unsigned long now)
+{
+    unsigned long elapsed = now - *last;
+    if (elapsed > 60000) // Long enough to fill any bucket, keeps the sum within 32 bits
+        elapsed = 60000;
+    *last = now;
+    *tokens += elapsed * rate;
+    if (*tokens > (uint32_t)burst * 1000)
+        *tokens = (uint32_t)burst * 1000;
+    if (*tokens < 1000)
+        return false;
+    *tokens -= 1000;
+    return true;
+}
+#endif
 
-void SimpleSNMP::sendResponse(char value) // Sends a byte
+///////////////////////////////////////////////////////////////////////////
+// Adds a manager whose get requests are processed ahead of other requests
+// Returns false if the list of priority managers is full
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::addPriorityManager(IPAddress ip)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 1);
+    if (priorityManagerCount >= SNMP_MAX_PRIORITY_MANAGERS)
+        return false;
+    priorityManagers[priorityManagerCount++] = ip;
+    return true;
 }
-void SimpleSNMP::sendResponse(byte value) // Sends a byte
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reads waiting frames into free receive buffers and queues them by priority
+// When every buffer is in use the frame is peeked at, it replaces the newest queued request of the lowest class below it's own
+// A frame that can't replace anything, or can't be peeked at, is left with the udp stack until there's room
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::receivePackets(void)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 1);
+    for (byte n = 0; n < SNMP_RX_POOL_SIZE; n++) // Bounded so a flood can't keep us here
+    {
+        int slot = -1;
+        bool lower = false; // set if a queued request could be replaced by a higher priority one
+        for (byte i = 0; i < SNMP_RX_POOL_SIZE; i++)
+        {
+            if (!rxQueue[i].len)
+                slot = i;
+            else if (rxQueue[i].priority > SNMP_PRIORITY_HIGH)
+                lower = true;
+        }
+        if (slot < 0 && !lower) // Queue full of the highest priority requests, leave the frame where it is
+            return;
+
+        int packetSize = transport->available();
+        if (packetSize <= 0)
+            return;
+        if (packetSize > SNMP_MAX_PACKET_SIZE) // Too big for the receive buffers, drop it
+        {
+            IPAddress ip;
+            uint16_t port;
+            transport->receive(NULL, 0, &ip, &port);
+            snmpPacketsRecv++;
+            snmpPacketsOversize++;
+            continue;
+        }
+#if SNMP_RATE_SOURCES
+        bool admitted = false; // set once the rate limits have been checked
+#endif
+        if (slot < 0) // Queue full, only a request of a lower class than this one can make room
+        {
+            byte head[SNMP_PEEK_SIZE];
+            IPAddress ip;
+            int len = transport->peek(head, sizeof(head), &ip);
+            if (len < 0)
+                return;
+            byte priority = getPriority(head, len, ip);
+            int victim = -1; // newest request of the lowest class below the frame's
+            for (byte i = 0; i < SNMP_RX_POOL_SIZE; i++)
+            {
+                if (rxQueue[i].priority > priority &&
+                    (victim < 0 || rxQueue[i].priority > rxQueue[victim].priority ||
+                     (rxQueue[i].priority == rxQueue[victim].priority && (uint16_t)(rxQueue[i].seq - rxQueue[victim].seq) < 0x8000)))
+                    victim = i;
+            }
+            if (victim < 0) // Nothing it can replace, equal classes are answered in arrival order
+                return;
+#if SNMP_RATE_SOURCES
+            if (!admitPacket(ip)) // Over a rate limit, it mustn't cost a queued request it's place
+            {
+                uint16_t port;
+                transport->receive(NULL, 0, &ip, &port);
+                snmpPacketsRecv++;
+                continue;
+            }
+            admitted = true;
+#endif
+            slot = victim;
+            snmpQueueDrops++;
+            snmpQueueDepth--;
+        }
+        snmpPacketsRecv++; // increment packet count
+        snmpRxEntry *entry = rxQueue + slot;
+        SNMP_TIMING_START(receiveStart);
+        entry->len = transport->receive(rxPool[slot], SNMP_MAX_PACKET_SIZE, &entry->ip, &entry->port); // Read incoming data
+        SNMP_TIMING_STOP(SNMP_STAGE_RECEIVE, receiveStart);
+        if (!entry->len)
+            continue;
+#if SNMP_RATE_SOURCES
+        if (!admitted && !admitPacket(entry->ip)) // Over a rate limit, dropped before it's parsed
+        {
+            entry->len = 0;
+            continue;
+        }
+#endif
+        entry->endpoint = transport->endpoint();
+        entry->priority = getPriority(rxPool[slot], entry->len, entry->ip);
+        entry->seq = rxSeq++;
+        if (++snmpQueueDepth > snmpQueueMaxDepth)
+            snmpQueueMaxDepth = snmpQueueDepth;
+    }
 }
-void SimpleSNMP::sendResponse(int16_t value) // Sends a byte
+
+///////////////////////////////////////////////////////////////////////////
+// Returns the receive buffer holding the next request to process, the highest priority then the oldest
+// Returns -1 if the queue is empty
+///////////////////////////////////////////////////////////////////////////
+int SimpleSNMP::nextQueued(void)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 2);
+    int next = -1;
+    for (byte i = 0; i < SNMP_RX_POOL_SIZE; i++)
+    {
+        if (!rxQueue[i].len)
+            continue;
+        if (next < 0 || rxQueue[i].priority < rxQueue[next].priority ||
+            (rxQueue[i].priority == rxQueue[next].priority && (uint16_t)(rxQueue[next].seq - rxQueue[i].seq) < 0x8000))
+            next = i;
+    }
+    return next;
 }
-void SimpleSNMP::sendResponse(uint16_t value) // Sends an unsigned int
+
+///////////////////////////////////////////////////////////////////////////
+// Works out the priority class of a received frame from the request type and where it came from
+// Set requests, and get requests from a priority manager, go first.  Getnext and getbulk requests, ie walks, go last
+///////////////////////////////////////////////////////////////////////////
+byte SimpleSNMP::getPriority(byte *pdu, uint16_t len, IPAddress ip)
+{
+    byte type = peekRequestType(pdu, len);
+    if (type == SNMP_TYPECODE_GSETREQ || type == SNMP_TYPECODE_GETRESPONSE) // A response acknowledges an inform, it's quick and frees the queue
+        return SNMP_PRIORITY_HIGH;
+    if (type == SNMP_TYPECODE_GETNEXTREQ || type == SNMP_TYPECODE_GETBULKREQ)
+        return SNMP_PRIORITY_BULK;
+    for (byte i = 0; i < priorityManagerCount; i++)
+    {
+        if (priorityManagers[i] == ip)
+            return SNMP_PRIORITY_HIGH;
+    }
+    return SNMP_PRIORITY_NORMAL;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Returns the pdu type of a received frame without parsing the rest of it, ie skips the version and community string fields
+// Returns SNMP_TYPECODE_NOTSET if the frame is too short, it's rejected properly when it's parsed
+///////////////////////////////////////////////////////////////////////////
+byte SimpleSNMP::peekRequestType(byte *pdu, uint16_t len)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 2);
+    byte *end = pdu + len;
+    uint16_t flen;
+    byte *pos = readASNhdr(pdu, end, &flen);        // Step into the message
+    for (byte field = 0; field < 2 && pos; field++) // over the version and community string
+    {
+        pos = readASNhdr(pos, end, &flen);
+        if (pos)
+            pos += flen;
+    }
+    if (!pos || pos >= end)
+        return SNMP_TYPECODE_NOTSET;
+    return pos[0];
 }
-void SimpleSNMP::sendResponse(int32_t value) // Sends an int
+
+///////////////////////////////////////////////////////////////////////////
+// Processes the request in a receive buffer and sends the response, then frees the buffer
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::processPacket(int slot)
+{
+    byte *packetBuffer = rxPool[slot];
+    uint16_t rxlen = rxQueue[slot].len;
+    servingAgent = this;
+    requestIP = rxQueue[slot].ip; // Responses go back to where the request came from
+    requestPort = rxQueue[slot].port;
+    requestEndpoint = rxQueue[slot].endpoint;
+    transport->setEndpoint(requestEndpoint);
+    snmpQueueDepth--;
+
+#if SNMP_NOTIFY_QUEUE_SIZE
+    if (peekRequestType(packetBuffer, rxlen) == SNMP_TYPECODE_GETRESPONSE) // A manager acknowledging an inform
+    {
+        snmpInPdus[SNMP_TYPECODE_GETRESPONSE & 7]++;
+        receiveInformResponse(packetBuffer, rxlen);
+        rxQueue[slot].len = 0;
+        return;
+    }
+#endif
+
+#if SNMP_DEDUP_CACHE_SIZE
+    uint32_t rxhash = hashPacket(packetBuffer, rxlen);
+    requestHash = rxhash; // Kept with a deferred request
+    requestLen = rxlen;
+    if (sendDuplicateResponse(rxhash, rxlen)) // A retransmit of a request already answered, send the same response again without processing it
+    {
+        snmpPacketsRetransmit++;
+        rxQueue[slot].len = 0; // Return the rx data buffer to the pool
+        return;
+    }
+#endif
+
+    SNMP_TIMING_START(requestStart);
+    SNMP_PARSE_STAT_CODES parse_error = parsepdu(packetBuffer, rxlen); // Parse the pdu and check data is a valid snmp record, store relevant fields into public variables
+    SNMP_TIMING_STOP(SNMP_STAGE_PARSE, requestStart);
+#if SNMP_DEFER_TABLE_SIZE
+    if (parse_error == SNMP_PACKET_SUCCESS && isDeferred()) // A retransmit of a deferred request, it's answered when the request completes
+    {
+        snmpPacketsRetransmit++;
+        memset(&workingpdu, 0, sizeof(workingpdu));
+        rxQueue[slot].len = 0;
+        return;
+    }
+#endif
+    if (parse_error == SNMP_PACKET_SUCCESS && !beginResponse()) // Start the response frame, the oid support functions add the values to it
+        parse_error = SNMP_PACKET_INVALID;                      // request fields too long to echo in the response headers
+    snmpParseResults[parse_error]++;
+    if (parse_error == SNMP_PACKET_SUCCESS)
+    {
+        snmpInPdus[workingpdu.requesttype & 7]++;
+        responseDeferred = false;
+#if SNMP_STAGE_TIMING
+        callbackCycles = 0;
+#endif
+        SNMP_TIMING_START(lookupStart);
+        switch (workingpdu.requesttype)
+        {
+        case SNMP_TYPECODE_GETREQ:
+            processGetRequest(); // search registry for each oid in the varbind list and call processing function attached
+            break;
+        case SNMP_TYPECODE_GETBULKREQ:
+            processGetBulkRequest(); // repeated getnext requests on the received varbind list
+            break;
+        case SNMP_TYPECODE_GETNEXTREQ:
+            processGetNextRequest(); // search registry for the oid following each oid in the varbind list and call processing function attached
+            break;
+        case SNMP_TYPECODE_GSETREQ:
+            processSetRequest(); // search registry for each oid in the varbind list and call the write function attached
+            break;
+        default:
+            break;
+        }
+#if SNMP_STAGE_TIMING
+        recordStage(SNMP_STAGE_LOOKUP, ESP.getCycleCount() - lookupStart - callbackCycles); // The library's share, the read and write functions are timed separately
+#endif
+        if (responseErrorStatus == SNMP_NOERROR) // Values read or written, counted for the snmp group
+        {
+            if (workingpdu.requesttype == SNMP_TYPECODE_GSETREQ)
+                snmpInTotalSetVars += responseVarbinds;
+            else
+                snmpInTotalReqVars += responseVarbinds;
+        }
+        byte *response;
+        SNMP_TIMING_START(headersStart);
+        uint16_t len = finishResponse(&response); // Add the headers, stops any further values being added
+        SNMP_TIMING_STOP(SNMP_STAGE_HEADERS, headersStart);
+        if (!responseDeferred)                    // A deferred response is sent when the request completes
+        {
+            sendResponseBuffer(response, len); // Send the response with all the varbinds, or the error
+#if SNMP_DEDUP_CACHE_SIZE
+            storeDuplicateResponse(rxhash, rxlen, response, len); // Keep it in case the request is retransmitted
+#endif
+        }
+        responseDeferred = false;
+        SNMP_TIMING_STOP(SNMP_STAGE_REQUEST, requestStart);
+    }
+    else
+    {
+        if (parse_error == SNMP_COMMUNITYSTRING_NOT_MATCHED && workingpdu.requesttype == SNMP_TYPECODE_GSETREQ && checkROcomstr())
+            snmpInBadCommunityUses++; // A known community, just not one that can write
+#if SNMP_REJECT_LOG_SIZE
+        storeRejected(parse_error, packetBuffer, rxlen); // Logged later by action(), or read with readRejected()
+#endif
+    }
+    memset(&workingpdu, 0, sizeof(workingpdu)); // Remove all links to the rx data buffer
+    rxQueue[slot].len = 0;                      // Return the rx data buffer to the pool
+}
+
+#if SNMP_REJECT_LOG_SIZE
+///////////////////////////////////////////////////////////////////////////
+// Keeps a rejected packet in the reject log, replacing the oldest one
+// Nothing is logged here, a flood of bad packets only costs a copy of the start of each one
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::storeRejected(byte error, const byte *packet, uint16_t len)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 4);
+    SnmpRejectedPacket *entry = &rejectLog[++rejectSeq % SNMP_REJECT_LOG_SIZE];
+    entry->seq = rejectSeq;
+    entry->time = millis();
+    entry->ip = (uint32_t)requestIP;
+    entry->port = requestPort;
+    entry->len = len;
+    entry->error = error;
+    memcpy(entry->data, packet, len < SNMP_REJECT_CAPTURE ? len : SNMP_REJECT_CAPTURE);
 }
-void SimpleSNMP::sendResponse(uint32_t value) // Sends an unsigned int
+
+///////////////////////////////////////////////////////////////////////////
+// Copies the oldest rejected packet that hasn't been read yet into packet, so the log can be drained when it suits the application
+// Packets overwritten before they were read are skipped, packet->seq shows the gap
+// Returns false if there's nothing new, reading the log over snmp doesn't count as reading it
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::readRejected(SnmpRejectedPacket *packet)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 4);
+    if (rejectRead == rejectSeq)
+        return false;
+    if (rejectSeq - rejectRead > SNMP_REJECT_LOG_SIZE) // The oldest ones have been overwritten
+        rejectRead = rejectSeq - SNMP_REJECT_LOG_SIZE;
+    *packet = rejectLog[++rejectRead % SNMP_REJECT_LOG_SIZE];
+    return true;
 }
-void SimpleSNMP::sendResponse(int64_t value) // Sends an int
+
+#if SNMP_LOG_LEVEL >= SNMP_LOG_WARN
+///////////////////////////////////////////////////////////////////////////
+// Logs the oldest rejected packet that hasn't been read yet, called by action() when no requests are waiting
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::logRejected(void)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 8);
+    SnmpRejectedPacket packet;
+    if (!readRejected(&packet))
+        return;
+    IPAddress ip(packet.ip);
+    snmpLogWarn(PSTR("Receive packet rejected (error %d) %s, %u bytes from %d.%d.%d.%d:%u\r\n"), packet.error, FPSTR(getErrorText(packet.error)),
+                packet.len, ip[0], ip[1], ip[2], ip[3], packet.port);
+#if SNMP_LOG_LEVEL >= SNMP_LOG_DEBUG
+    dumpRaw(packet.data, packet.len < SNMP_REJECT_CAPTURE ? packet.len : SNMP_REJECT_CAPTURE); // The fields can't be listed, they failed validation
+#endif
 }
-void SimpleSNMP::sendResponse(uint64_t value) // Sends an unsigned int
+#endif
+#endif
+
+#if SNMP_DEDUP_CACHE_SIZE
+///////////////////////////////////////////////////////////////////////////
+// Returns a 32 bit FNV-1a hash of a received packet
+// The whole packet is hashed so the request id and the varbinds are both covered
+///////////////////////////////////////////////////////////////////////////
+uint32_t SimpleSNMP::hashPacket(const byte *buff, uint16_t len)
 {
-    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 8);
+    uint32_t hash = 2166136261UL;
+    for (uint16_t i = 0; i < len; i++)
+    {
+        hash ^= buff[i];
+        hash *= 16777619UL;
+    }
+    return hash;
 }
 
-// Send string response, PROGMEM friendly for source string
-void SimpleSNMP::sendResponse(char *value)
+///////////////////////////////////////////////////////////////////////////
+// Checks if the received packet is a retransmit of a recent request, ie the same request from the same address and port
+// Managers retransmit with the same request id when a response is slow so the response already sent is sent again
+// This stops a retransmitted set request being applied twice
+// Returns true if the response was resent
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::sendDuplicateResponse(uint32_t hash, uint16_t len)
 {
-    byte responseValueBuffer[MAX_OID_SIZE - 30];                          // Buffer used to build the response packet, allow space for version, comstr etc
-    responseValueBuffer[0] = SNMP_DATATYPE_OCTETSTRING;                   // type char string
-    responseValueBuffer[1] = strlen_P(value);                             // length for a byte value
-    strncpy_P((char *)responseValueBuffer + 2, value, MAX_OID_SIZE - 32); // Copy data into buffer, value can be in PROGMEM
-    buildResponseBuffer(gpbuff, responseValueBuffer);                     // Build the complete response frame
-    sendResponseBuffer(gpbuff);                                           // and send it
+    uint32_t ip = requestIP;
+    uint16_t port = requestPort;
+    for (byte i = 0; i < SNMP_DEDUP_CACHE_SIZE; i++)
+    {
+        snmpDedupEntry *entry = dedupCache + i;
+        if (entry->len && entry->hash == hash && entry->reqlen == len && entry->ip == ip && entry->port == port && entry->endpoint == requestEndpoint)
+        {
+            if (millis() - entry->time >= SNMP_DEDUP_TTL) // Too old, treat it as a new request
+            {
+                entry->len = 0;
+                return false;
+            }
+            sendResponseBuffer(entry->response, entry->len);
+            return true;
+        }
+    }
+    return false;
 }
 
-// Send an asn.1 type response, value needs to be an asn.1 formatted field, eg when sending an oid  response
-void SimpleSNMP::sendResponse(ASNTYPE *value)
+///////////////////////////////////////////////////////////////////////////
+// Keeps a copy of a response in case the request is retransmitted, replaces the oldest response kept
+// Responses larger than SNMP_DEDUP_RESPONSE_SIZE are not kept
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::storeDuplicateResponse(uint32_t hash, uint16_t reqlen, byte *response, uint16_t len)
 {
-    buildResponseBuffer(gpbuff, value); // Build the complete response frame
-    sendResponseBuffer(gpbuff);         // and send it
+    if (!len || len > SNMP_DEDUP_RESPONSE_SIZE)
+        return;
+    snmpDedupEntry *entry = dedupCache + dedupNext;
+    dedupNext = (dedupNext + 1) % SNMP_DEDUP_CACHE_SIZE;
+    entry->ip = requestIP;
+    entry->port = requestPort;
+    entry->endpoint = requestEndpoint;
+    entry->reqlen = reqlen;
+    entry->hash = hash;
+    entry->time = millis();
+    memcpy(entry->response, response, len);
+    entry->len = len;
 }
+#endif
 
-// Send an asn.1 type response, value needs to be an integer type
-void SimpleSNMP::sendResponse(long long value, SNMP_DATA_TYPE type)
+#if SNMP_DEFER_TABLE_SIZE
+///////////////////////////////////////////////////////////////////////////
+// Defers the response to the request being processed, called from a read or write function that can't answer straight away
+// The request details are saved so the function can return at once and answer later with completeResponse() or failResponse()
+// A deferred request not answered within SNMP_DEFER_TIMEOUT ms gets a genErr response
+// Only requests with a single varbind can be deferred, getbulk requests can't be deferred
+// Returns the handle to answer the request with, 0 if it can't be deferred
+///////////////////////////////////////////////////////////////////////////
+SnmpHandle SimpleSNMP::deferResponse(void)
 {
-    sendResponse(value, type, 0);
+    if (!responseEnd || valueAdded || responseDeferred || !workingpdu.oidasn1) // Not called from a read or write function
+        return 0;
+    if (workingpdu.requesttype == SNMP_TYPECODE_GETBULKREQ || workingpdu.vbcount > 1)
+        return 0;
+
+    snmpDeferred *entry = NULL;
+    for (byte i = 0; i < SNMP_DEFER_TABLE_SIZE && !entry; i++) // Find a free entry
+    {
+        if (!deferTable[i].id)
+            entry = deferTable + i;
+    }
+    if (!entry)
+    {
+        snmpDeferFull++;
+        return 0;
+    }
+
+    byte *oidasn1 = workingpdu.nextoidasn1 ? workingpdu.nextoidasn1 : workingpdu.oidasn1; // The oid the response carries
+    if (!saveASN1(entry->versionasn1, workingpdu.versionasn1, sizeof(entry->versionasn1)) ||
+        !saveASN1(entry->comstrasn1, workingpdu.comstrasn1, sizeof(entry->comstrasn1)) ||
+        !saveASN1(entry->reqidasn1, workingpdu.reqidasn1, sizeof(entry->reqidasn1)) ||
+        !saveASN1(entry->oidasn1, oidasn1, sizeof(entry->oidasn1)))
+        return 0;
+    entry->ip = requestIP;
+    entry->port = requestPort;
+    entry->endpoint = requestEndpoint;
+    entry->requesttype = workingpdu.requesttype;
+    entry->version = workingpdu.version;
+    entry->time = millis();
+    entry->state = SNMP_DEFER_PENDING;
+#if SNMP_DEDUP_CACHE_SIZE
+    entry->hash = requestHash;
+    entry->reqlen = requestLen;
+#endif
+    if (!++deferSeq) // Handles are never 0
+        deferSeq++;
+    entry->id = deferSeq;
+    responseDeferred = true; // The response to this request is sent when it's completed
+    return entry->id;
 }
-void SimpleSNMP::sendResponse(long long value, SNMP_DATA_TYPE type, byte length)
+
+///////////////////////////////////////////////////////////////////////////
+// Answers a deferred request with a value, can be called from anywhere in loop() including another read function
+// The response is sent by the next call to action()
+// Returns false if the handle has timed out or already been answered
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::completeResponse(SnmpHandle handle, const SnmpValue *value)
 {
-    // Serial.printf("%s: Type %d Value %lld\r\n", __func__, type, value);
-    byte responseValueBuffer[20]; // Buffer used to build the response packet, allow space for version, comstr etc
-    switch (type)
+    snmpDeferred *entry = findDeferred(handle);
+    if (!entry)
+        return false;
+    if (!encodeValue(value, entry->value, sizeof(entry->value))) // Can't send it, answer with an error
     {
-    case SNMP_DATATYPE_COUNTER32:
-        responseValueBuffer[0] = SNMP_DATATYPE_COUNTER32; // type coubnter32
+        entry->state = SNMP_DEFER_FAILED;
+        entry->error = SNMP_GENERR;
+        return true;
+    }
+    entry->state = SNMP_DEFER_COMPLETE;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Answers a deferred request with an error
+// Returns false if the handle has timed out or already been answered
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::failResponse(SnmpHandle handle, SNMP_ERROR_CODE errorno)
+{
+    snmpDeferred *entry = findDeferred(handle);
+    if (!entry)
+        return false;
+    entry->state = SNMP_DEFER_FAILED;
+    entry->error = errorno;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Returns the pending table entry for a handle, NULL if it isn't pending
+///////////////////////////////////////////////////////////////////////////
+snmpDeferred *SimpleSNMP::findDeferred(SnmpHandle handle)
+{
+    for (byte i = 0; handle && i < SNMP_DEFER_TABLE_SIZE; i++)
+    {
+        if (deferTable[i].id == handle && deferTable[i].state == SNMP_DEFER_PENDING)
+            return deferTable + i;
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Checks if a received request is a retransmit of a request that has been deferred, ie the same request id from the same address and port
+// The response will be sent when the request is completed so the retransmit is ignored
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::isDeferred(void)
+{
+    uint16_t len = getASNhdrlen(workingpdu.reqidasn1) + getASNlen(workingpdu.reqidasn1);
+    for (byte i = 0; i < SNMP_DEFER_TABLE_SIZE; i++)
+    {
+        snmpDeferred *entry = deferTable + i;
+        if (entry->id && entry->port == requestPort && entry->ip == requestIP && entry->endpoint == requestEndpoint && !memcmp(entry->reqidasn1, workingpdu.reqidasn1, len))
+            return true;
+    }
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sends the responses to deferred requests that have been answered and a genErr to any that have timed out
+// Called by action() before any new requests are processed
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::sendDeferredResponses(void)
+{
+    for (byte i = 0; i < SNMP_DEFER_TABLE_SIZE; i++)
+    {
+        snmpDeferred *entry = deferTable + i;
+        if (!entry->id)
+            continue;
+        if (entry->state == SNMP_DEFER_PENDING)
+        {
+            if (millis() - entry->time < SNMP_DEFER_TIMEOUT)
+                continue;
+            snmpDeferTimeouts++;
+            entry->state = SNMP_DEFER_FAILED;
+            entry->error = SNMP_GENERR;
+        }
+
+        workingpdu.versionasn1 = entry->versionasn1; // Rebuild the request context from the saved fields
+        workingpdu.comstrasn1 = entry->comstrasn1;
+        workingpdu.reqidasn1 = entry->reqidasn1;
+        workingpdu.oidasn1 = entry->oidasn1;
+        workingpdu.requesttype = entry->requesttype;
+        workingpdu.version = entry->version;
+        requestIP = entry->ip;
+        requestPort = entry->port;
+        requestEndpoint = entry->endpoint;
+        transport->setEndpoint(requestEndpoint);
+        if (beginResponse())
+        {
+            if (entry->state == SNMP_DEFER_COMPLETE && !addResponseValue(entry->value)) // Value can't be sent to this client
+            {
+                entry->state = SNMP_DEFER_FAILED;
+                entry->error = SNMP_GENERR;
+            }
+            if (entry->state == SNMP_DEFER_FAILED) // Return the oid with the error
+            {
+                byte nullValue[] = {SNMP_DATATYPE_NULL, 0x00};
+                responseErrorStatus = entry->error;
+                responseErrorIndex = 1;
+                appendVarbind(entry->oidasn1, nullValue);
+            }
+            byte *response;
+            uint16_t len = finishResponse(&response);
+            sendResponseBuffer(response, len);
+#if SNMP_DEDUP_CACHE_SIZE
+            storeDuplicateResponse(entry->hash, entry->reqlen, response, len); // Keep it in case the request is retransmitted
+#endif
+        }
+        memset(&workingpdu, 0, sizeof(workingpdu));
+        entry->id = 0; // Free the entry
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Copies an asn.1 object into dest if it fits in size bytes
+// Returns false if it's too large
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::saveASN1(byte *dest, byte *src, uint16_t size)
+{
+    uint16_t len = getASNhdrlen(src) + getASNlen(src);
+    if (len > size)
+        return false;
+    memcpy(dest, src, len);
+    return true;
+}
+#endif
+
+#if SNMP_NOTIFY_QUEUE_SIZE
+///////////////////////////////////////////////////////////////////////////
+// Adds a manager notifications are sent to, as snmp v2c traps or, if inform is set, informs that are sent again until they're acknowledged
+// community is the community string the notifications carry, it can be in PROGMEM
+// Returns false if the list of managers is full
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::addNotifyDestination(IPAddress ip, uint16_t port, const char *community, bool inform)
+{
+    if (notifyDestinationCount >= SNMP_MAX_NOTIFY_DESTINATIONS)
+        return false;
+    snmpNotifyDestination *dest = notifyDestinations + notifyDestinationCount++;
+    dest->ip = ip;
+    dest->port = port;
+    dest->inform = inform;
+    strncpy_P(dest->community, community, MAX_COMSTR_SIZE - 1);
+    dest->community[MAX_COMSTR_SIZE - 1] = '\0';
+    dest->tokens = notifyBurst;
+    dest->refillTime = millis();
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sets the rate limit applied to each manager, up to burst notifications are sent back to back then one every interval ms
+// Informs sent again count towards the limit, notifications held back wait in the queue
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::setNotifyRate(byte burst, unsigned long interval)
+{
+    notifyBurst = burst ? burst : 1;
+    notifyInterval = interval;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Queues a notification for every manager added with addNotifyDestination(), it's sent by action()
+// trapoid identifies the notification, eg "1.3.6.1.6.3.1.1.5.3" for linkDown, it's sent after sysUpTime as snmpTrapOID.0
+// varbinds are the values it carries, they're encoded straight away so they can be changed or go out of scope once this returns
+// A notification raised again before it has been sent to anyone replaces the one waiting, so a burst of the same alarm sends
+// only the latest values
+// Returns false if an oid isn't valid, the varbinds don't fit in SNMP_NOTIFY_SIZE bytes, or the queue is full
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::sendNotification(const char *trapoid, const SnmpVarbind *varbinds, byte count)
+{
+    static const byte sysUpTime[] PROGMEM = {SNMP_DATATYPE_OID, 8, 0x2B, 6, 1, 2, 1, 1, 3, 0};      // 1.3.6.1.2.1.1.3.0
+    static const byte snmpTrapOID[] PROGMEM = {SNMP_DATATYPE_OID, 10, 0x2B, 6, 1, 6, 3, 1, 1, 4, 1, 0}; // 1.3.6.1.6.3.1.1.4.1.0
+    byte sysUpTimeOid[sizeof(sysUpTime)];
+    byte snmpTrapOIDOid[sizeof(snmpTrapOID)];
+    memcpy_P(sysUpTimeOid, sysUpTime, sizeof(sysUpTime));
+    memcpy_P(snmpTrapOIDOid, snmpTrapOID, sizeof(snmpTrapOID));
+
+    byte trapasn1[MAX_OID_SIZE];
+    byte oidbuff[MAX_OID_SIZE];
+    byte data[9];
+    uint16_t len;
+    if (!char2oid(trapoid, trapasn1) || !notifyDestinationCount)
+        return false;
+    byte uptime[9];
+    byte *uptimeData = encodeInteger(uptime + 9, (uint32_t)(millis() / 10), false); // timeticks are 1/100th seconds
+    uint16_t uptimeLen = uptime + 9 - uptimeData;
+    uint16_t size = getVarbindSize(sysUpTimeOid, uptimeLen) + getVarbindSize(snmpTrapOIDOid, trapasn1[1]);
+    for (byte i = 0; i < count; i++) // Check every varbind and add up the space they need
+    {
+        if (!char2oid(varbinds[i].oidtext, oidbuff) || !getValueData(&varbinds[i].value, data, &len))
+            return false;
+        size += getVarbindSize(oidbuff, len);
+    }
+    if (size > SNMP_NOTIFY_SIZE)
+        return false;
+
+    snmpNotification *entry = NULL;
+    for (byte i = 0; i < SNMP_NOTIFY_QUEUE_SIZE && !entry; i++) // The same notification still waiting for every manager is replaced
+    {
+        snmpNotification *queued = notifyQueue + i;
+        if (!queued->len || memcmp(queued->varbinds + queued->trapOid, trapasn1, trapasn1[1] + 2))
+            continue;
+        bool waiting = true;
+        for (byte d = 0; d < notifyDestinationCount; d++)
+            waiting = waiting && queued->delivery[d].state == SNMP_NOTIFY_WAITING;
+        if (waiting)
+        {
+            entry = queued;
+            snmpNotifyMerged++;
+        }
+    }
+    for (byte i = 0; i < SNMP_NOTIFY_QUEUE_SIZE && !entry; i++) // Otherwise a free entry
+    {
+        if (!notifyQueue[i].len)
+        {
+            entry = notifyQueue + i;
+            notifyQueued++;
+            entry->seq = notifySeq++;
+        }
+    }
+    if (!entry)
+    {
+        snmpNotifyDrops++;
+        return false;
+    }
+
+    byte *pos = entry->varbinds; // sysUpTime.0 and snmpTrapOID.0 come first, rfc 3416 4.2.6
+    pos = putVarbind(pos, sysUpTimeOid, SNMP_DATATYPE_TIMETICKS, uptimeData, uptimeLen);
+    pos += getASNhdrsize(uptimeLen) + uptimeLen;
+    pos = putVarbind(pos, snmpTrapOIDOid, SNMP_DATATYPE_OID, trapasn1 + 2, trapasn1[1]);
+    entry->trapOid = pos - entry->varbinds; // The value is the encoded trap oid
+    pos += 2 + trapasn1[1];
+    for (byte i = 0; i < count; i++)
+    {
+        const byte *value = getValueData(&varbinds[i].value, data, &len);
+        pos = putVarbind(pos, char2oid(varbinds[i].oidtext, oidbuff), varbinds[i].value.type, value, len);
+        pos += getASNhdrsize(len) + len;
+    }
+    entry->len = pos - entry->varbinds;
+    for (byte d = 0; d < SNMP_MAX_NOTIFY_DESTINATIONS; d++)
+    {
+        entry->delivery[d].state = d < notifyDestinationCount ? SNMP_NOTIFY_WAITING : SNMP_NOTIFY_DONE;
+        entry->delivery[d].retries = 0;
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sends queued notifications oldest first as each manager's rate limit allows, and sends informs again that haven't been acknowledged
+// An inform waits SNMP_INFORM_TIMEOUT ms for it's response, doubling after each retry, and is given up on after SNMP_INFORM_RETRIES retries
+// Called by action() before any new requests are processed
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::sendNotifications(void)
+{
+    unsigned long now = millis();
+    for (byte d = 0; d < notifyDestinationCount; d++) // Top up the rate limits
+    {
+        snmpNotifyDestination *dest = notifyDestinations + d;
+        if (dest->tokens >= notifyBurst)
+            dest->refillTime = now;
+        else if (!notifyInterval)
+            dest->tokens = notifyBurst;
+        else
+        {
+            unsigned long earned = (now - dest->refillTime) / notifyInterval;
+            if (earned)
+            {
+                dest->tokens = earned >= (unsigned long)(notifyBurst - dest->tokens) ? notifyBurst : dest->tokens + earned;
+                dest->refillTime += earned * notifyInterval;
+            }
+        }
+    }
+
+    byte order[SNMP_NOTIFY_QUEUE_SIZE]; // The queue in the order the notifications were raised
+    byte queued = 0;
+    for (byte i = 0; i < SNMP_NOTIFY_QUEUE_SIZE; i++)
+    {
+        if (!notifyQueue[i].len)
+            continue;
+        byte j = queued++;
+        for (; j > 0 && (uint16_t)(notifyQueue[order[j - 1]].seq - notifyQueue[i].seq) < 0x8000; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (byte n = 0; n < queued; n++)
+    {
+        snmpNotification *entry = notifyQueue + order[n];
+        bool done = true;
+        for (byte d = 0; d < notifyDestinationCount; d++)
+        {
+            snmpDelivery *delivery = entry->delivery + d;
+            if (delivery->state == SNMP_NOTIFY_SENT && now - delivery->time >= ((unsigned long)SNMP_INFORM_TIMEOUT << delivery->retries))
+            {
+                if (delivery->retries >= SNMP_INFORM_RETRIES) // No response, give up
+                {
+                    snmpInformFailures++;
+                    delivery->state = SNMP_NOTIFY_DONE;
+                }
+                else if (notifyDestinations[d].tokens)
+                {
+                    delivery->retries++;
+                    snmpInformRetries++;
+                    sendNotificationTo(entry, d);
+                }
+            }
+            else if (delivery->state == SNMP_NOTIFY_WAITING && notifyDestinations[d].tokens)
+                sendNotificationTo(entry, d);
+            if (delivery->state != SNMP_NOTIFY_DONE)
+                done = false;
+        }
+        if (done) // Delivered everywhere, or given up on
+        {
+            entry->len = 0;
+            notifyQueued--;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Sends a notification to one manager, the message is built in the response buffer around a copy of the varbinds
+// A retried inform keeps it's request id so the manager can tell it's a retransmit
+// Returns the transport send() result
+///////////////////////////////////////////////////////////////////////////
+bool SimpleSNMP::sendNotificationTo(snmpNotification *entry, byte dest)
+{
+    snmpNotifyDestination *manager = notifyDestinations + dest;
+    snmpDelivery *delivery = entry->delivery + dest;
+    if (!delivery->retries) // A new request id, always positive
+    {
+        notifyRequestId = ((uint32_t)notifyRequestId + 1) & 0x7FFFFFFF;
+        if (!notifyRequestId)
+            notifyRequestId = 1;
+        delivery->requestId = notifyRequestId;
+    }
+
+    byte *pos = txBuffer + SNMP_TX_HEADROOM; // The headers are written back to front in front of the varbinds, as for a response
+    byte *end = pos + entry->len;
+    memcpy(pos, entry->varbinds, entry->len);
+    pos = pushASNhdr(pos, SNMP_DATATYPE_VARBIND, entry->len); // varbind list
+    pos = pushInt(pos, 0);                                    // error index
+    pos = pushInt(pos, 0);                                    // error status
+    byte *id = encodeInteger(pos, (uint32_t)delivery->requestId, true);
+    pos = pushASNhdr(id, SNMP_DATATYPE_INTEGER, pos - id); // request id
+    pos = pushASNhdr(pos, manager->inform ? SNMP_TYPECODE_INFORMREQ : SNMP_TYPECODE_TRAPV2, end - pos);
+    uint16_t comlen = strlen(manager->community);
+    pos -= comlen;
+    memcpy(pos, manager->community, comlen);
+    pos = pushASNhdr(pos, SNMP_DATATYPE_OCTETSTRING, comlen); // community string
+    pos = pushInt(pos, 1);                                    // version, 1 is v2c
+    pos = pushASNhdr(pos, SNMP_DATATYPE_VARBIND, end - pos);  // SNMP message type = 0x30
+
+    manager->tokens--;
+    delivery->state = manager->inform ? SNMP_NOTIFY_SENT : SNMP_NOTIFY_DONE;
+    delivery->time = millis();
+    snmpNotifySent++;
+    snmpPacketsSent++;
+    transport->setEndpoint(0); // Notifications go out of the first endpoint
+    return transport->send(pos, end - pos, manager->ip, manager->port);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Checks a received response against the informs waiting to be acknowledged, the request id and the manager have to match
+// Anything that isn't a valid response to one of our informs is ignored
+///////////////////////////////////////////////////////////////////////////
+void SimpleSNMP::receiveInformResponse(byte *pdu, uint16_t len)
+{
+    byte *end = pdu + len;
+    uint16_t flen;
+    byte *pos = readASNhdr(pdu, end, &flen); // Step into the message
+    if (!pos || pdu[0] != SNMP_DATATYPE_VARBIND)
+        return;
+    pos = checkASN(pos, end, SNMP_DATATYPE_INTEGER, 1, 4);                 // over the version
+    pos = checkASN(pos, end, SNMP_DATATYPE_OCTETSTRING, 0, MAX_COMSTR_SIZE); // and the community string
+    byte *reqid = readASNhdr(pos, end, &flen);                             // into the response pdu
+    if (!reqid || !checkASN(reqid, end, SNMP_DATATYPE_INTEGER, 1, 4))
+        return;
+    int32_t id = decodeInt(reqid);
+    for (byte i = 0; i < SNMP_NOTIFY_QUEUE_SIZE; i++)
+    {
+        if (!notifyQueue[i].len)
+            continue;
+        for (byte d = 0; d < notifyDestinationCount; d++)
+        {
+            snmpDelivery *delivery = notifyQueue[i].delivery + d;
+            if (delivery->state == SNMP_NOTIFY_SENT && delivery->requestId == id && notifyDestinations[d].ip == requestIP &&
+                notifyDestinations[d].port == requestPort)
+            {
+                delivery->state = SNMP_NOTIFY_DONE; // The queue entry is freed by the next sendNotifications()
+                return;
+            }
+        }
+    }
+}
+#endif
+
+///////////////////////////////////////////////////
+// Send response functions
+///////////////////////////////////////////////////
+
+void SimpleSNMP::sendResponse(char value) // Sends a byte
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 1);
+}
+void SimpleSNMP::sendResponse(byte value) // Sends a byte
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 1);
+}
+void SimpleSNMP::sendResponse(int16_t value) // Sends a byte
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 2);
+}
+void SimpleSNMP::sendResponse(uint16_t value) // Sends an unsigned int
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 2);
+}
+void SimpleSNMP::sendResponse(int32_t value) // Sends an int
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 4);
+}
+void SimpleSNMP::sendResponse(uint32_t value) // Sends an unsigned int
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 4);
+}
+void SimpleSNMP::sendResponse(int64_t value) // Sends an int
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 8);
+}
+void SimpleSNMP::sendResponse(uint64_t value) // Sends an unsigned int
+{
+    sendResponse((long long)value, SNMP_DATATYPE_INTEGER, 8);
+}
+
+// Send string response, PROGMEM friendly for source string
+// The string is copied straight into the response frame, a string too long for the response gives a tooBig error
+void SimpleSNMP::sendResponse(char *value)
+{
+    addResponseValue(SNMP_DATATYPE_OCTETSTRING, (const byte *)value, strlen_P(value)); // Add it to the response frame, value can be in PROGMEM
+}
+
+// Send an asn.1 type response, value needs to be an asn.1 formatted field, eg when sending an oid  response
+void SimpleSNMP::sendResponse(ASNTYPE *value)
+{
+    addResponseValue(value); // Add it to the response frame
+}
+
+// Send an asn.1 type response, value needs to be an integer type
+void SimpleSNMP::sendResponse(long long value, SNMP_DATA_TYPE type)
+{
+    sendResponse(value, type, 0);
+}
+void SimpleSNMP::sendResponse(long long value, SNMP_DATA_TYPE type, byte length)
+{
+    // Serial.printf("%s: Type %d Value %lld\r\n", __func__, type, value);
+    byte responseValueBuffer[20]; // Buffer used to build the response packet, allow space for version, comstr etc
+    switch (type)
+    {
+    case SNMP_DATATYPE_COUNTER32:
+        responseValueBuffer[0] = SNMP_DATATYPE_COUNTER32; // type coubnter32
         responseValueBuffer[1] = 4;                       // data length
         responseValueBuffer[2] = (value >> 24) & 0xFF;
         responseValueBuffer[3] = (value >> 16) & 0xFF;
@@ -245,8 +1360,7 @@ void SimpleSNMP::sendResponse(long long value, SNMP_DATA_TYPE type, byte length)
     default:
         return;
     }
-    buildResponseBuffer(gpbuff, responseValueBuffer); // Build the complete response frame
-    sendResponseBuffer(gpbuff);                       // and send it
+    addResponseValue(responseValueBuffer); // Add it to the response frame
 }
 
 // Send an asn.1 type response, value needs to be an IP address object
@@ -260,8 +1374,7 @@ void SimpleSNMP::sendResponse(IPAddress value)
     responseValueBuffer[3] = value[1];
     responseValueBuffer[4] = value[2];
     responseValueBuffer[5] = value[3];
-    buildResponseBuffer(gpbuff, responseValueBuffer); // Build the complete response frame
-    sendResponseBuffer(gpbuff);                       // and send it
+    addResponseValue(responseValueBuffer); // Add it to the response frame
 }
 
 // Send an asn.1 type response, value needs to be a float
@@ -280,8 +1393,7 @@ void SimpleSNMP::sendResponse(float value)
     for (byte i = 0; i < 4; i++)
         responseValueBuffer[5 - i] = v.ival[i];
 
-    buildResponseBuffer(gpbuff, responseValueBuffer); // Build the complete response frame
-    sendResponseBuffer(gpbuff);                       // and send it
+    addResponseValue(responseValueBuffer); // Add it to the response frame
 }
 
 // Send an asn.1 type response, value needs to be a float
@@ -300,8 +1412,7 @@ void SimpleSNMP::sendResponse(double value)
     for (byte i = 0; i < 8; i++)
         responseValueBuffer[9 - i] = v.ival[i];
 
-    buildResponseBuffer(gpbuff, responseValueBuffer); // Build the complete response frame
-    sendResponseBuffer(gpbuff);                       // and send it
+    addResponseValue(responseValueBuffer); // Add it to the response frame
 }
 
 /**************************************************************************************************************************************************************
@@ -311,6 +1422,8 @@ void SimpleSNMP::sendResponse(double value)
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Locates the snmp data in the rxbuffer and stores pointers to each element into the workingpdu struct
 // pdu points to a complete received frame buffer formatted as asn.1 data.
+// The frame is read once front to back, every length is checked against the end of it's enclosing field before anything is read
+// so a truncated or hostile frame is rejected without reading outside the frame.  The varbind oids are indexed in vbindex as they're passed
 // Returns SUCCESS if all data present is validated otherwise returns an error code indicating the error
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 SNMP_PARSE_STAT_CODES SimpleSNMP::parsepdu(byte *pdu, uint16_t rxlen)
@@ -318,21 +1431,41 @@ SNMP_PARSE_STAT_CODES SimpleSNMP::parsepdu(byte *pdu, uint16_t rxlen)
     memset(&workingpdu, 0, sizeof(workingpdu)); // Initialie the index list
     workingpdu.rxdata = pdu;                    // Store a pointer to the start of the data, this can be used to validate we have a full buffer
 
-    if (pdu[0] != 0x30) // Check we got a snmp message type packet header, all snmp frames start with an 0x30
+    if (rxlen < 2 || pdu[0] != 0x30) // Check we got a snmp message type packet header, all snmp frames start with an 0x30
         return SNMP_PACKET_INVALID;
 
-    if (rxlen != pdu[1] + 2) // a valid asn.1 pdu will have the data type in byte[0] and the data length in byte[1] so byte[1] should equal the data read length
+    byte *end = pdu + rxlen;
+    uint16_t len;
+    byte *pos = readASNhdr(pdu, end, &len);
+    if (!pos || pos + len != end) // The message must fill the datagram exactly, truncated or padded frames are rejected
         return SNMP_LENGTH_PACKET_INVALID;
 
-    if (!getversion(pdu)) // extract SNMP version and store in global oid buffer
+    byte *next = checkASN(pos, end, SNMP_DATATYPE_INTEGER, 1, 4); // Version
+    if (!next)
+        return SNMP_PACKET_INVALID;
+    workingpdu.versionasn1 = pos;
+    workingpdu.version = decodeInt(pos) + 1; // 0 == version 1, 1 == version 2, 3 == version 3
+    if (workingpdu.version != 1 && workingpdu.version != 2)
         return SNMP_VERSION_NOT_SUPPORTED;
 
-    if (!getcomstr(pdu)) // extract community and store in global buffer
+    pos = next;
+    next = checkASN(pos, end, SNMP_DATATYPE_OCTETSTRING, 0, MAX_COMSTR_SIZE); // Community string
+    if (!next)
         return SNMP_COMSTR_NOT_FOUND;
+    workingpdu.comstrasn1 = pos;
 
-    getType(pdu); // extract the request type, the request id, the error & the error index fields
-    switch (workingpdu.requesttype)
+    pos = readASNhdr(next, end, &len); // Request pdu, it's the rest of the message
+    if (!pos || pos + len != end)
+        return SNMP_LENGTH_PACKET_INVALID;
+    workingpdu.requesttype = next[0];
+    switch (workingpdu.requesttype) // Check the community before going any further
     {
+    case SNMP_TYPECODE_GETBULKREQ:
+        if (workingpdu.version == 1) // getbulk is not part of snmp v1
+            return SNMP_REQTYPE_NOT_SUPPORTED;
+        if (!checkROcomstr())
+            return SNMP_COMMUNITYSTRING_NOT_MATCHED;
+        break;
     case SNMP_TYPECODE_GETREQ:
     case SNMP_TYPECODE_GETNEXTREQ:
         if (!checkROcomstr())
@@ -347,79 +1480,117 @@ SNMP_PARSE_STAT_CODES SimpleSNMP::parsepdu(byte *pdu, uint16_t rxlen)
         break;
     }
 
-    workingpdu.oidasn1 = workingpdu.rxdata; // Store start of data pointer, getoid() will update this or clear it.
-    if (!getoid(workingpdu.oidasn1))        // extract pointer to oid data field, also extracts user data if its a setreq
-        return SNMP_OID_NOT_FOUND;
+    workingpdu.reqidasn1 = pos; // request id, error status and error index, or non-repeaters and max-repetitions in a getbulkreq
+    workingpdu.errorasn1 = checkASN(workingpdu.reqidasn1, end, SNMP_DATATYPE_INTEGER, 1, 4);
+    workingpdu.erroridxasn1 = checkASN(workingpdu.errorasn1, end, SNMP_DATATYPE_INTEGER, 1, 4);
+    workingpdu.vblistasn1 = checkASN(workingpdu.erroridxasn1, end, SNMP_DATATYPE_INTEGER, 1, 4);
+    if (!workingpdu.vblistasn1)
+        return SNMP_PACKET_INVALID;
 
+    pos = readASNhdr(workingpdu.vblistasn1, end, &len); // Varbind list, it's the rest of the pdu
+    if (!pos || workingpdu.vblistasn1[0] != SNMP_DATATYPE_VARBIND || pos + len != end)
+        return SNMP_OID_NOT_FOUND;
+    while (pos < end) // Each varbind is an oid followed by a value and nothing else
+    {
+        byte *vbend = readASNhdr(pos, end, &len);
+        if (!vbend || pos[0] != SNMP_DATATYPE_VARBIND)
+            return SNMP_OID_NOT_FOUND;
+        byte *oidasn1 = vbend;
+        vbend += len;
+        byte *value = checkASN(oidasn1, vbend, SNMP_DATATYPE_OID, 1, MAX_OID_SIZE - 2); // Short form so the oid can be handled as oid[1] + 2 bytes
+        if (!value || (oidasn1[oidasn1[1] + 1] & 0x80))                              // The last sub identifier must be complete
+            return SNMP_OID_NOT_FOUND;
+        byte *data = readASNhdr(value, vbend, &len);
+        if (!data || data + len != vbend)
+            return SNMP_OID_NOT_FOUND;
+        if (workingpdu.vbcount == SNMP_MAX_REQUEST_VARBINDS)
+            return SNMP_TOO_MANY_VARBINDS;
+        vbindex[workingpdu.vbcount++] = oidasn1 - pdu;
+        pos = vbend;
+    }
+    if (!workingpdu.vbcount)
+        return SNMP_OID_NOT_FOUND;
+    selectVarbind(0); // The oid fields start at the first varbind
     return SNMP_PACKET_SUCCESS;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Returns a PROGMEM pointer to a text string for each error type
+// Reads the asn.1 header at pos, checking the header and the data field it describes both end by end
+// Long form lengths of up to two bytes are accepted, anything larger can't be in a datagram.  The indefinite form isn't allowed in snmp
+// Returns a pointer to the data field and sets len, NULL if the field is truncated or the header is invalid
 ///////////////////////////////////////////////////////////////////////////
-const char *snmpErrorText[] PROGMEM = {"SUCCESS", "INVALID", "LENGTH", "OID", "COMSTR", "VERSION", "REQUEST", "COMSTR"};
-const char *SimpleSNMP::getErrorText(byte errno) // Returns a pointer to the error text
+byte *SimpleSNMP::readASNhdr(byte *pos, byte *end, uint16_t *len)
 {
-    return snmpErrorText[errno];
+    if (!pos || end - pos < 2)
+        return NULL;
+    byte *data = pos + 2;
+    uint16_t flen = pos[1];
+    if (flen & 0x80) // long form, the low bits hold the number of length bytes that follow
+    {
+        byte count = flen & 0x7f;
+        if (count == 0 || count > 2 || end - data < count)
+            return NULL;
+        flen = 0;
+        for (byte i = 0; i < count; i++)
+            flen = (flen << 8) | *data++;
+    }
+    if (end - data < flen)
+        return NULL;
+    *len = flen;
+    return data;
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Checks the last received pdy against the RO community string
-// Returns true if they match
+// Checks the asn.1 field at pos is of type with a data field of minlen to maxlen bytes that ends by end
+// A maxlen under 128 also requires the short form, fields like the version and community string are read using asn[1] as their length
+// Returns a pointer to the following field, NULL if the field is invalid
 ///////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::checkROcomstr(void) // Checks the last received record for a community string match
+byte *SimpleSNMP::checkASN(byte *pos, byte *end, byte type, uint16_t minlen, uint16_t maxlen)
 {
-    return !strcmp(ROcommunity, decodeComStr());
+    uint16_t len;
+    byte *data = readASNhdr(pos, end, &len);
+    if (!data || pos[0] != type || len < minlen || len > maxlen)
+        return NULL;
+    if (maxlen < 0x80 && data != pos + 2)
+        return NULL;
+    return data + len;
 }
+
 ///////////////////////////////////////////////////////////////////////////
-// Checks the last received pdy against the RW community string
-// Returns true if they match
+// Returns a PROGMEM pointer to a text string for each error type
 ///////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::checkRWcomstr(void) // Checks the last received record for a community string match
+const char *snmpErrorText[] PROGMEM = {"SUCCESS", "INVALID", "LENGTH", "OID", "COMSTR", "VERSION", "REQUEST", "COMSTR", "VARBINDS"};
+const char *SimpleSNMP::getErrorText(byte errno) // Returns a pointer to the error text
 {
-    return !strcmp(RWcommunity, decodeComStr());
+    return snmpErrorText[errno];
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// extracts the snmp request type from a udp frame and stores it into the reqtype buffer
-// pdu points to a frame buffer formatted as asn.1 data.
-// Returns true for compatibility, should not be able to fail
+// Checks the last received pdy against the RO community string
+// Returns true if they match
 ///////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::getType(byte *pdu) // Gets the SNMP record type
+bool SimpleSNMP::checkROcomstr(void) // Checks the last received record for a community string match
 {
-    byte *phs = workingpdu.rxdata + workingpdu.rxdata[6] + 7; // PDU Header Start pointer
-    workingpdu.requesttype = phs[0];                          // request type byte
-    workingpdu.reqidasn1 = phs + 2;                           // request id starts 2 bytes beyond
-    workingpdu.errorasn1 = workingpdu.reqidasn1 + workingpdu.reqidasn1[1] + 2;
-    workingpdu.erroridxasn1 = workingpdu.errorasn1 + workingpdu.errorasn1[1] + 2;
-    return true;
+    return compareComStr(ROcommunity);
 }
-
 ///////////////////////////////////////////////////////////////////////////
-// extracts the snmp version number from a udp frame and siores it into the version buffer
-// pdu points to a frame buffer formatted as asn.1 data.
-// Returns true if it finds an acceptable version, ie version 1 or 2
+// Checks the last received pdy against the RW community string
+// Returns true if they match
 ///////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::getversion(byte *pdu)
+bool SimpleSNMP::checkRWcomstr(void) // Checks the last received record for a community string match
 {
-    bool versionOK = false;
-    workingpdu.versionasn1 = pdu + 2;
-    workingpdu.version = decodeInt(workingpdu.versionasn1) + 1;            // 0 == version 1, 1 == version 2, 4 == version 3
-    workingpdu.version = workingpdu.version == 4 ? 3 : workingpdu.version; // Fixup snmp version 3
-    if (workingpdu.version == 1 || workingpdu.version == 2)
-        versionOK = true;
-    return versionOK;
+    return compareComStr(RWcommunity);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// extracts the community string from a udp frame and siores it into the comstr buffer
-// pdu points to a frame buffer formatted as asn.1 data.
-// Returns true if it finds a valid community string
+// Compares the received asn.1 community string with a community name
+// The comparison is made in place in the rx buffer, nothing is copied or terminated
+// Returns true if they match
 ///////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::getcomstr(byte *pdu)
+bool SimpleSNMP::compareComStr(const char *name)
 {
-    workingpdu.comstrasn1 = workingpdu.rxdata + 5; // start of rxdata + 2 bytes for type field + 3 bytes for version field, next field should be the community string
-    return true;
+    byte len = workingpdu.comstrasn1[1];
+    return len == strlen(name) && !memcmp(workingpdu.comstrasn1 + 2, name, len);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -437,65 +1608,23 @@ char *SimpleSNMP::decodeComStr(byte *asn) // Returns a pointer to the community
 {
     if (!asn)
         return NULL;
-    if (workingpdu.comstrasn1[1])
-        strncpy((char *)gpbuff, (const char *)workingpdu.comstrasn1 + 2, workingpdu.comstrasn1[1]); // Copy community string
-    gpbuff[workingpdu.comstrasn1[1]] = 0x00;                                                        // NULL terminate the string
+    if (asn[1])
+        strncpy((char *)gpbuff, (const char *)asn + 2, asn[1]); // Copy community string
+    gpbuff[asn[1]] = 0x00;                                      // NULL terminate the string
     return (char *)gpbuff;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////
-// extracts the oid from a udp frame and stores it into the oid buffer
-// pdu points to a frame buffer formatted as asn.1 data.
-// If it's a compound data type then it is recursed into
-// If it's a primitive then it's ignored unless it's an oid in which case it's location is stored
-// Returns true if it finds a valid oid
-// Only processes the first primitive data field in a compound data type then returns
-// if it finds an oid and it's a setreq then it also stores the pointer to the value field
-//////////////////////////////////////////////////////////////////////////////////////
-bool SimpleSNMP::getoid(byte *oidasn1)
+// Converts an oid ASN.1 data field to a char string
+// Returns true if sucessfully converted
+// Stores output into gpbuff
+bool SimpleSNMP::oid2char(void)
+{
+    return oid2char(workingpdu.oidasn1);
+}
+bool SimpleSNMP::oid2char(byte *asn)
 {
-    bool found = false;
-
-    switch (oidasn1[0])
-    {
-    // compound data types, recurse into these
-    case SNMP_DATATYPE_VARBIND:
-    case SNMP_TYPECODE_GETNEXTREQ:
-    case SNMP_TYPECODE_GSETREQ:
-    case SNMP_TYPECODE_GETREQ:
-        found = getoid(oidasn1 + getASNhdrlen(oidasn1)); // Skip over other known data types
-        break;
-    // primitive data types, skip over these
-    case SNMP_DATATYPE_INTEGER:
-    case SNMP_DATATYPE_OCTETSTRING:
-    case SNMP_DATATYPE_NULL:
-        found = getoid(oidasn1 + getASNhdrlen(oidasn1) + getASNlen(oidasn1)); // Skip over other known data types
-        break;
-    // OID data type, process this
-    case SNMP_DATATYPE_OID:
-        workingpdu.oidasn1 = oidasn1;                                                       // Store pointer to oid field
-        if (workingpdu.requesttype == SNMP_TYPECODE_GSETREQ)                                // If it's a set request, user data field should immidietly follow the oid field
-            workingpdu.setvalueasn1 = oidasn1 + getASNhdrlen(oidasn1) + getASNlen(oidasn1); // set pointer to user data field
-        found = true;
-        break;
-    default:
-        workingpdu.oidasn1 = NULL; // clear oid pointer as we didn't find one
-        break;
-    }
-    return found;
-}
-
-// Converts an oid ASN.1 data field to a char string
-// Returns true if sucessfully converted
-// Stores output into gpbuff
-bool SimpleSNMP::oid2char(void)
-{
-    return oid2char(workingpdu.oidasn1);
-}
-bool SimpleSNMP::oid2char(byte *asn)
-{
-    bool result = true;         // Assume it works unless we get an error
-    char *oid = (char *)gpbuff; // Set up char pointer to make copying easier
+    bool result = true;         // Assume it works unless we get an error
+    char *oid = (char *)gpbuff; // Set up char pointer to make copying easier
 
     memset(gpbuff, 0, sizeof(gpbuff)); // Clear output buffer
 
@@ -530,12 +1659,14 @@ long SimpleSNMP::decodeOidInt(byte *pdu) // Decodes oid values, pdu points to th
     return rval;
 }
 
-byte SimpleSNMP::getASNlen(byte *asn) // Returns the data length value from an asn.1 buffer
+uint16_t SimpleSNMP::getASNlen(byte *asn) // Returns the data length value from an asn.1 buffer
 {
-    byte len = 1;               // allow for type byte
-    if (asn[1] & 0x80)          // offset if bit set
-        len += (asn[1] & 0x7f); // Add the number of offset bytes
-    return asn[len];
+    if (!(asn[1] & 0x80)) // short form, length is in the length byte
+        return asn[1];
+    uint16_t len = 0;                          // long form, the length byte holds the number of length bytes that follow
+    for (byte i = 0; i < (asn[1] & 0x7f); i++) // Accumulate the length bytes
+        len = (len << 8) | asn[2 + i];
+    return len;
 }
 
 byte SimpleSNMP::getASNhdrlen(byte *asn) // Returns the length of the header from an asn.1 buffer, ie type byte + length of length field
@@ -653,118 +1784,306 @@ double SimpleSNMP::decodeDouble(byte *asn) // Decodes multi byte integers, note
 // Send response functions
 ///////////////////////////////////////////////////
 
-void SimpleSNMP::sendErrorResponse(SNMP_ERROR_CODE errorno) // Sends an error response
+// Turns the response being built into an error response
+// errorindex is the 1 based position of the varbind that failed, 0 if it doesn't apply to a single varbind
+// Any values already added are removed and the received varbind list is returned unchanged, as required by rfc 3416
+// A tooBig error is returned with an empty varbind list
+void SimpleSNMP::sendErrorResponse(SNMP_ERROR_CODE errorno, byte errorindex) // Sends an error response
 {
-    workingpdu.errorasn1[2] = errorno;           // Set error type to 4 RO error
-    byte responseValueBuffer[2];                 // buffer to store the value field, 8 bytes for the long long then 2 for the type and length
-    responseValueBuffer[0] = SNMP_DATATYPE_NULL; // type integer
-    responseValueBuffer[1] = 0x00;               // length for a NULL value
-    sendResponse(responseValueBuffer);           // send no oid response error
+    if (!responseEnd) // No response being built
+        return;
+    responseErrorStatus = errorno;             // Set the error status in the response
+    responseErrorIndex = errorindex;           // and the error index that follows it
+    responseEnd = txBuffer + SNMP_TX_HEADROOM; // Remove the varbinds already added
+    responseVarbinds = 0;
+    if (errorno == SNMP_TOOBIG)
+        return;
+
+    byte *vb = workingpdu.vblistasn1 + getASNhdrlen(workingpdu.vblistasn1); // Copy the received varbinds, each ends with it's value
+    for (byte i = 0; i < workingpdu.vbcount; i++)
+    {
+        byte *value = varbindOid(i) + varbindOid(i)[1] + 2;
+        byte *vbend = value + getASNhdrlen(value) + getASNlen(value);
+        if (responseEnd + (vbend - vb) > responseLimit) // Won't fit, leave the varbind list incomplete
+            return;
+        memcpy(responseEnd, vb, vbend - vb);
+        responseEnd += vbend - vb;
+        responseVarbinds++;
+        vb = vbend;
+    }
 }
 
-// Builds the response frame
-// responsebuffer points to a buffer large enougth to hold the response
-// valueBuffer points to an ASN.1 formatted object holding the value to be returned.
-void SimpleSNMP::buildResponseBuffer(byte *responseBuffer, byte *valueBuffer) // Builds the snmp response frame at responsebuffer
+// Adds the value returned by an oid support function to the response frame
+// valueBuffer is an asn.1 encoded value field
+// Returns true if the value was added
+bool SimpleSNMP::addResponseValue(byte *valueBuffer)
 {
-    responseBuffer[0] = 0x30;                                                                     // SNMP message type = 0x30
-    responseBuffer[1] = 0;                                                                        // Length of type data
-    appendASN1(responseBuffer, workingpdu.versionasn1);                                           // add version
-    appendASN1(responseBuffer, workingpdu.comstrasn1);                                            // add community string
-    responseBuffer[1] += addSnmpResponsePDU(responseBuffer + responseBuffer[1] + 2, valueBuffer); // add response pdu, P1 = point to append to, ie start of request type object
+    return addResponseValue(valueBuffer[0], valueBuffer + getASNhdrlen(valueBuffer), getASNlen(valueBuffer));
 }
 
-// adds the response pdu to the end of the response buffer
-// valuebuffer is an ASN.1 formatted object containing the response data
-// responsebuffer points to the start of the new data
-// Does not update the parent length byte, updates it;s own length byte
-// Returns the length of the added data
-byte SimpleSNMP::addSnmpResponsePDU(byte *responseBuffer, byte *valueBuffer)
+// Adds the value returned by an oid support function to the response frame
+// The varbind oid is the next oid on a getnextreq or getbulkreq, otherwise the request oid
+// Only the first value added for each varbind is used
+// Returns true if the value was added, Counter64 values can't be sent to a v1 client so they set valueSkipped instead
+bool SimpleSNMP::addResponseValue(byte type, const byte *data, uint16_t len)
 {
-    responseBuffer[0] = 0xa2;                            // Response id type
-    responseBuffer[1] = 0x00;                            // data length
-    appendASN1(responseBuffer, workingpdu.reqidasn1);    // Append the request id field and updates the length
-    appendASN1(responseBuffer, workingpdu.errorasn1);    // Append the error field and updates the length
-    appendASN1(responseBuffer, workingpdu.erroridxasn1); // Append the error index field and updates the length
-    responseBuffer[1] += addSnmpVBlist(responseBuffer + responseBuffer[1] + 2, valueBuffer);
-    return responseBuffer[1] + 2; // Length of the pdu type obkect
+    if (!responseEnd || valueAdded) // No response being built or already answered
+        return false;
+    if (type == SNMP_DATATYPE_COUNTER64 && workingpdu.version == 1)
+    {
+        valueSkipped = true;
+        return false;
+    }
+    byte *oidasn1 = workingpdu.nextoidasn1 ? workingpdu.nextoidasn1 : workingpdu.oidasn1;
+    byte *value = appendVarbind(oidasn1, type, data, len);
+    if (!value)
+    {
+        responseFull = true; // flag that there's no more room in the response
+        return false;
+    }
+    workingpdu.getvalueasn1 = value; // Points into the response frame, valid until it's sent
+    valueAdded = true;
+    return true;
 }
 
-// Adds the VBlist pdu to the reponse buffer
-// Returns the length of the added data
-// Does not update the buffer length feild
-byte SimpleSNMP::addSnmpVBlist(byte *responseBuffer, byte *valueBuffer)
+// Encodes the value set by a value callback and adds it to the response frame
+// Returns false if the value type isn't supported
+bool SimpleSNMP::addResponseValue(const SnmpValue *value)
 {
-    responseBuffer[0] = 0x30;                                           // Response id type
-    responseBuffer[1] = addSnmpVBtype(responseBuffer + 2, valueBuffer); // Set length to the total length of the next varibind
-    return responseBuffer[1] + 2;                                       // Length of the pdu type obkect
+    byte buff[9]; // Largest integer, a 64 bit value plus a leading zero
+    uint16_t len;
+    const byte *data = getValueData(value, buff, &len);
+    if (!data)
+        return false;
+    return addResponseValue(value->type, data, len);
 }
 
-// Adds the VBtype pdu to the response buffer
-// Adds the source OID to the response buffer
-// Adds the Value field data to the response buffer
-// Updates the buffer length field
-// Returns the length of the added data
-byte SimpleSNMP::addSnmpVBtype(byte *responseBuffer, byte *valueBuffer)
+// Encodes a value into buff as an asn.1 object, type and length included
+// Returns the length of the object, 0 if the value type isn't supported or it doesn't fit in size bytes
+uint16_t SimpleSNMP::encodeValue(const SnmpValue *value, byte *buff, uint16_t size)
 {
-    responseBuffer[0] = 0x30; // Response id type
-    responseBuffer[1] = 0x00; // data length
-    if (workingpdu.nextoidasn1)
-        appendASN1(responseBuffer, workingpdu.nextoidasn1); // add nextoid for getnext if there is one
-    else
-        appendASN1(responseBuffer, workingpdu.oidasn1); // else append the request oid
-    appendASN1(responseBuffer, valueBuffer);            // Append the user data response value and updates the length
-    return responseBuffer[1] + 2;                       // Length of the pdu type obkect
+    byte data[9];
+    uint16_t len;
+    const byte *src = getValueData(value, data, &len);
+    if (!src || getASNhdrsize(len) + len > size)
+        return 0;
+    memcpy_P(putASNhdr(buff, value->type, len), src, len); // value can be in PROGMEM
+    return getASNhdrsize(len) + len;
 }
 
-// Appends a source asn.1 object to dest, make sure there is room in the dest for the copy.
-// dest should be a compound asn.1 object, src will be appended to the end of the compound object
-// updates the destination data length
-// Returns the length of the added data
-byte SimpleSNMP::appendASN1(byte *dest, byte *src)
+// Finds the data field for a value set by a value callback, integers are encoded into buff which must be 9 bytes long
+// Strings and oids are not copied, the returned pointer may be in PROGMEM
+// Returns a pointer to the data and sets len to it's length, NULL if the value type isn't supported
+const byte *SimpleSNMP::getValueData(const SnmpValue *value, byte *buff, uint16_t *len)
 {
-    memcpy(dest + dest[1] + 2, src, src[1] + 2); // copy field data plus header to the end of the dest buffer
-    dest[1] += src[1] + 2;                       // add length of the appended data to the dest field length
-    return src[1] + 2;                           // Return the length of the appended data
+    byte *end = buff + 9;
+    byte *data;
+    switch (value->type)
+    {
+    case SNMP_DATATYPE_INTEGER:
+        data = encodeInteger(end, (int64_t)value->integer, true);
+        break;
+    case SNMP_DATATYPE_COUNTER32:
+    case SNMP_DATATYPE_GAUGE32:
+    case SNMP_DATATYPE_TIMETICKS:
+        data = encodeInteger(end, value->unsigned32, false);
+        break;
+    case SNMP_DATATYPE_COUNTER64:
+        data = encodeInteger(end, value->unsigned64, false);
+        break;
+    case SNMP_DATATYPE_IPADDRESS:
+        *len = 4;
+        return value->ipaddress;
+    case SNMP_DATATYPE_OCTETSTRING:
+    case SNMP_DATATYPE_OID:
+        *len = value->octets.len;
+        return value->octets.data;
+    default:
+        return NULL;
+    }
+    *len = end - data;
+    return data;
 }
 
-// Sends the response buffer back to the requestor
-// Returns the udp.endpacket() response code, 1 if ok, 0 if error
-bool SimpleSNMP::sendResponseBuffer(byte *responseBuffer) // Sends the snmp response frame at responsebuffer, returns true if ok
+// Writes an integer value in front of end using the fewest big endian bytes that hold it
+// Unsigned values get a leading zero if their top bit is set so they aren't read as negative
+// Returns a pointer to the first byte, there must be room for 9 bytes in front of end
+byte *SimpleSNMP::encodeInteger(byte *end, uint64_t value, bool isSigned)
 {
-    snmpudp.beginPacket(snmpudp.remoteIP(), snmpudp.remotePort());
-    snmpudp.write((char *)responseBuffer, responseBuffer[1] + 2);
-    snmpPacketsSent++; // Increment Tx count
-    return snmpudp.endPacket();
+    uint64_t fill = isSigned && (int64_t)value < 0 ? ~0ULL : 0; // bits shifted in at the top
+    do
+    {
+        *--end = value & 0xFF;
+        value = (value >> 8) | (fill << 56);
+    } while (value != fill || ((*end ^ fill) & 0x80)); // stop once the rest is just sign bits
+    return end;
+}
+
+// Starts a new response with an empty varbind list and no error
+// The varbinds are added from SNMP_TX_HEADROOM onwards, the headers are written in front of them by finishResponse()
+// The space needed for the headers is worked out here so appendVarbind() can keep the whole message within SNMP_MAX_PACKET_SIZE
+// Returns false if the version, community string and request id fields are too long to fit in the headroom
+bool SimpleSNMP::beginResponse(void)
+{
+    uint16_t hdrlen = getASNhdrlen(workingpdu.versionasn1) + getASNlen(workingpdu.versionasn1); // fields copied from the request
+    hdrlen += getASNhdrlen(workingpdu.comstrasn1) + getASNlen(workingpdu.comstrasn1);
+    hdrlen += getASNhdrlen(workingpdu.reqidasn1) + getASNlen(workingpdu.reqidasn1);
+    hdrlen += 3 * 4 + 2 * 4; // message, pdu and varbind list headers, then the error and error index fields
+    if (hdrlen > SNMP_TX_HEADROOM)
+        return false;
+    responseEnd = txBuffer + SNMP_TX_HEADROOM;
+    responseLimit = responseEnd + SNMP_MAX_PACKET_SIZE - hdrlen;
+    responseErrorStatus = SNMP_NOERROR;
+    responseErrorIndex = 0;
+    responseVarbinds = 0;
+    responseFull = false;
+    valueAdded = false;
+    valueSkipped = false;
+    return true;
+}
+
+// Completes the response by writing the headers back to front in the space in front of the varbind list
+// Each header is written after everything it encloses so it's length is already known, nothing has to be moved or patched
+// version and community string are copied from the request
+// Sets start to the first byte of the message and returns the message length, 0 if no response was being built
+uint16_t SimpleSNMP::finishResponse(byte **start)
+{
+    if (!responseEnd)
+        return 0;
+    byte *end = responseEnd;
+    byte *pos = txBuffer + SNMP_TX_HEADROOM;                            // start of the varbinds
+    pos = pushASNhdr(pos, SNMP_DATATYPE_VARBIND, end - pos);            // varbind list
+    pos = pushInt(pos, responseErrorIndex);                             // error index
+    pos = pushInt(pos, responseErrorStatus);                            // error status
+    pos = pushASN1(pos, workingpdu.reqidasn1);                          // request id
+    pos = pushASNhdr(pos, SNMP_TYPECODE_GETRESPONSE, end - pos);        // response pdu
+    pos = pushASN1(pos, workingpdu.comstrasn1);                         // community string
+    pos = pushASN1(pos, workingpdu.versionasn1);                        // version
+    pos = pushASNhdr(pos, SNMP_DATATYPE_VARBIND, end - pos);            // SNMP message type = 0x30
+    responseEnd = NULL;                                                 // Response is finished, stop any further values being added
+    if (!responseDeferred && responseErrorStatus <= SNMP_NOTWRITABLE)   // A deferred request's response is counted when it's sent
+        snmpOutErrors[responseErrorStatus]++;
+    *start = pos;
+    return end - pos;
+}
+
+// Appends a varbind to the end of the response frame
+// valueBuffer is an asn.1 encoded value field
+// Returns false if there isn't room for it in the response frame
+bool SimpleSNMP::appendVarbind(byte *oidasn1, byte *valueBuffer)
+{
+    return appendVarbind(oidasn1, valueBuffer[0], valueBuffer + getASNhdrlen(valueBuffer), getASNlen(valueBuffer)) != NULL;
+}
+
+// Appends a varbind to the end of the response frame, the value is encoded straight into the frame from data
+// data can be in PROGMEM
+// Returns a pointer to the value field in the response frame or NULL if there isn't room for it
+byte *SimpleSNMP::appendVarbind(const byte *oidasn1, byte type, const byte *data, uint16_t len)
+{
+    if (responseEnd + getVarbindSize(oidasn1, len) > responseLimit)
+        return NULL;
+    byte *value = putVarbind(responseEnd, oidasn1, type, data, len);
+    responseOid = value - (getASNhdrlen((byte *)oidasn1) + getASNlen((byte *)oidasn1));
+    responseEnd = value + getASNhdrsize(len) + len;
+    responseVarbinds++;
+    return value;
+}
+
+// Writes a varbind at pos, the value is encoded straight into place from data which can be in PROGMEM
+// The caller checks there's room, see getVarbindSize()
+// Returns a pointer to the value field
+byte *SimpleSNMP::putVarbind(byte *pos, const byte *oidasn1, byte type, const byte *data, uint16_t len)
+{
+    uint16_t oidlen = getASNhdrlen((byte *)oidasn1) + getASNlen((byte *)oidasn1);
+    pos = putASNhdr(pos, SNMP_DATATYPE_VARBIND, oidlen + getASNhdrsize(len) + len); // varbind header
+    memcpy(pos, oidasn1, oidlen);                                                  // add the oid
+    byte *value = pos + oidlen;
+    memcpy_P(putASNhdr(value, type, len), data, len); // add the value
+    return value;
+}
+
+// Returns the encoded size of a varbind, headers included, for an oid and a value data field of len bytes
+uint16_t SimpleSNMP::getVarbindSize(const byte *oidasn1, uint16_t len)
+{
+    uint16_t vblen = getASNhdrlen((byte *)oidasn1) + getASNlen((byte *)oidasn1) + getASNhdrsize(len) + len; // Length of the varbind contents
+    return getASNhdrsize(vblen) + vblen;
+}
+
+// Returns the size of an asn.1 header for a data field of len bytes, lengths over 127 use the long form
+byte SimpleSNMP::getASNhdrsize(uint16_t len)
+{
+    if (len < 0x80)
+        return 2;
+    if (len < 0x100)
+        return 3;
+    return 4;
 }
 
-// Finds an oid field in the source pdu
-// Recurses through the pdu data structure until it finds a pdu
-// Probably crashes if there isn't an oid object but this should never happen as we are only called if we have received a valid request
-// Returns a pointer to the start of the pdu field
-byte *SimpleSNMP::findOid(byte *pdu) // Searches a pdu for the oid data type record
+// Writes an asn.1 type and length header at pos
+// Returns a pointer to the data field that follows it
+byte *SimpleSNMP::putASNhdr(byte *pos, byte type, uint16_t len)
 {
-    byte *found = NULL;
-    switch (pdu[0]) // walk the pdu to find the oid start
+    *pos++ = type;
+    if (len >= 0x100) // long form, two length bytes
     {
-    case SNMP_DATATYPE_VARBIND:
-    case SNMP_TYPECODE_GETNEXTREQ:
-    case SNMP_TYPECODE_GSETREQ:
-    case SNMP_TYPECODE_GETREQ:
-        found = findOid(pdu + 2); // compound type, recurse into it
-        break;
-    case SNMP_DATATYPE_OID:
-        found = pdu;
-        break;
-    default:
-        found = findOid(pdu + 2 + pdu[1]); // Skip over other known data types
-        break;
+        *pos++ = 0x82;
+        *pos++ = len >> 8;
     }
-    return found;
+    else if (len >= 0x80) // long form, one length byte
+        *pos++ = 0x81;
+    *pos++ = len & 0xFF;
+    return pos;
+}
+
+// Writes an asn.1 type and length header in front of pos, used to wrap data already in the buffer
+// Returns a pointer to the start of the header
+byte *SimpleSNMP::pushASNhdr(byte *pos, byte type, uint16_t len)
+{
+    pos -= getASNhdrsize(len);
+    putASNhdr(pos, type, len);
+    return pos;
+}
+
+// Copies an asn.1 object in front of pos
+// Returns a pointer to the start of the copy
+byte *SimpleSNMP::pushASN1(byte *pos, byte *src)
+{
+    uint16_t len = getASNhdrlen(src) + getASNlen(src);
+    pos -= len;
+    memcpy(pos, src, len);
+    return pos;
+}
+
+// Writes a non negative integer field in front of pos using the fewest bytes
+// Returns a pointer to the start of the field
+byte *SimpleSNMP::pushInt(byte *pos, uint16_t value)
+{
+    byte len = 0;
+    do
+    {
+        *--pos = value & 0xFF;
+        value >>= 8;
+        len++;
+    } while (value || (*pos & 0x80)); // add a leading zero if the top bit is set so it isn't read as negative
+    return pushASNhdr(pos, SNMP_DATATYPE_INTEGER, len);
 }
 
+// Sends the response buffer back to the requestor
+// Returns the transport send() response, true if ok, false if error
+bool SimpleSNMP::sendResponseBuffer(byte *responseBuffer, uint16_t len) // Sends the snmp response frame at responsebuffer, returns true if ok
+{
+    if (!len)
+        return false;
+    snmpPacketsSent++; // Increment Tx count
+    SNMP_TIMING_START(sendStart);
+    bool sent = transport->send(responseBuffer, len, requestIP, requestPort);
+    SNMP_TIMING_STOP(SNMP_STAGE_SEND, sendStart);
+    return sent;
+}
+
+#if SNMP_LOG_LEVEL >= SNMP_LOG_DEBUG
 ///////////////////////////////////////////////////
-// Debug functions
+// Debug functions, only built for SNMP_LOG_DEBUG
 ///////////////////////////////////////////////////
 
 /*******************************************************************
@@ -1002,193 +2321,1435 @@ void SimpleSNMP::dumpField(byte *pdu) // Displays the contents of a asn.1 field
 /*******************************************************************
  * Print out an asn.1 record as hex bytes for pasting into decoder
  *******************************************************************/
-void SimpleSNMP::dumpRaw(byte *pdu)
+void SimpleSNMP::dumpRaw(byte *pdu, uint16_t len)
 {
     myLog_P(PSTR("Raw data"));
-    for (auto i = 0; i < pdu[1] + 2; i++)
+    for (uint16_t i = 0; i < len; i++)
     {
         myLog_P(PSTR(" %02.2X"), pdu[i]);
     }
     myLog_P(PSTR("\r\n")); // crnl
 }
+#endif
 
 /*************************************************************************************************************************************************************************/
 
+// Adds an oid to the registry, the registry is kept sorted in oid order so it can be binary searched
+// Registering in ascending oid order appends to the end of the registry without moving anything
+// Registering an oid a second time replaces the read function
 void SimpleSNMP::insertNode(const char *oidtext, void (*action)()) // Function to insert a new node
 {
-    snmpNode *newNode = new snmpNode(oidtext, action); // Create the new Node.
-    if (head == NULL)                                  // First item so assign to head
-    {
-        //        head = newNode;
-        head = new snmpNode(oidtext, action); // Create the roor node
+    snmpNode *node = addNode(oidtext);
+    if (!node)
+        return;
+    node->ROcommandAction = action;
+    node->ROvalueAction = NULL;
+    node->variable = NULL;
+}
+
+// Adds an oid with a value callback to the registry
+// The callback sets the value in the slot it's given and returns true, the library encodes it into the response
+// Returning false, or not setting a value, is treated the same as a read function that didn't call sendResponse()
+void SimpleSNMP::insertNode(const char *oidtext, bool (*action)(SnmpValue *value)) // Function to insert a new node
+{
+    snmpNode *node = addNode(oidtext);
+    if (!node)
         return;
+    node->ROcommandAction = NULL;
+    node->ROvalueAction = action;
+    node->variable = NULL;
+}
+
+// Binds an oid to an integer variable, the value is read and encoded when it's requested without calling a read function
+// type is the type it's sent as, INTEGER, Counter32, Gauge32, TimeTicks or Counter64, a 32 bit type sends the low 32 bits
+// The variable can be changed at any time, an interrupt can update it as it's read with volatile access
+// Returns false if the oid or type isn't valid, the oid is a table, or the registry is read only or full
+bool SimpleSNMP::bindNode(const char *oidtext, const volatile void *variable, byte type, byte size)
+{
+    switch (type)
+    {
+    case SNMP_DATATYPE_INTEGER:
+    case SNMP_DATATYPE_COUNTER32:
+    case SNMP_DATATYPE_GAUGE32:
+    case SNMP_DATATYPE_TIMETICKS:
+    case SNMP_DATATYPE_COUNTER64:
+        if (!(size & ~SNMP_VARIABLE_SIGNED))
+            return false;
+        break;
+    case SNMP_DATATYPE_OCTETSTRING: // A string
+    case SNMP_DATATYPE_NOTSET:      // An encoded constant
+        break;
+    default:
+        return false;
+    }
+    if (!variable)
+        return false;
+    snmpNode *node = addNode(oidtext);
+    if (!node || node->table)
+        return false;
+    node->ROcommandAction = NULL;
+    node->ROvalueAction = NULL;
+    node->variable = variable;
+    node->variableType = type;
+    node->variableSize = size;
+    return true;
+}
+
+// Binds an oid to a null terminated string, it's sent as an OCTET STRING
+// The string isn't copied, it can change but must stay where it is, it can be in PROGMEM
+bool SimpleSNMP::bindVariable(const char *oidtext, const char *string)
+{
+    return bindNode(oidtext, string, SNMP_DATATYPE_OCTETSTRING, 0);
+}
+
+// Binds an oid to a constant already encoded as an asn.1 object, type and length included, eg sysObjectID
+// SnmpMib.h has snmpEncodedString() and snmpEncodedOid() to encode them at compile time
+// The constant isn't copied and is sent as it is, it can be in PROGMEM
+bool SimpleSNMP::bindConstant(const char *oidtext, const byte *encoded)
+{
+    return bindNode(oidtext, encoded, SNMP_DATATYPE_NOTSET, 0);
+}
+
+// Returns the registry node for an oid, a new node is inserted at it's place in oid order if it isn't already registered
+// Returns NULL if the oid text isn't valid or the registry couldn't be grown
+snmpNode *SimpleSNMP::addNode(const char *oidtext)
+{
+    byte oidbuff[MAX_OID_SIZE];
+    byte *oid = char2oid(oidtext, oidbuff); // Encode the oid text, the registry is keyed on the asn.1 encoding
+    if (!oid)
+        return NULL;
+
+    if (registryShared) // Workers are reading it, or it was built by the compiler
+    {
+        snmpLogError(PSTR("SimpleSNMP: registry is read only, %s not added\r\n"), oidtext);
+        return NULL;
+    }
+
+    bool exact;
+    uint16_t idx = findNode(oid, &exact); // Find the insertion point
+    if (exact)                            // Already registered
+        return nodes + idx;
+    if (nodeCount == nodeCapacity && !growRegistry(SNMP_REGISTRY_GROW)) // Make room for the new node
+        return NULL;
+    if (!reserveKeys(oid[1] + 2))
+        return NULL;
+
+    byte *key = keyFree; // Store the encoded oid, type and length bytes included
+    keyFree += oid[1] + 2;
+    memcpy(key, oid, oid[1] + 2);
+
+    memmove(nodes + idx + 1, nodes + idx, (nodeCount - idx) * sizeof(snmpNode)); // Open a gap at the insertion point
+    if (nodeHits) // The counts stay with their nodes
+    {
+        memmove(nodeHits + idx + 1, nodeHits + idx, (nodeCount - idx) * sizeof(uint32_t));
+        nodeHits[idx] = 0;
+    }
+    nodes[idx].oid = key;
+    nodes[idx].ROcommandAction = NULL;
+    nodes[idx].ROvalueAction = NULL;
+    nodes[idx].RWcommandAction = NULL;
+    nodes[idx].cache = NULL;
+    nodes[idx].table = NULL;
+    nodes[idx].variable = NULL;
+    nodes[idx].variableType = SNMP_DATATYPE_NOTSET;
+    nodes[idx].variableSize = 0;
+    nodeCount++;
+    return nodes + idx;
+}
+
+// Increases the registry size by extra nodes, the existing nodes are copied across
+// Returns false if the memory could not be allocated or the registry is a fixed size
+bool SimpleSNMP::growRegistry(uint16_t extra)
+{
+#if SNMP_REGISTRY_POOL_SIZE
+    (void)extra; // The pool can't grow
+    snmpLogError(PSTR("SimpleSNMP: registry is full\r\n"));
+    return false;
+#else
+    if (extra > 0xFFFF - nodeCapacity) // Node numbers are 16 bit
+        return false;
+    snmpNode *grown = new snmpNode[nodeCapacity + extra];
+    if (!grown)
+        return false;
+    if (nodeHits) // The request counts grow with the registry
+    {
+        uint32_t *hits = new uint32_t[nodeCapacity + extra];
+        if (!hits)
+        {
+            delete[] grown;
+            return false;
+        }
+        memcpy(hits, nodeHits, nodeCount * sizeof(uint32_t));
+        delete[] nodeHits;
+        nodeHits = hits;
     }
-    // Find the last item in the list
-    snmpNode *temp = head;
-    while (temp->next != NULL)
-        temp = temp->next; // Update temp
-    temp->next = newNode;  // Insert at the end.
+    if (nodes)
+        memcpy(grown, nodes, nodeCount * sizeof(snmpNode));
+    delete[] nodes;
+    nodes = grown;
+    nodeCapacity += extra;
+    return true;
+#endif
+}
+
+// Makes sure there's room for len bytes of encoded oids, the keys are packed into blocks so each oid isn't a separate allocation
+// The keys never move once stored, registeredOid() pointers stay valid
+// Returns false if the memory could not be allocated or the registry is a fixed size and it's full
+bool SimpleSNMP::reserveKeys(uint32_t len)
+{
+    if ((uint32_t)(keyEnd - keyFree) >= len)
+        return true;
+#if SNMP_REGISTRY_POOL_SIZE
+    snmpLogError(PSTR("SimpleSNMP: no room for the oid\r\n"));
+    return false;
+#else
+    uint32_t size = len > SNMP_KEY_BLOCK_SIZE ? len : SNMP_KEY_BLOCK_SIZE;
+    byte *block = new byte[sizeof(snmpKeyBlock) + size]; // Any space left in the last block is abandoned
+    if (!block)
+        return false;
+    ((snmpKeyBlock *)block)->next = keyBlocks;
+    keyBlocks = (snmpKeyBlock *)block;
+    keyFree = block + sizeof(snmpKeyBlock);
+    keyEnd = keyFree + size;
+    return true;
+#endif
 }
 
-// Walks the list looking for a oid match and if found updates the RW function pointer
+// Looks up an oid in the registry and if found updates the RW function pointer
 bool SimpleSNMP::addRWaction(const char *oidfind, void (*action)()) // Function to add a RW action to a node
 {
-    snmpNode *flist = head;
-    while (flist != NULL) // Traverse the list.
+    byte oidbuff[MAX_OID_SIZE];
+    byte *oid = char2oid(oidfind, oidbuff); // Encode the oid text, the registry is keyed on the asn.1 encoding
+    if (!oid)
+        return false;
+
+    bool exact;
+    uint16_t idx = findNode(oid, &exact);
+    if (!exact || registryShared)
+        return false; // failed to match the oid, or workers are reading the registry
+
+    nodes[idx].RWcommandAction = action; // Update function pointer
+    return true;                         // indicate that we matched the oid
+}
+
+// Registers a conceptual table, eg ifTable, every cell is answered by two callbacks so a table uses the same memory whatever it's size
+// entryoid is the table's entry object, eg "1.3.6.1.2.1.2.2.1" for ifEntry, the cells are entryoid.column.row
+// columns lists the column numbers in ascending order, each below 128, the list isn't copied and can be in PROGMEM
+// nextRow returns the first row index after the one it's passed, or -1 if there isn't one, it's passed -1 for the first row
+// Rows can come and go at any time, nextRow only has to report the rows that exist when it's called
+// readCell sets the value of a cell and returns true, returning false leaves the cell out of walks
+// Oids below entryoid can't also be registered with insertNode(), the table answers for all of them
+// Returns false if the oid isn't valid or is already registered, oids below it are registered, the registry is shared or the memory could not be allocated
+bool SimpleSNMP::addTable(const char *entryoid, const byte *columns, byte columnCount, int32_t (*nextRow)(int32_t after),
+                          bool (*readCell)(byte column, int32_t row, SnmpValue *value))
+{
+    byte oidbuff[MAX_OID_SIZE];
+    byte *oid = char2oid(entryoid, oidbuff);
+    if (!oid || oid[1] + 2 + 6 > MAX_OID_SIZE || !columnCount || !nextRow || !readCell) // Room for a column and a 5 byte row index
+        return false;
+    bool exact;
+    uint16_t idx = findNode(oid, &exact);
+    if (exact)
+        return false;
+    if (idx < nodeCount && nodes[idx].oid[1] > oid[1] && !memcmp(nodes[idx].oid + 2, oid + 2, oid[1])) // Oids already registered below it
+        return false;
+
+    snmpTable *table = new snmpTable;
+    if (!table)
+        return false;
+    snmpNode *node = addNode(entryoid);
+    if (!node)
+    {
+        delete table;
+        return false;
+    }
+    table->columns = columns;
+    table->columnCount = columnCount;
+    table->nextRow = nextRow;
+    table->readCell = readCell;
+    node->table = table;
+    return true;
+}
+
+// Registers a list of objects made with snmpObject(), snmpTableObject(), snmpVariable() and snmpConstant(), the list can be in PROGMEM
+// The registry and the space for the encoded oids are sized for the whole list first, so the nodes and the keys take an
+// allocation each rather than growing an object at a time, listing the objects in oid order is quickest
+// Objects that are already registered have their functions replaced
+// Returns false if an oid isn't valid, nothing is registered, or if the registry is read only or the memory could not be allocated
+bool SimpleSNMP::registerMib(const snmpMibObject *objects, uint16_t count)
+{
+    byte oidbuff[MAX_OID_SIZE];
+    snmpMibObject object;
+    uint32_t keyBytes = 0;
+    for (uint16_t i = 0; i < count; i++) // Check every oid and add up the space their keys need
+    {
+        memcpy_P(&object, objects + i, sizeof(object));
+        byte *oid = char2oid(object.oidtext, oidbuff);
+        if (!oid)
+        {
+            snmpLogError(PSTR("SimpleSNMP: invalid oid %s, mib not registered\r\n"), object.oidtext);
+            return false;
+        }
+        keyBytes += oid[1] + 2;
+    }
+    if (registryShared || count > 0xFFFF - nodeCount)
+        return false;
+    if (nodeCount + count > nodeCapacity && !growRegistry(nodeCount + count - nodeCapacity))
+        return false;
+    if (!reserveKeys(keyBytes))
+        return false;
+
+    bool ok = true;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        memcpy_P(&object, objects + i, sizeof(object));
+        if (object.table)
+        {
+            snmpTable table;
+            memcpy_P(&table, object.table, sizeof(table));
+            if (!addTable(object.oidtext, table.columns, table.columnCount, table.nextRow, table.readCell))
+                ok = false;
+            continue;
+        }
+        if (object.variable)
+        {
+            if (!bindNode(object.oidtext, object.variable, object.variableType, object.variableSize))
+                ok = false;
+            continue;
+        }
+        snmpNode *node = addNode(object.oidtext);
+        if (!node)
+        {
+            ok = false;
+            continue;
+        }
+        node->ROcommandAction = object.ROcommandAction;
+        node->ROvalueAction = object.ROvalueAction;
+        node->RWcommandAction = object.RWcommandAction;
+        node->variable = NULL;
+    }
+    return ok;
+}
+
+// Serves a registry built at compile time by SnmpMib, the nodes are used where they are so nothing is allocated or registered
+// The registry is read only, no oids can be added and the value caches aren't used, workers can share it as normal
+// Returns false if oids have already been registered or this is a worker
+bool SimpleSNMP::useMib(const snmpNode *mibNodes, uint16_t count)
+{
+    if (nodeCount || !ownRegistry)
+        return false;
+    nodes = (snmpNode *)mibNodes; // Never written while registryShared is set
+    nodeCount = count;
+    nodeCapacity = count;
+    ownRegistry = false; // Not ours to delete
+    registryShared = true;
+    mibRegistry = true;
+    return true;
+}
+
+// Copies a compile time mib's nodes into a registry of our own so more oids can be added, used by exportStatistics()
+// The encoded oids stay in the mib, the table descriptions are copied as the destructor deletes a registry's tables
+// Returns false if the memory could not be allocated, or the mib doesn't fit a fixed size registry
+bool SimpleSNMP::copyMib(void)
+{
+    const snmpNode *mibNodes = nodes;
+#if SNMP_REGISTRY_POOL_SIZE
+    if (nodeCount > SNMP_REGISTRY_POOL_SIZE)
+        return false;
+    snmpNode *copy = nodePool;
+    uint16_t capacity = SNMP_REGISTRY_POOL_SIZE;
+#else
+    uint16_t capacity = nodeCount + SNMP_REGISTRY_GROW;
+    snmpNode *copy = new snmpNode[capacity];
+    if (!copy)
+        return false;
+#endif
+    memcpy(copy, mibNodes, nodeCount * sizeof(snmpNode));
+    for (uint16_t i = 0; i < nodeCount; i++)
+    {
+        if (copy[i].table)
+            copy[i].table = new snmpTable(*mibNodes[i].table);
+    }
+    nodes = copy;
+    nodeCapacity = capacity;
+    ownRegistry = true;
+    registryShared = false;
+    mibRegistry = false;
+    return true;
+}
+
+// Registers the agent's counters so a manager can read them like any other oid, and starts counting the requests each oid answers
+// The snmp group of SNMP-MIB, snmpInPkts and the rest at 1.3.6.1.2.1.11, and the agent's own counters under subtree are
+// registered as tables so a single node answers for each group, the counters are only read when they're requested
+//   subtree.1.n.0    requests by parse result, n is the SNMP_PARSE_STAT_CODES value + 1
+//   subtree.2.n.0    the agent's other counters, getbulk requests, snmpPacketsOversize, snmpQueueDrops and so on
+//   subtree.3.1.1.n  the oid of registry node n, in oid order
+//   subtree.3.1.2.n  the number of requests node n has answered, each value read or written counts once
+//   subtree.4.1.c.n  rejected packet n from the reject log, the error, source address and port, length, first bytes and time
+// The counters come from the instance answering the request so each worker reports it's own
+// A compile time mib served by useMib() is copied to the heap first so the tables can be added, workers made after this share the copy
+// Returns false if the oids are already registered, workers are already sharing the registry or the memory could not be allocated
+bool SimpleSNMP::exportStatistics(const char *subtree)
+{
+    static const byte snmpGroupColumns[] PROGMEM = {1, 2, 3, 4, 5, 6, 13, 14, 15, 16, 17, 18, 20, 21, 22, 24, 28, 29, 30, 31, 32};
+    static const byte parseColumns[] PROGMEM = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    static const byte agentColumns[] PROGMEM = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    static const byte hitColumns[] PROGMEM = {1, 2};
+#if SNMP_REJECT_LOG_SIZE
+    static const byte rejectColumns[] PROGMEM = {1, 2, 3, 4, 5, 6};
+#endif
+    char oidtext[MAX_OID_SIZE];
+    size_t len = strlen_P(subtree);
+    if (len + 5 > sizeof(oidtext)) // Room for the longest suffix
+        return false;
+    if (mibRegistry && !copyMib()) // A compile time mib is copied so the statistics can be added to it
+        return false;
+    if (registryShared)
+    {
+        snmpLogError(PSTR("SimpleSNMP: registry is read only, statistics not exported\r\n"));
+        return false;
+    }
+    strcpy_P(oidtext, subtree);
+
+    bool ok = addTable(PSTR("1.3.6.1.2.1.11"), snmpGroupColumns, sizeof(snmpGroupColumns), nextScalarRow, readSnmpGroup);
+    strcpy_P(oidtext + len, PSTR(".1"));
+    ok = addTable(oidtext, parseColumns, sizeof(parseColumns), nextScalarRow, readParseResults) && ok;
+    strcpy_P(oidtext + len, PSTR(".2"));
+    ok = addTable(oidtext, agentColumns, sizeof(agentColumns), nextScalarRow, readAgentCounters) && ok;
+    strcpy_P(oidtext + len, PSTR(".3.1"));
+    ok = addTable(oidtext, hitColumns, sizeof(hitColumns), nextHitRow, readOidHits) && ok;
+#if SNMP_REJECT_LOG_SIZE
+    strcpy_P(oidtext + len, PSTR(".4.1"));
+    ok = addTable(oidtext, rejectColumns, sizeof(rejectColumns), nextRejectRow, readRejectLog) && ok;
+#endif
+    if (!nodeHits && nodeCapacity) // Counted from now on, addNode() and growRegistry() keep the counts in step with the registry
+    {
+        nodeHits = new uint32_t[nodeCapacity]();
+        if (!nodeHits)
+            return false;
+    }
+    return ok;
+}
+
+// Returns the rows of a group of scalars registered as a table, there's only row 0 so it's cells are column.0
+int32_t SimpleSNMP::nextScalarRow(int32_t after)
+{
+    return after < 0 ? 0 : -1;
+}
+
+// Reads the snmp group of SNMP-MIB, the column is the object's number under 1.3.6.1.2.1.11
+// The group's counters are made up from the agent's own, objects the agent has nothing to count for are left out
+bool SimpleSNMP::readSnmpGroup(byte column, int32_t, SnmpValue *value)
+{
+    SimpleSNMP *agent = serving();
+    const unsigned long *parsed = agent->snmpParseResults;
+    unsigned long count = 0;
+    switch (column)
+    {
+    case 1: // snmpInPkts
+        count = agent->snmpPacketsRecv;
+        break;
+    case 2: // snmpOutPkts
+        count = agent->snmpPacketsSent;
+        break;
+    case 3: // snmpInBadVersions
+        count = parsed[SNMP_VERSION_NOT_SUPPORTED];
+        break;
+    case 4: // snmpInBadCommunityNames
+        count = parsed[SNMP_COMMUNITYSTRING_NOT_MATCHED] - agent->snmpInBadCommunityUses;
+        break;
+    case 5: // snmpInBadCommunityUses
+        count = agent->snmpInBadCommunityUses;
+        break;
+    case 6: // snmpInASNParseErrs
+        count = parsed[SNMP_PACKET_INVALID] + parsed[SNMP_LENGTH_PACKET_INVALID] + parsed[SNMP_OID_NOT_FOUND] + parsed[SNMP_COMSTR_NOT_FOUND];
+        break;
+    case 13: // snmpInTotalReqVars
+        count = agent->snmpInTotalReqVars;
+        break;
+    case 14: // snmpInTotalSetVars
+        count = agent->snmpInTotalSetVars;
+        break;
+    case 15: // snmpInGetRequests
+        count = agent->snmpInPdus[SNMP_TYPECODE_GETREQ & 7];
+        break;
+    case 16: // snmpInGetNexts
+        count = agent->snmpInPdus[SNMP_TYPECODE_GETNEXTREQ & 7];
+        break;
+    case 17: // snmpInSetRequests
+        count = agent->snmpInPdus[SNMP_TYPECODE_GSETREQ & 7];
+        break;
+    case 18: // snmpInGetResponses, acknowledgements of informs
+        count = agent->snmpInPdus[SNMP_TYPECODE_GETRESPONSE & 7];
+        break;
+    case 20: // snmpOutTooBigs
+        count = agent->snmpOutErrors[SNMP_TOOBIG];
+        break;
+    case 21: // snmpOutNoSuchNames
+        count = agent->snmpOutErrors[SNMP_NOSUCHNAME];
+        break;
+    case 22: // snmpOutBadValues
+        count = agent->snmpOutErrors[SNMP_BADVALUE];
+        break;
+    case 24: // snmpOutGenErrs
+        count = agent->snmpOutErrors[SNMP_GENERR];
+        break;
+    case 28: // snmpOutGetResponses
+        for (byte i = 0; i <= SNMP_NOTWRITABLE; i++)
+            count += agent->snmpOutErrors[i];
+        break;
+    case 29: // snmpOutTraps, traps and informs
+        count = agent->snmpNotifySent;
+        break;
+    case 30: // snmpEnableAuthenTraps, authenticationFailure traps aren't sent
+        value->setInteger(2);
+        return true;
+    case 31: // snmpSilentDrops, requests dropped without a response
+        count = agent->snmpQueueDrops + agent->snmpPacketsOversize + agent->snmpRateDrops + agent->snmpGlobalRateDrops;
+        break;
+    case 32: // snmpProxyDrops, there's no proxy
+        break;
+    default:
+        return false;
+    }
+    value->setCounter32(count);
+    return true;
+}
+
+// Reads the count of requests parsed with each result, column n is SNMP_PARSE_STAT_CODES n - 1
+bool SimpleSNMP::readParseResults(byte column, int32_t, SnmpValue *value)
+{
+    value->setCounter32(serving()->snmpParseResults[column - 1]);
+    return true;
+}
+
+// Reads the agent's counters that have no place in the snmp group
+bool SimpleSNMP::readAgentCounters(byte column, int32_t, SnmpValue *value)
+{
+    SimpleSNMP *agent = serving();
+    switch (column)
+    {
+    case 1:
+        value->setCounter32(agent->snmpInPdus[SNMP_TYPECODE_GETBULKREQ & 7]);
+        break;
+    case 2:
+        value->setCounter32(agent->snmpPacketsOversize);
+        break;
+    case 3:
+        value->setCounter32(agent->snmpQueueDrops);
+        break;
+    case 4:
+        value->setGauge32(agent->snmpQueueMaxDepth);
+        break;
+    case 5:
+        value->setCounter32(agent->snmpPacketsRetransmit);
+        break;
+    case 6:
+        value->setCounter32(agent->snmpDeferTimeouts);
+        break;
+    case 7:
+        value->setCounter32(agent->snmpDeferFull);
+        break;
+    case 8:
+        value->setCounter32(agent->snmpCacheHits);
+        break;
+    case 9:
+        value->setCounter32(agent->snmpCacheMisses);
+        break;
+    case 10:
+        value->setCounter32(agent->snmpNotifySent);
+        break;
+    case 11:
+        value->setCounter32(agent->snmpNotifyMerged);
+        break;
+    case 12:
+        value->setCounter32(agent->snmpNotifyDrops);
+        break;
+    case 13:
+        value->setCounter32(agent->snmpInformRetries);
+        break;
+    case 14:
+        value->setCounter32(agent->snmpInformFailures);
+        break;
+    case 15:
+        value->setCounter32(agent->snmpRateDrops);
+        break;
+    case 16:
+        value->setCounter32(agent->snmpGlobalRateDrops);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Returns the rows of the oid hit table, row n is registry node n - 1
+int32_t SimpleSNMP::nextHitRow(int32_t after)
+{
+    SimpleSNMP *agent = serving();
+    int32_t row = after < 1 ? 1 : after + 1;
+    return agent->nodeHits && row <= agent->nodeCount ? row : -1;
+}
+
+// Reads the oid hit table, column 1 is the node's oid and column 2 the number of requests it has answered
+bool SimpleSNMP::readOidHits(byte column, int32_t row, SnmpValue *value)
+{
+    SimpleSNMP *agent = serving();
+    if (column == 1)
+        value->setOid(agent->nodes[row - 1].oid);
+    else
+        value->setCounter32(agent->nodeHits[row - 1]);
+    return true;
+}
+
+#if SNMP_REJECT_LOG_SIZE
+// Returns the rows of the reject log table, the row is the packet's seq so rows stay the same as packets are added
+int32_t SimpleSNMP::nextRejectRow(int32_t after)
+{
+    SimpleSNMP *agent = serving();
+    uint32_t row = agent->rejectSeq > SNMP_REJECT_LOG_SIZE ? agent->rejectSeq - SNMP_REJECT_LOG_SIZE + 1 : 1; // Oldest still held
+    if (after >= 0 && (uint32_t)after >= row)
+        row = after + 1;
+    return row <= agent->rejectSeq && row <= 0x7FFFFFFF ? (int32_t)row : -1;
+}
+
+// Reads the reject log table, the columns are the error, source address, source port, length, start of the packet and time rejected
+bool SimpleSNMP::readRejectLog(byte column, int32_t row, SnmpValue *value)
+{
+    SimpleSNMP *agent = serving();
+    if (row <= 0)
+        return false;
+    const SnmpRejectedPacket *entry = &agent->rejectLog[row % SNMP_REJECT_LOG_SIZE];
+    if (entry->seq != (uint32_t)row) // Overwritten since the row was found
+        return false;
+    switch (column)
+    {
+    case 1:
+        value->setInteger(entry->error);
+        break;
+    case 2:
+        value->setIpAddress(IPAddress(entry->ip));
+        break;
+    case 3:
+        value->setInteger(entry->port);
+        break;
+    case 4:
+        value->setInteger(entry->len);
+        break;
+    case 5:
+        value->setOctets(entry->data, entry->len < SNMP_REJECT_CAPTURE ? entry->len : SNMP_REJECT_CAPTURE);
+        break;
+    case 6:
+        value->setTimeTicks(entry->time / 10); // timeticks are 1/100th seconds
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Returns the registry's encoded copy of a registered oid, the pointer stays the same while the registry is shared
+// Returns NULL if the oid isn't registered
+const byte *SimpleSNMP::registeredOid(const char *oidtext)
+{
+    byte oidbuff[MAX_OID_SIZE];
+    byte *oid = char2oid(oidtext, oidbuff); // Encode the oid text, the registry is keyed on the asn.1 encoding
+    if (!oid)
+        return NULL;
+
+    bool exact;
+    uint16_t idx = findNode(oid, &exact);
+    return exact ? nodes[idx].oid : NULL;
+}
+
+// Enables the value cache for a registered oid, repeat requests within ttl ms are answered from the cache without calling the read function
+// size is the largest encoded value that will be cached, the space is allocated now so nothing is allocated while requests are processed
+// A ttl of 0 turns the cache off again, a set request on the oid empties it
+// Returns false if the oid isn't registered or the memory could not be allocated
+bool SimpleSNMP::setCacheTTL(const char *oidtext, unsigned long ttl, uint16_t size)
+{
+    byte oidbuff[MAX_OID_SIZE];
+    byte *oid = char2oid(oidtext, oidbuff); // Encode the oid text, the registry is keyed on the asn.1 encoding
+    if (!oid)
+        return false;
+
+    bool exact;
+    uint16_t idx = findNode(oid, &exact);
+    if (!exact || registryShared)
+        return false; // failed to match the oid, or workers are reading the registry
+
+    snmpCache *cache = nodes[idx].cache;
+    if (cache && (!ttl || cache->size != size)) // Turning it off or resizing, remove the old cache
+    {
+        delete[] cache->value;
+        delete cache;
+        nodes[idx].cache = cache = NULL;
+    }
+    if (!ttl)
+        return true;
+    if (!cache)
+    {
+        cache = new snmpCache;
+        if (!cache)
+            return false;
+        cache->value = new byte[size];
+        if (!cache->value)
+        {
+            delete cache;
+            return false;
+        }
+        cache->size = size;
+        cache->len = 0;
+        nodes[idx].cache = cache;
+    }
+    cache->ttl = ttl;
+    return true;
+}
+
+// Binary search of the registry for an asn.1 encoded oid
+// Returns the index of the first node that is greater than or equal to the oid, nodeCount if there isn't one
+// exact is set true if the node at the returned index matches the oid
+uint16_t SimpleSNMP::findNode(const byte *oidasn1, bool *exact)
+{
+    *exact = false;
+    if (nodeCount == 0 || compareOid(oidasn1, nodes[nodeCount - 1].oid) > 0) // Past the end, the usual case while registering
+        return nodeCount;
+
+    uint16_t lo = 0;
+    uint16_t hi = nodeCount;
+    while (lo < hi)
+    {
+        uint16_t mid = lo + (hi - lo) / 2;
+        int cmp = compareOid(nodes[mid].oid, oidasn1);
+        if (cmp == 0)
+        {
+            *exact = true;
+            return mid;
+        }
+        if (cmp < 0)
+            lo = mid + 1; // node is before the oid, search the top half
+        else
+            hi = mid; // node is after the oid, search the bottom half
+    }
+    return lo;
+}
+
+// Looks up each oid in the varbind list and calls the attached function to add it's value to the response
+// A v1 request stops at the first oid not found with a noSuchName error, v2c returns noSuchObject or noSuchInstance in place of the value
+bool SimpleSNMP::processGetRequest(void)
+{
+    byte vbindex = 0; // 1 based position in the varbind list, reported in the error index
+    for (byte vb = 0; vb < workingpdu.vbcount; vb++)
     {
-        bool cresult = true;              // compare result flag
-        byte i = 0;                       // pointer into source compare string
-        char cp = pgm_read_byte(oidfind); // get first byte to compare
-        while (cp)                        // while it's not a 0
+        byte *oidasn1 = selectVarbind(vb);
+        vbindex++;
+        bool exact;
+        uint16_t idx = findNode(oidasn1, &exact);
+        byte missing = SNMP_DATATYPE_NOSUCHOBJECT; // exception returned if there's no value
+        if (exact && !nodes[idx].table)
+        {
+            if (!callReadAction(idx, vbindex))
+                return false;
+            continue;
+        }
+        if (!exact && idx && inTable(idx - 1, oidasn1)) // A table cell, it's table is the node before
         {
-            if (cp != pgm_read_byte(flist->oid + i)) // if strings are not the same
+            missing = getTableCell(idx - 1, oidasn1);
+            if (missing == SNMP_DATATYPE_NOTSET)
             {
-                cresult = false; // set false result
-                break;           // breakout with result false
+                if (!checkReadAction(vbindex))
+                    return false;
+                continue;
             }
-            i++;                             // point to next char
-            cp = pgm_read_byte(oidfind + i); // get next char
         }
+        else if (!exact && isInstanceOf(idx, oidasn1)) // An exact match here is a table's entry oid, it's not an instance
+            missing = SNMP_DATATYPE_NOSUCHINSTANCE;
+        if (workingpdu.version == 1)
+        {
+            sendErrorResponse(SNMP_NOSUCHNAME, vbindex);
+            return false;
+        }
+        byte noSuch[] = {missing, 0x00};
+        if (!appendVarbind(oidasn1, noSuch))
+        {
+            sendErrorResponse(SNMP_TOOBIG, 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Looks up the first registered oid that follows each oid in the varbind list and calls it's attached function to add the value to the response
+// The requested oid does not need to be registered, a partial oid returns the first registered oid below it
+// At the end of the registry a v1 request gets a noSuchName error, v2c returns endOfMibView in place of the value
+bool SimpleSNMP::processGetNextRequest(void)
+{
+    byte vbindex = 0; // 1 based position in the varbind list, reported in the error index
+    for (byte vb = 0; vb < workingpdu.vbcount; vb++)
+    {
+        byte *oidasn1 = selectVarbind(vb);
+        vbindex++;
+        snmpWalkPos pos;
+        seekNext(oidasn1, &pos);
+        readPosition(&pos); // The response carries the registered oid or table cell
+        if (pos.idx < nodeCount)
+        {
+            if (!checkReadAction(vbindex))
+                return false;
+            continue;
+        }
+        if (workingpdu.version == 1) // End of the registry
+        {
+            sendErrorResponse(SNMP_NOSUCHNAME, vbindex);
+            return false;
+        }
+        byte endOfMibView[] = {SNMP_DATATYPE_ENDOFMIBVIEW, 0x00};
+        if (!appendVarbind(oidasn1, endOfMibView))
+        {
+            sendErrorResponse(SNMP_TOOBIG, 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Calls the read function for a registry node and checks it added a value to the response
+// Sets a tooBig error if the value didn't fit or a genErr if the function didn't respond
+// Returns true if the value was added
+bool SimpleSNMP::callReadAction(uint16_t idx, byte vbindex)
+{
+    runReadAction(idx);
+    return checkReadAction(vbindex);
+}
+
+// Checks the value for varbind vbindex was added to the response
+// Sets a tooBig error if the value didn't fit, a noSuchName if it was a Counter64 for a v1 client or a genErr if the function didn't respond
+// Returns true if the value was added
+bool SimpleSNMP::checkReadAction(byte vbindex)
+{
+    if (responseFull)
+    {
+        sendErrorResponse(SNMP_TOOBIG, 0);
+        return false;
+    }
+    if (!valueAdded)
+    {
+        sendErrorResponse(valueSkipped ? SNMP_NOSUCHNAME : SNMP_GENERR, vbindex);
+        return false;
+    }
+    return true;
+}
+
+// Calls the read function for a registry node
+// A read function adds it's value to the response itself, a value callback's value is encoded and added once it returns
+// A bound variable or constant is read directly, there's no function to call and nothing to cache
+void SimpleSNMP::runReadAction(uint16_t idx)
+{
+    if (nodeHits)
+        nodeHits[idx]++;
+    if (valueOverride) // A value set in place of the read function's
+    {
+        const byte *value = valueOverride(overrideContext, nodes[idx].oid);
+        if (value)
+        {
+            addResponseValue((byte *)value); // only read
+            return;
+        }
+    }
+
+    if (nodes[idx].variable)
+    {
+        addBoundValue(nodes + idx);
+        return;
+    }
+
+    snmpCache *cache = registryShared ? NULL : nodes[idx].cache; // A shared registry is read only, the caches would be written by several workers
+    if (cache)
+    {
+        if (cache->len && millis() - cache->time < cache->ttl) // Still fresh, answer from the cache
+        {
+            snmpCacheHits++;
+            addResponseValue(cache->value);
+            return;
+        }
+        snmpCacheMisses++;
+    }
 
-        if (cresult) // Check for command match
+    if (nodes[idx].ROvalueAction)
+    {
+        SnmpValue value;
+        value.type = SNMP_DATATYPE_NOTSET;
+        SNMP_TIMING_START(callStart);
+        bool read = nodes[idx].ROvalueAction(&value);
+        SNMP_TIMING_CALLBACK(callStart);
+        if (read)
+            addResponseValue(&value);
+    }
+    else if (nodes[idx].ROcommandAction) // check we have a function to call
+    {
+        SNMP_TIMING_START(callStart);
+        nodes[idx].ROcommandAction(); // Run command, command function should add the value to the response
+        SNMP_TIMING_CALLBACK(callStart);
+    }
+
+    if (cache && valueAdded) // Keep a copy of the value from the response frame
+        storeCacheValue(cache, workingpdu.getvalueasn1);
+}
+
+// Adds the value of a node bound with bindVariable() or bindConstant() to the response
+void SimpleSNMP::addBoundValue(const snmpNode *node)
+{
+    const byte *src = (const byte *)node->variable;
+    switch (node->variableType)
+    {
+    case SNMP_DATATYPE_NOTSET: // Encoded constant, possibly in PROGMEM so the header is read a byte at a time
+    {
+        byte type = pgm_read_byte(src);
+        uint16_t len = pgm_read_byte(src + 1);
+        byte hdr = 2;
+        if (len == 0x81)
+        {
+            len = pgm_read_byte(src + 2);
+            hdr = 3;
+        }
+        else if (len == 0x82)
         {
-            flist->RWcommandAction = action; // Update function pointer
-                                             //            flist->SNMPreqtype = SNMP_TYPECODE_GSETREQ;
-            return true;                     // indicate that we matched the command
+            len = (pgm_read_byte(src + 2) << 8) | pgm_read_byte(src + 3);
+            hdr = 4;
         }
-        flist = flist->next; // Iterate to next member
+        addResponseValue(type, src + hdr, len);
+        return;
+    }
+    case SNMP_DATATYPE_OCTETSTRING:
+        addResponseValue(SNMP_DATATYPE_OCTETSTRING, src, strlen_P((const char *)src));
+        return;
     }
-    return false; // failed to match the command
+
+    byte buff[9];
+    uint64_t value = readVariable(node->variable, node->variableSize);
+    bool isSigned = node->variableType == SNMP_DATATYPE_INTEGER;
+    if (node->variableType != SNMP_DATATYPE_COUNTER64) // 32 bit types send the low 32 bits
+        value = isSigned ? (uint64_t)(int64_t)(int32_t)value : (uint32_t)value;
+    byte *data = encodeInteger(buff + 9, value, isSigned);
+    addResponseValue(node->variableType, data, buff + 9 - data);
+}
+
+// Reads a bound integer variable of size bytes, a signed variable is sign extended to 64 bits
+// A 64 bit variable can't be read in one go on a 32 bit processor, it's read again until two reads match so a value being
+// updated by an interrupt isn't sent torn
+uint64_t SimpleSNMP::readVariable(const volatile void *variable, byte size)
+{
+    bool isSigned = size & SNMP_VARIABLE_SIGNED;
+    switch (size & ~SNMP_VARIABLE_SIGNED)
+    {
+    case 1:
+        return isSigned ? (uint64_t)(int64_t)*(const volatile int8_t *)variable : *(const volatile uint8_t *)variable;
+    case 2:
+        return isSigned ? (uint64_t)(int64_t)*(const volatile int16_t *)variable : *(const volatile uint16_t *)variable;
+    case 4:
+        return isSigned ? (uint64_t)(int64_t)*(const volatile int32_t *)variable : *(const volatile uint32_t *)variable;
+    case 8:
+    {
+        const volatile uint64_t *v = (const volatile uint64_t *)variable;
+        uint64_t value = *v;
+        for (uint64_t again = *v; again != value; again = *v)
+            value = again;
+        return value;
+    }
+    }
+    return 0;
 }
 
-// Walks the list looking for a command match and if found calls the attached function to process the command
-bool SimpleSNMP::processGetRequest(const char *oidfind)
+// Stores an encoded value into a node cache and restarts it's ttl
+// A value larger than the cache is not stored
+void SimpleSNMP::storeCacheValue(snmpCache *cache, byte *valueasn1)
 {
-    snmpNode *flist = head; // initialise flist to point to the first entry in the list
-    while (flist != NULL)   // Traverse the list.
+    uint16_t len = getASNhdrlen(valueasn1) + getASNlen(valueasn1);
+    if (len > cache->size)
     {
-        // myLog_P(PSTR("%s: Looking for %s, found %s\r\n"), __func__, oidfind, flist->oid);
-        if (compareStr_P(oidfind, flist->oid)) // Check for command match
+        cache->len = 0;
+        return;
+    }
+    memcpy(cache->value, valueasn1, len);
+    cache->len = len;
+    cache->time = millis();
+}
+
+// Points the workingpdu oid fields at a varbind from the received varbind list ready for the support function, vb counts from 0
+// Returns a pointer to the varbind oid
+byte *SimpleSNMP::selectVarbind(byte vb)
+{
+    byte *oidasn1 = varbindOid(vb);
+    workingpdu.oidasn1 = oidasn1;
+    workingpdu.nextoidasn1 = NULL;
+    workingpdu.getvalueasn1 = NULL;
+    if (workingpdu.requesttype == SNMP_TYPECODE_GSETREQ) // If it's a set request, user data field immidietly follows the oid field
+        workingpdu.setvalueasn1 = oidasn1 + oidasn1[1] + 2; // set pointer to user data field, parsepdu() only accepts short form oids
+    valueAdded = false;
+    valueSkipped = false;
+    return oidasn1;
+}
+
+// Checks if an unregistered oid is an instance of a registered object, ie a registered oid shares all but it's last sub identifier
+// idx is the registry position the oid would be inserted at, any oids sharing the object part are next to it
+// Used to choose between noSuchInstance and noSuchObject
+bool SimpleSNMP::isInstanceOf(uint16_t idx, const byte *oidasn1)
+{
+    int objlen = oidasn1[1] - 1; // Find the start of the last sub identifier
+    while (objlen > 0 && (oidasn1[2 + objlen - 1] & 0x80))
+        objlen--;
+    if (objlen <= 0)
+        return false;
+    for (uint16_t i = idx ? idx - 1 : idx; i <= idx && i < nodeCount; i++) // Check the nodes either side
+    {
+        const byte *oid = nodes[i].oid;
+        if (oid[1] <= objlen || memcmp(oid + 2, oidasn1 + 2, objlen))
+            continue;
+        int end = objlen; // The node must be the object plus one sub identifier, a longer oid is a different object
+        while (end < oid[1] - 1 && (oid[2 + end] & 0x80))
+            end++;
+        if (end == oid[1] - 1)
+            return true;
+    }
+    return false;
+}
+
+// Finds the first registered oid, or table cell, that follows oidasn1 for a getnext
+// pos is left past the end of the registry if there isn't one
+void SimpleSNMP::seekNext(const byte *oidasn1, snmpWalkPos *pos)
+{
+    bool exact;
+    pos->idx = findNode(oidasn1, &exact);
+    if (!exact && pos->idx && inTable(pos->idx - 1, oidasn1)) // Inside a table, look for the next cell
+    {
+        pos->idx--;
+        if (seekTableCell(pos, oidasn1))
+            return;
+        pos->idx++;
+    }
+    else if (exact && !nodes[pos->idx].table) // Exact match, step on to the next node.  A table's cells all follow it's entry oid
+        pos->idx++;
+    seekNode(pos);
+}
+
+// Moves pos to the first oid there is from the start of node pos->idx, a table's first cell, empty tables are stepped over
+void SimpleSNMP::seekNode(snmpWalkPos *pos)
+{
+    for (; pos->idx < nodeCount; pos->idx++)
+    {
+        if (!nodes[pos->idx].table || seekTableCell(pos, nodes[pos->idx].oid))
+            return;
+    }
+}
+
+// Finds the first cell of table node pos->idx after oidasn1, which is the entry oid or one below it
+// Columns are walked in turn, every row of a column before the next column, as a getnext walk of a table expects
+// Returns false if there are no more cells
+bool SimpleSNMP::seekTableCell(snmpWalkPos *pos, const byte *oidasn1)
+{
+    snmpTable *table = nodes[pos->idx].table;
+    const byte *sub = oidasn1 + 2 + nodes[pos->idx].oid[1]; // Sub identifiers after the entry oid, if there are any
+    const byte *end = oidasn1 + 2 + oidasn1[1];
+    uint32_t column = 0;
+    uint32_t row;
+    int32_t after = -1; // Row to start after in the requested column
+    if (decodeSubid(&sub, end, &column) && decodeSubid(&sub, end, &row))
+        after = row > 0x7FFFFFFF ? 0x7FFFFFFF : row;
+    for (pos->column = 0; pos->column < table->columnCount; pos->column++)
+    {
+        byte c = pgm_read_byte(table->columns + pos->column);
+        if (c < column)
+            continue;
+        int32_t start = c == column ? after : -1;
+        pos->row = table->nextRow(start);
+        if (pos->row > start) // A row index that doesn't move forward is taken as the end, a walk can't loop
+            return true;
+    }
+    return false;
+}
+
+// Moves pos on to the following registered oid or table cell, past the end of the registry if there isn't one
+void SimpleSNMP::stepNext(snmpWalkPos *pos)
+{
+    if (pos->idx >= nodeCount)
+        return;
+    snmpTable *table = nodes[pos->idx].table;
+    if (table)
+    {
+        int32_t row = table->nextRow(pos->row); // Next row in the column
+        if (row > pos->row)
+        {
+            pos->row = row;
+            return;
+        }
+        while (++pos->column < table->columnCount) // Then the first row of the next column
         {
-            if (flist && flist->ROcommandAction) // check is wasn't the last one and we have a function to call
-                flist->ROcommandAction();        // Run command, command function should build and send the appropriate response record
-            return true;                         // indicate that we matched the command and break out
+            pos->row = table->nextRow(-1);
+            if (pos->row >= 0)
+                return;
         }
-        flist = flist->next; // Iterate to next member
     }
-    sendErrorResponse(SNMP_NOSUCHNAME);
-    return false; // failed to match the command
+    pos->idx++;
+    seekNode(pos);
 }
 
-// Walks the list looking for a command match and if found calls the next nodes attached function to process the command
-bool SimpleSNMP::processGetNextRequest(const char *oidfind) // Function to print the nodes of the linked list.  Returns true if command was matched
+// Adds the value at a walk position to the response for a getnext or getbulk, the response carries the registered oid or cell oid
+// A table cell without a value, eg it's row has just gone, is stepped over so pos can move on, past the end of the registry if nothing follows
+// A Counter64 value is stepped over in the same way for a v1 client, RFC 2576 4.1.2.1
+void SimpleSNMP::readPosition(snmpWalkPos *pos)
 {
-    snmpNode *flist = head;
-    while (flist != NULL) // Traverse the list.
+    valueAdded = false;
+    valueSkipped = false;
+    while (pos->idx < nodeCount)
     {
-        if (compareStr_P(oidfind, flist->oid)) // Check for exact command match and return the next oid
+        snmpTable *table = nodes[pos->idx].table;
+        if (!table)
         {
-            flist = flist->next; // Jump to next node
-            workingpdu.nextoidasn1 = char2oid(flist->oid);
-            if (flist && flist->ROcommandAction) // check is wasn't the last one and we have a function to call
-                flist->ROcommandAction();        // Run command, command function should build and send the appropriate response record
-            return true;                         // indicate that we matched the command and break out
+            workingpdu.nextoidasn1 = nodes[pos->idx].oid;
+            runReadAction(pos->idx);
+            if (!valueSkipped)
+                return;
+            valueSkipped = false;
+            stepNext(pos);
+            continue;
         }
-        else if (comparepStr_P(oidfind, flist->oid)) // Check for partial command match and return matching oid
+        byte column = pgm_read_byte(table->columns + pos->column);
+        SnmpValue value;
+        value.type = SNMP_DATATYPE_NOTSET;
+        SNMP_TIMING_START(callStart);
+        bool read = table->readCell(column, pos->row, &value);
+        SNMP_TIMING_CALLBACK(callStart);
+        if (read && value.type != SNMP_DATATYPE_NOTSET)
         {
-            workingpdu.nextoidasn1 = char2oid(flist->oid);
-            if (flist && flist->ROcommandAction) // check is wasn't the last one and we have a function to call
-                flist->ROcommandAction();        // Run command, command function should build and send the appropriate response record
-            return true;                         // indicate that we matched the command and break out
+            workingpdu.nextoidasn1 = tableCellOid(pos->idx, column, pos->row);
+            if (nodeHits)
+                nodeHits[pos->idx]++;
+            addResponseValue(&value);
+            if (!valueSkipped)
+                return;
+            valueSkipped = false;
         }
-        flist = flist->next; // Iterate to next member if no match
+        stepNext(pos);
     }
-    sendErrorResponse(SNMP_NOSUCHNAME);
-    return false; // failed to match the command
 }
 
-// Walks the list looking for a command match and if found calls the attached function to process the command
-bool SimpleSNMP::processSetRequest(const char *oidfind) // Function to print the nodes of the linked list.  Returns true if command was matched
+// Checks if an oid is a cell of a table, ie it's below the entry oid of table node idx
+bool SimpleSNMP::inTable(uint16_t idx, const byte *oidasn1)
 {
-    snmpNode *flist = head;
-    while (flist != NULL) // Traverse the list.
+    if (idx >= nodeCount || !nodes[idx].table)
+        return false;
+    byte *entry = nodes[idx].oid;
+    return oidasn1[1] > entry[1] && !memcmp(oidasn1 + 2, entry + 2, entry[1]);
+}
+
+// Adds the value of a table cell for a getreq, oidasn1 is below the entry oid of table node idx
+// The row must be one nextRow() reports and the cell must have a value
+// Returns SNMP_DATATYPE_NOTSET if the value was added, otherwise the exception to return in it's place
+byte SimpleSNMP::getTableCell(uint16_t idx, const byte *oidasn1)
+{
+    snmpTable *table = nodes[idx].table;
+    const byte *sub = oidasn1 + 2 + nodes[idx].oid[1];
+    const byte *end = oidasn1 + 2 + oidasn1[1];
+    uint32_t column = 0;
+    uint32_t row;
+    decodeSubid(&sub, end, &column);
+    byte i = 0;
+    while (i < table->columnCount && pgm_read_byte(table->columns + i) != column)
+        i++;
+    if (i == table->columnCount) // Not a column of the table
+        return SNMP_DATATYPE_NOSUCHOBJECT;
+    if (!decodeSubid(&sub, end, &row) || sub != end || row > 0x7FFFFFFF)
+        return SNMP_DATATYPE_NOSUCHINSTANCE;
+    if (table->nextRow((int32_t)row - 1) != (int32_t)row) // Not a row that exists
+        return SNMP_DATATYPE_NOSUCHINSTANCE;
+    SnmpValue value;
+    value.type = SNMP_DATATYPE_NOTSET;
+    SNMP_TIMING_START(callStart);
+    bool read = table->readCell(column, row, &value);
+    SNMP_TIMING_CALLBACK(callStart);
+    if (!read || value.type == SNMP_DATATYPE_NOTSET)
+        return SNMP_DATATYPE_NOSUCHINSTANCE;
+    if (nodeHits)
+        nodeHits[idx]++;
+    addResponseValue(&value); // The response carries the requested oid
+    return SNMP_DATATYPE_NOTSET;
+}
+
+// Builds the asn.1 oid of a table cell, the entry oid followed by the column and row, in cellOid and returns it
+byte *SimpleSNMP::tableCellOid(uint16_t idx, byte column, int32_t row)
+{
+    byte *entry = nodes[idx].oid;
+    memcpy(cellOid, entry, entry[1] + 2);
+    byte *pos = cellOid + 2 + entry[1];
+    *pos++ = column;
+    byte digits[5]; // A 31 bit row index is up to 5 sub identifier bytes, most significant first with the top bit set on all but the last
+    byte count = 0;
+    uint32_t value = row;
+    do
     {
-        if (compareStr_P(oidfind, flist->oid)) // Check for command match
+        digits[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+    while (count--)
+        *pos++ = digits[count] | (count ? 0x80 : 0x00);
+    cellOid[1] = pos - cellOid - 2;
+    return cellOid;
+}
+
+// Reads one oid sub identifier at *pos and moves *pos past it, values too large for 32 bits are returned as 0xFFFFFFFF
+// Returns false if there isn't a complete sub identifier before end
+bool SimpleSNMP::decodeSubid(const byte **pos, const byte *end, uint32_t *value)
+{
+    uint32_t v = 0;
+    while (*pos < end)
+    {
+        byte b = *(*pos)++;
+        v = v > 0x1FFFFFF ? 0xFFFFFFFF : (v << 7) | (b & 0x7F);
+        if (!(b & 0x80))
         {
-            if (flist->RWcommandAction) // Check this oid has a RW function attached
-            {
-                flist->RWcommandAction(); // Run command,  command function should action the change then build and send the appropriate response record
-                return true;              // indicate that we matched the command
-            }
-            else // oid matched but not RW
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Processes a getbulkreq as described in rfc 3416 4.2.3
+// The first non-repeaters varbinds get a single getnext, the remaining varbinds get max-repetitions getnexts, each following on from the last
+// Results are added until the response is full, a smaller response than requested is allowed
+bool SimpleSNMP::processGetBulkRequest(void)
+{
+    long nonRepeaters = decodeInt(workingpdu.errorasn1);      // getbulkreq uses the error field for non-repeaters
+    long maxRepetitions = decodeInt(workingpdu.erroridxasn1); // and the error index field for max-repetitions
+    snmpWalkPos cursor[SNMP_MAX_REQUEST_VARBINDS];            // registry position of the next oid to return for each repeater
+    byte *lastoid[SNMP_MAX_REQUEST_VARBINDS];                 // last oid returned for each repeater, reported with end of mib view
+    byte repeaters = 0;
+    long vbnum = 0;
+
+    for (byte vb = 0; vb < workingpdu.vbcount; vb++, vbnum++)
+    {
+        byte *oidasn1 = varbindOid(vb);
+        snmpWalkPos pos;
+        seekNext(oidasn1, &pos);
+        if (vbnum < nonRepeaters) // non-repeater, single getnext
+        {
+            if (!addBulkVarbind(&pos, oidasn1))
+                return true; // response is full
+        }
+        else // repeater, save it for the repetitions, parsepdu() accepts no more than SNMP_MAX_REQUEST_VARBINDS so every one fits
+        {
+            cursor[repeaters] = pos;
+            lastoid[repeaters] = oidasn1;
+            repeaters++;
+        }
+    }
+
+    for (long rep = 0; rep < maxRepetitions && repeaters; rep++)
+    {
+        bool endOfMib = true; // set false if any repeater still has oids to return
+        for (byte r = 0; r < repeaters; r++)
+        {
+            if (!addBulkVarbind(&cursor[r], lastoid[r]))
+                return true; // response is full
+            if (cursor[r].idx < nodeCount)
             {
-                sendErrorResponse(SNMP_READONLY);
-                return false; // indicate that we matched the command but it was RO
+                lastoid[r] = responseOid; // The oid just returned, a table cell's oid is only held in the response
+                stepNext(&cursor[r]);
+                endOfMib = false;
             }
         }
-        flist = flist->next; // Iterate to next member
+        if (endOfMib) // Nothing more to return
+            break;
     }
-    sendErrorResponse(SNMP_NOSUCHNAME);
-    return false; // failed to match the command
+    return true;
 }
 
-// Walks the list displaying each element found
-// level is the recursion level to display
-bool SimpleSNMP::dumpList(void)
+// Adds one getbulkreq result to the response, pos is the registry position to return, table cells that have gone are stepped over
+// If pos is past the end of the registry then oidasn1 is returned with an end of mib view value
+// Returns false once the response is full
+bool SimpleSNMP::addBulkVarbind(snmpWalkPos *pos, byte *oidasn1)
+{
+    readPosition(pos);
+    if (pos->idx >= nodeCount)
+    {
+        byte endOfMibView[] = {SNMP_DATATYPE_ENDOFMIBVIEW, 0x00};
+        return appendVarbind(oidasn1, endOfMibView);
+    }
+    if (responseFull)
+        return false;
+    if (!valueAdded) // support function didn't respond, return a null so the repetitions stay in step
+    {
+        byte nullValue[] = {SNMP_DATATYPE_NULL, 0x00};
+        return appendVarbind(nodes[pos->idx].oid, nullValue);
+    }
+    return true;
+}
+
+// Returns the oid of a received varbind from the index parsepdu() built, vb counts from 0 and must be less than workingpdu.vbcount
+byte *SimpleSNMP::varbindOid(byte vb)
 {
-    return dumpList(head, 1); // Start listing at level 1
+    return workingpdu.rxdata + vbindex[vb];
 }
-bool SimpleSNMP::dumpList(snmpNode *flist, byte level)
+
+// Looks up each oid in the varbind list and calls the attached write function to action the change
+// Every oid is checked before any write function is called so a failure doesn't leave the request partly applied
+// Errors are reported against the first oid that failed
+bool SimpleSNMP::processSetRequest(void)
 {
-    if (flist)
+    byte vbindex = 0; // 1 based position in the varbind list, reported in the error index
+    for (byte vb = 0; vb < workingpdu.vbcount; vb++)
     {
-        myLog_P(PSTR("%s: Level %3d"), __func__, level);
-        myLog_P(PSTR(" oid:[%30s]"), FPSTR(flist->oid));
-        myLog_P(PSTR("ROfunc: [%s]"), flist->ROcommandAction ? "Set" : "Null");
-        myLog_P(PSTR("\tRWfunc: [%s]"), flist->RWcommandAction ? "Set" : "Null");
-        return dumpList(flist->next, ++level); // recurse into next item
+        byte *oidasn1 = varbindOid(vb);
+        vbindex++;
+        bool exact;
+        uint16_t idx = findNode(oidasn1, &exact);
+        if (!exact && idx && inTable(idx - 1, oidasn1)) // tables are read only
+        {
+            sendErrorResponse(workingpdu.version == 1 ? SNMP_READONLY : SNMP_NOTWRITABLE, vbindex);
+            return false;
+        }
+        if (!exact || nodes[idx].table) // oid not registered
+        {
+            sendErrorResponse(workingpdu.version == 1 ? SNMP_NOSUCHNAME : SNMP_NOCREATION, vbindex);
+            return false;
+        }
+        if (!nodes[idx].RWcommandAction) // oid matched but not RW
+        {
+            sendErrorResponse(workingpdu.version == 1 ? SNMP_READONLY : SNMP_NOTWRITABLE, vbindex);
+            return false;
+        }
+    }
+
+    vbindex = 0;
+    for (byte vb = 0; vb < workingpdu.vbcount; vb++)
+    {
+        byte *oidasn1 = selectVarbind(vb);
+        vbindex++;
+        bool exact;
+        uint16_t idx = findNode(oidasn1, &exact);
+        if (nodeHits)
+            nodeHits[idx]++;
+        SNMP_TIMING_START(callStart);
+        nodes[idx].RWcommandAction(); // Run command,  command function should action the change then add the value written to the response
+        SNMP_TIMING_CALLBACK(callStart);
+        if (nodes[idx].cache && !registryShared) // The cached value is out of date
+            nodes[idx].cache->len = 0;
+        if (responseFull)
+        {
+            sendErrorResponse(SNMP_TOOBIG, 0);
+            return false;
+        }
+        if (!valueAdded)
+        {
+            sendErrorResponse(SNMP_GENERR, vbindex);
+            return false;
+        }
+    }
+    return true;
+}
+
+#if SNMP_LOG_LEVEL >= SNMP_LOG_DEBUG
+// Lists each element of the registry
+bool SimpleSNMP::dumpList(void)
+{
+    for (uint16_t i = 0; i < nodeCount; i++)
+    {
+        oid2char(nodes[i].oid); // Store oid into gpbuff
+        myLog_P(PSTR("%s: Node %3d"), __func__, i);
+        myLog_P(PSTR(" oid:[%30s]"), (char *)gpbuff);
+        myLog_P(PSTR("ROfunc: [%s]"), nodes[i].table ? "Table" : nodes[i].variable ? "Bound" : nodes[i].ROcommandAction || nodes[i].ROvalueAction ? "Set" : "Null");
+        myLog_P(PSTR("\tRWfunc: [%s]\r\n"), nodes[i].RWcommandAction ? "Set" : "Null");
     }
     return true;
 }
+#endif
 
-// Compares two strings, PROGMEM safe
-// Returns if both match and are the same length
-bool SimpleSNMP::compareStr_P(const char *o1, const char *o2)
+#if SNMP_STAGE_TIMING
+// Returns the times recorded for a stage, they're counts of ESP.getCycleCount()
+// The struct is updated in place as requests are processed, copy it to get a consistent view from another thread
+const SnmpStageTiming *SimpleSNMP::stageTiming(SNMP_STAGE stage)
 {
-    char c1 = pgm_read_byte(o1++); // Read first character
-    char c2 = pgm_read_byte(o2++); // Read first character
+    return stage < SNMP_STAGE_COUNT ? stageTimes + stage : NULL;
+}
 
-    while (c1 && c2 && c1 == c2)
+// Clears the times recorded for every stage
+void SimpleSNMP::resetStageTiming(void)
+{
+    memset(stageTimes, 0, sizeof(stageTimes));
+    callbackCycles = 0;
+}
+
+// Adds a time to a stage, the bucket is the position of the top bit set so each bucket covers twice the range of the one before
+void SimpleSNMP::recordStage(byte stage, uint32_t cycles)
+{
+    SnmpStageTiming *timing = stageTimes + stage;
+    byte bucket = 31 - __builtin_clz(cycles | 1);
+    if (bucket >= SNMP_TIMING_BUCKETS)
+        bucket = SNMP_TIMING_BUCKETS - 1;
+    timing->buckets[bucket]++;
+    timing->count++;
+    timing->total += cycles;
+    if (cycles > timing->max)
+        timing->max = cycles;
+}
+
+// Logs the count, mean and longest time of each stage, followed by the histogram buckets that have been used
+void SimpleSNMP::dumpStageTiming(void)
+{
+    static const char *const stageNames[SNMP_STAGE_COUNT] = {"receive", "parse", "lookup", "callback", "headers", "send", "request"};
+    for (byte i = 0; i < SNMP_STAGE_COUNT; i++)
     {
-        c1 = pgm_read_byte(o1++); // Read first character
-        c2 = pgm_read_byte(o2++); // Read first character
+        SnmpStageTiming *timing = stageTimes + i;
+        myLog_P(PSTR("%-8s count %lu mean %lu max %lu\r\n"), stageNames[i], (unsigned long)timing->count,
+                (unsigned long)(timing->count ? timing->total / timing->count : 0), (unsigned long)timing->max);
+        for (byte b = 0; b < SNMP_TIMING_BUCKETS; b++)
+        {
+            if (timing->buckets[b])
+                myLog_P(PSTR("    %s%lu %lu\r\n"), b == SNMP_TIMING_BUCKETS - 1 ? ">=" : "<", 1UL << (b == SNMP_TIMING_BUCKETS - 1 ? b : b + 1),
+                        (unsigned long)timing->buckets[b]);
+        }
     }
-    if (c1 == '\0' && c2 == '\0')
-        return true;
-    return false;
 }
+#endif
 
-// Compares two strings, PROGMEM safe
-// Returns true if o1 matches the start of o2
-// o1 is the string we are looking for in o2
-bool SimpleSNMP::comparepStr_P(const char *o1, const char *o2)
+// Compares two asn.1 encoded oids in numeric order, one sub identifier at a time
+// A sub identifier encoded in more bytes is the larger number so the byte values only need comparing when the lengths match
+// An oid that matches the start of a longer oid sorts before it
+// Returns <0 if o1 is before o2, 0 if they match, >0 if o1 is after o2
+int SimpleSNMP::compareOid(const byte *o1, const byte *o2)
 {
-    char c1 = pgm_read_byte(o1++); // Read first character
-    char c2 = pgm_read_byte(o2++); // Read first character
+    int l1 = o1[1]; // data lengths
+    int l2 = o2[1];
+    int i1 = 0; // position of the current sub identifier in each oid
+    int i2 = 0;
+    o1 += 2; // skip over the type and length bytes
+    o2 += 2;
 
-    while (c1 && c2 && c1 == c2)
+    while (i1 < l1 && i2 < l2)
     {
-        c1 = pgm_read_byte(o1++); // Read first character
-        c2 = pgm_read_byte(o2++); // Read first character
+        int e1 = i1; // find the last byte of each sub identifier
+        while (e1 < l1 - 1 && (o1[e1] & 0x80))
+            e1++;
+        int e2 = i2;
+        while (e2 < l2 - 1 && (o2[e2] & 0x80))
+            e2++;
+        if (e1 - i1 != e2 - i2) // different encoded lengths, longer is larger
+            return (e1 - i1) - (e2 - i2);
+        for (; i1 <= e1; i1++, i2++)
+        {
+            if (o1[i1] != o2[i2])
+                return o1[i1] - o2[i2];
+        }
     }
-    if (c1 == '\0') // We got to the end of o1 with a match
-        return true;
-    return false;
+    return (l1 - i1) - (l2 - i2); // all common sub identifiers match, shorter oid is first
 }
 
-// Converts a char string oid text back into an asn.1 encoded oid, PROGMEM safe
+// Converts a char string oid text into an asn.1 encoded oid, PROGMEM safe
+// Only used when registering oids, requests are handled in their asn.1 form
+// nextoid is the output buffer, it must be MAX_OID_SIZE bytes long
 // Returns a pointer to the converted asn.1 buffer or NULL if not found
-byte *SimpleSNMP::char2oid(const char *oidtext) // Converts and oid text string back to an encoded oid asn.1 field and stores it in nextoid
+byte *SimpleSNMP::char2oid(const char *oidtext, byte *nextoid) // Converts and oid text string to an encoded oid asn.1 field and stores it in nextoid
 {
     if (strncmp_P("1.3.", oidtext, 4))
         return NULL;
@@ -1221,6 +3782,8 @@ byte *SimpleSNMP::char2oid(const char *oidtext) // Converts and oid text string
         }
         tidx++;                            // Move ptr to next free byte
         oidtext = findTok_P(oidtext, '.'); // Find the next token, set to null if no token found
+        if (oidtext && tidx > MAX_OID_SIZE - 6) // No room for another 5 byte sub identifier
+            return NULL;
     }
     return nextoid;
 }
@@ -1,8 +1,131 @@
 #pragma once
+#ifdef ARDUINO
 #include <Arduino.h>
+#include "SnmpWiFiUdp.h"
+#else
+#include "SnmpHost.h"
+#endif
+#include "SnmpTransport.h"
 
-#define MAX_OID_SIZE 128   // Largest oid allowed
-#define MAX_COMSTR_SIZE 20 // Largest community string allowed
+#define MAX_OID_SIZE 128     // Largest oid allowed
+#define MAX_COMSTR_SIZE 20   // Largest community string allowed
+#define SNMP_REGISTRY_GROW 8 // Number of registry entries added each time the registry fills up
+
+#ifndef SNMP_MAX_PACKET_SIZE
+#define SNMP_MAX_PACKET_SIZE 1472 // Largest datagram accepted or sent, the udp payload of a 1500 byte ethernet frame, rfc 3417 requires at least 484
+#endif
+#ifndef SNMP_KEY_BLOCK_SIZE
+#define SNMP_KEY_BLOCK_SIZE 128 // Bytes allocated at a time for the registry's encoded oids, they're packed into blocks rather than allocated one by one
+#endif
+#ifndef SNMP_REGISTRY_POOL_SIZE
+#define SNMP_REGISTRY_POOL_SIZE 0 // Nodes in a fixed size registry allocated with the class so registering never uses the heap, 0 grows the registry on the heap
+#endif
+#ifndef SNMP_REGISTRY_POOL_KEYS
+#define SNMP_REGISTRY_POOL_KEYS (SNMP_REGISTRY_POOL_SIZE * 16) // Bytes for the encoded oids of a fixed size registry
+#endif
+#ifndef SNMP_MAX_REQUEST_VARBINDS
+#define SNMP_MAX_REQUEST_VARBINDS 32 // Most varbinds accepted in a request, each uses 2 bytes of the varbind index, larger requests are rejected
+#endif
+#ifndef SNMP_DEDUP_CACHE_SIZE
+#define SNMP_DEDUP_CACHE_SIZE 4 // Number of recent responses kept to answer retransmitted requests, 0 turns retransmit detection off
+#endif
+#ifndef SNMP_DEDUP_RESPONSE_SIZE
+#define SNMP_DEDUP_RESPONSE_SIZE 256 // Largest response kept for retransmitted requests, larger responses are not kept
+#endif
+#ifndef SNMP_DEDUP_TTL
+#define SNMP_DEDUP_TTL 10000 // ms a response is kept for, a repeated request after this is processed again
+#endif
+#ifndef SNMP_DEFER_TABLE_SIZE
+#define SNMP_DEFER_TABLE_SIZE 4 // Number of requests that can be waiting for a deferred response, 0 turns deferred responses off
+#endif
+#ifndef SNMP_DEFER_TIMEOUT
+#define SNMP_DEFER_TIMEOUT 2000 // ms a deferred request waits for it's response before it's answered with a genErr
+#endif
+#ifndef SNMP_DEFER_VALUE_SIZE
+#define SNMP_DEFER_VALUE_SIZE 64 // Largest encoded value a deferred request can be answered with
+#endif
+#ifndef SNMP_TX_HEADROOM
+#define SNMP_TX_HEADROOM 64 // Space reserved in front of the response varbind list for the message headers, written back to front once the varbinds are added
+#endif
+#ifndef SNMP_RX_POOL_SIZE
+#define SNMP_RX_POOL_SIZE 4 // Number of receive buffers, each SNMP_MAX_PACKET_SIZE bytes, allocated with the class, this is the ingress queue length
+#endif
+#ifndef SNMP_ACTION_MAX_PACKETS
+#define SNMP_ACTION_MAX_PACKETS 4 // Default for the most requests processed by each call to action()
+#endif
+#ifndef SNMP_ACTION_MAX_MICROS
+#define SNMP_ACTION_MAX_MICROS 0 // Default for the time each call to action() can spend processing requests in us, 0 for no limit
+#endif
+#ifndef SNMP_ACTION_CPU_SHARE
+#define SNMP_ACTION_CPU_SHARE 100 // Default for the most time action() spends processing requests, as a percent of the time between calls, 100 for no limit
+#endif
+#ifndef SNMP_ACTION_CREDIT_MAX
+#define SNMP_ACTION_CREDIT_MAX 20000 // Most us of processing action() can save up while it's under SNMP_ACTION_CPU_SHARE, limits the burst after a quiet spell
+#endif
+#ifndef SNMP_RATE_SOURCES
+#define SNMP_RATE_SOURCES 8 // Number of sources given their own rate limit, the least recently seen is replaced, 0 turns rate limiting off
+#endif
+#ifndef SNMP_RATE_PROBE
+#define SNMP_RATE_PROBE 4 // Entries of the source table a source can be held in, searched from the entry it hashes to
+#endif
+#ifndef SNMP_SOURCE_RATE
+#define SNMP_SOURCE_RATE 0 // Default packets per second accepted from each source, 0 for no limit
+#endif
+#ifndef SNMP_SOURCE_BURST
+#define SNMP_SOURCE_BURST 20 // Default packets a source can send back to back before it's held to SNMP_SOURCE_RATE
+#endif
+#ifndef SNMP_GLOBAL_RATE
+#define SNMP_GLOBAL_RATE 0 // Default packets per second accepted from all sources together, up to a second's worth back to back, 0 for no limit
+#endif
+#ifndef SNMP_MAX_PRIORITY_MANAGERS
+#define SNMP_MAX_PRIORITY_MANAGERS 4 // Number of managers whose get requests can be given priority
+#endif
+#ifndef SNMP_NOTIFY_QUEUE_SIZE
+#define SNMP_NOTIFY_QUEUE_SIZE 4 // Number of notifications waiting to be sent or acknowledged, 0 turns traps and informs off
+#endif
+#ifndef SNMP_NOTIFY_SIZE
+#define SNMP_NOTIFY_SIZE 256 // Largest varbind list a notification can carry, sysUpTime and snmpTrapOID included
+#endif
+#ifndef SNMP_MAX_NOTIFY_DESTINATIONS
+#define SNMP_MAX_NOTIFY_DESTINATIONS 2 // Number of managers notifications can be sent to
+#endif
+#ifndef SNMP_NOTIFY_BURST
+#define SNMP_NOTIFY_BURST 4 // Default for the most notifications sent to a manager back to back
+#endif
+#ifndef SNMP_NOTIFY_INTERVAL
+#define SNMP_NOTIFY_INTERVAL 250 // Default ms between notifications to a manager once a burst is used up
+#endif
+#ifndef SNMP_INFORM_TIMEOUT
+#define SNMP_INFORM_TIMEOUT 1000 // ms an inform waits for it's response before it's sent again, doubled after each retry
+#endif
+#ifndef SNMP_INFORM_RETRIES
+#define SNMP_INFORM_RETRIES 3 // Number of times an unacknowledged inform is sent again before it's given up on
+#endif
+#ifndef SNMP_STATS_OID
+#define SNMP_STATS_OID "1.3.6.1.4.1.55577.2" // Default subtree exportStatistics() registers the agent's own counters under
+#endif
+#ifndef SNMP_STAGE_TIMING
+#define SNMP_STAGE_TIMING 0 // 1 times each stage of processing a request with the cycle counter, see stageTiming(), 0 compiles the timing out
+#endif
+#ifndef SNMP_TIMING_BUCKETS
+#define SNMP_TIMING_BUCKETS 24 // Histogram buckets for each stage, bucket n counts times of 2^n to 2^(n+1)-1 cycles, the last one anything longer
+#endif
+#define SNMP_LOG_NONE 0  // Log levels for SNMP_LOG_LEVEL, nothing is logged
+#define SNMP_LOG_ERROR 1 // registration and setup failures
+#define SNMP_LOG_WARN 2  // rejected packets as well, a line at a time from action() once the queue is empty
+#define SNMP_LOG_DEBUG 3 // a hex dump of each rejected packet as well, and the dump functions are built
+#ifndef SNMP_LOG_LEVEL
+#define SNMP_LOG_LEVEL SNMP_LOG_ERROR // Most detailed messages logged, anything more detailed isn't compiled
+#endif
+#ifndef SNMP_REJECT_LOG_SIZE
+#define SNMP_REJECT_LOG_SIZE 4 // Number of recent rejected packets kept, see readRejected(), 0 turns the reject log off
+#endif
+#ifndef SNMP_REJECT_CAPTURE
+#define SNMP_REJECT_CAPTURE 48 // Bytes kept from the start of each rejected packet
+#endif
+#if SNMP_NOTIFY_SIZE + 64 > SNMP_MAX_PACKET_SIZE
+#error "SNMP_NOTIFY_SIZE leaves no room for the notification headers within SNMP_MAX_PACKET_SIZE"
+#endif
 
 enum SNMP_PARSE_STAT_CODES // packet parser status return codes
 {
@@ -14,6 +137,14 @@ enum SNMP_PARSE_STAT_CODES // packet parser status return codes
     SNMP_VERSION_NOT_SUPPORTED = 5,
     SNMP_REQTYPE_NOT_SUPPORTED = 6,
     SNMP_COMMUNITYSTRING_NOT_MATCHED = 7,
+    SNMP_TOO_MANY_VARBINDS = 8,
+};
+
+enum SNMP_PRIORITY // ingress queue priority classes, lowest value is processed first
+{
+    SNMP_PRIORITY_HIGH = 0,   // set requests and get requests from priority managers
+    SNMP_PRIORITY_NORMAL = 1, // other get requests
+    SNMP_PRIORITY_BULK = 2,   // getnext and getbulk requests, ie walks
 };
 
 enum SNMP_TYPE_CODE
@@ -42,24 +173,100 @@ enum SNMP_DATA_TYPE
     SNMP_DATATYPE_IPADDRESS = 0x40,
     SNMP_DATATYPE_COUNTER32 = 0x41,
     SNMP_DATATYPE_UNSIGNED = 0x42,
+    SNMP_DATATYPE_GAUGE32 = 0x42, // Same encoding as unsigned
     SNMP_DATATYPE_TIMETICKS = 0x43, // 1/100th of a second
     SNMP_DATATYPE_INT64 = 0x44,
+    SNMP_DATATYPE_COUNTER64 = 0x46, // v2c only
     SNMP_DATATYPE_FLOAT = 0x78,
     SNMP_DATATYPE_DOUBLE = 0x79,
     SNMP_DATATYPE_SIGNED64 = 0x7A,
     SNMP_DATATYPE_UNSIGNED64 = 0x7B,
+    SNMP_DATATYPE_NOSUCHOBJECT = 0x80,   // v2c exception values, returned in place of a value
+    SNMP_DATATYPE_NOSUCHINSTANCE = 0x81, //
+    SNMP_DATATYPE_ENDOFMIBVIEW = 0x82,   //
 };
 
 enum SNMP_ERROR_CODE // https://www.ibm.com/docs/en/zos/2.2.0?topic=snmp-major-minor-error-codes-value-types
 {
     SNMP_NOERROR = 0,
-    SNMP_NOSUCHNAME = 2,
-    SNMP_READONLY = 4,
+    SNMP_TOOBIG = 1,
+    SNMP_NOSUCHNAME = 2, // v1 only
+    SNMP_BADVALUE = 3,   // v1 only
+    SNMP_READONLY = 4,   // v1 only
+    SNMP_GENERR = 5,
+    SNMP_NOCREATION = 11,
+    SNMP_NOTWRITABLE = 17,
+};
+
+enum SNMP_NOTIFY_STATE // delivery state of a notification to one manager
+{
+    SNMP_NOTIFY_DONE = 0,    // sent as a trap, acknowledged, given up on, or not for this manager
+    SNMP_NOTIFY_WAITING = 1, // waiting to be sent, held back by the rate limit
+    SNMP_NOTIFY_SENT = 2,    // inform sent, waiting for the response
+};
+
+enum SNMP_STAGE // stages of processing a request, timed when SNMP_STAGE_TIMING is set
+{
+    SNMP_STAGE_RECEIVE = 0,  // reading a datagram from the transport
+    SNMP_STAGE_PARSE = 1,    // checking the request and indexing it's varbinds
+    SNMP_STAGE_LOOKUP = 2,   // registry lookups and encoding the values, the time in the read and write functions isn't included
+    SNMP_STAGE_CALLBACK = 3, // each call of a read, write or table cell function
+    SNMP_STAGE_HEADERS = 4,  // writing the response headers
+    SNMP_STAGE_SEND = 5,     // handing a response to the transport
+    SNMP_STAGE_REQUEST = 6,  // a whole request, from parsing it to sending the response
+    SNMP_STAGE_COUNT = 7,
+};
+
+enum SNMP_DEFER_STATE // state of a deferred request
+{
+    SNMP_DEFER_PENDING = 0,  // waiting for completeResponse()
+    SNMP_DEFER_COMPLETE = 1, // value ready to send
+    SNMP_DEFER_FAILED = 2,   // error ready to send
 };
 
 typedef byte SNMP_NULL; // Used by send to flag a null data type feild (0x05,0x00)
+typedef uint16_t SnmpHandle; // Identifies a deferred request, see deferResponse()
 typedef byte ASNTYPE;
 
+#define SNMP_VARIABLE_SIGNED 0x80 // Set in a bound variable's size if it's a signed type
+
+// struct SnmpValue is the value slot passed to a value callback, see insertNode()
+// The callback sets the value with one of the set functions and the library encodes it into the response
+// String and oid data is not copied until the callback returns so it must not be held in a local variable
+struct SnmpValue
+{
+    SNMP_DATA_TYPE type; // Type of the value, SNMP_DATATYPE_NOTSET until a value is set
+    union
+    {
+        int32_t integer;     // SNMP_DATATYPE_INTEGER
+        uint32_t unsigned32; // SNMP_DATATYPE_COUNTER32, SNMP_DATATYPE_GAUGE32, SNMP_DATATYPE_TIMETICKS
+        uint64_t unsigned64; // SNMP_DATATYPE_COUNTER64
+        byte ipaddress[4];   // SNMP_DATATYPE_IPADDRESS
+        struct
+        {
+            const byte *data; // string or encoded oid sub identifiers, can be in PROGMEM
+            uint16_t len;     // length of data
+        } octets;             // SNMP_DATATYPE_OCTETSTRING, SNMP_DATATYPE_OID
+    };
+
+    void setInteger(int32_t value) { type = SNMP_DATATYPE_INTEGER, integer = value; }
+    void setCounter32(uint32_t value) { type = SNMP_DATATYPE_COUNTER32, unsigned32 = value; }
+    void setGauge32(uint32_t value) { type = SNMP_DATATYPE_GAUGE32, unsigned32 = value; }
+    void setTimeTicks(uint32_t value) { type = SNMP_DATATYPE_TIMETICKS, unsigned32 = value; }
+    void setCounter64(uint64_t value) { type = SNMP_DATATYPE_COUNTER64, unsigned64 = value; }
+    void setIpAddress(IPAddress value) { type = SNMP_DATATYPE_IPADDRESS, ipaddress[0] = value[0], ipaddress[1] = value[1], ipaddress[2] = value[2], ipaddress[3] = value[3]; }
+    void setString(const char *value) { setOctets((const byte *)value, strlen_P(value)); } // PROGMEM friendly
+    void setOctets(const byte *value, uint16_t len) { type = SNMP_DATATYPE_OCTETSTRING, octets.data = value, octets.len = len; }
+    void setOid(const ASNTYPE *value) { type = SNMP_DATATYPE_OID, octets.data = value + 2, octets.len = value[1]; } // value is an asn.1 encoded oid
+};
+
+// struct SnmpVarbind is one of the values a notification carries, see sendNotification()
+struct SnmpVarbind
+{
+    const char *oidtext; // oid text, can be in PROGMEM
+    SnmpValue value;     // the value, set with one of it's set functions
+};
+
 // struct holding pointers to each field within the received data frame.  The actual data stays in the rxbuffer
 struct pdudata
 {
@@ -69,39 +276,274 @@ struct pdudata
     byte *reqidasn1;    // points to the request id field
     byte *errorasn1;    // poijnts to the rrror field
     byte *erroridxasn1; // points to the error index field
+    byte *vblistasn1;   // points to the varbind list
     byte *oidasn1;      // points to the oid field
     byte *nextoidasn1;  // optional field, points to the next oid on a getnetxreq
     byte *setvalueasn1; // optional field, points to the user data field on a setreq, used by the set function
     byte *getvalueasn1; // optional field, points to the user data field to be returned on a getreq or getnextreq, set by the get function
     byte requesttype;   // Set to the pdu type, getreq, getnextreq of setreq
     byte version;       // Set to the version number
+    byte vbcount;       // Number of varbinds in the request, parsepdu() indexes them in vbindex
 };
 
-// class snmpNode is used to store the instance data and the pointer to the next node, a new instance is created for every oid to be supported
+// struct snmpCache holds the last value returned for a registry node so repeat requests don't need to call the read function, see setCacheTTL()
+struct snmpCache
+{
+    unsigned long ttl;  // time a value is served from the cache for in ms
+    unsigned long time; // millis() when the value was stored
+    uint16_t size;      // space allocated for the value
+    uint16_t len;       // length of the stored value including it's asn.1 header, 0 if nothing is stored
+    byte *value;        // the asn.1 encoded value
+};
+
+// struct snmpDedupEntry holds a recent response so a retransmitted request can be answered without processing it again
+struct snmpDedupEntry
+{
+    uint32_t ip;                             // requestor ip address
+    uint16_t port;                           // requestor udp port
+    uint16_t endpoint;                       // transport endpoint the request arrived on
+    uint16_t reqlen;                         // length of the request
+    uint32_t hash;                           // hash of the whole request, including the request id
+    unsigned long time;                      // millis() when the response was sent
+    uint16_t len;                            // length of the response, 0 if the entry is unused
+    byte response[SNMP_DEDUP_RESPONSE_SIZE]; // the response datagram
+};
+
+// struct snmpRxEntry describes the request held in a receive buffer, the receive buffers form the ingress queue
+struct snmpRxEntry
+{
+    uint16_t len;  // length of the received frame, 0 if the buffer is free
+    byte priority; // SNMP_PRIORITY class
+    uint16_t seq;  // arrival order, requests in the same class are processed oldest first
+    IPAddress ip;      // requestor ip address
+    uint16_t port;     // requestor udp port
+    uint16_t endpoint; // transport endpoint it arrived on, see SnmpTransport::endpoint()
+};
+
+#if SNMP_RATE_SOURCES
+// struct snmpRateBucket is the token bucket of one source, see setRateLimit()
+struct snmpRateBucket
+{
+    uint32_t ip;        // source address, 0 if the entry is unused
+    uint32_t tokens;    // packets that can be accepted now, in 1/1000ths of a packet
+    unsigned long last; // millis() when it was last refilled, ie when the source was last seen
+};
+#endif
+
+// struct snmpDeferred holds the details of a deferred request needed to send it's response later
+struct snmpDeferred
+{
+    SnmpHandle id;                      // handle given out for the request, 0 if the entry is free
+    byte state;                         // SNMP_DEFER_STATE
+    byte error;                         // error status sent if the request failed
+    unsigned long time;                 // millis() when the request was deferred
+    IPAddress ip;                       // requestor ip address
+    uint16_t port;                      // requestor udp port
+    uint16_t endpoint;                  // transport endpoint the request arrived on
+    byte requesttype;                   // request pdu type
+    byte version;                       // request snmp version
+    byte versionasn1[3];                // request version field
+    byte reqidasn1[6];                  // request id field
+    byte comstrasn1[MAX_COMSTR_SIZE + 2]; // request community string field
+    byte oidasn1[MAX_OID_SIZE];         // oid the response carries
+    byte value[SNMP_DEFER_VALUE_SIZE];  // encoded response value once completed
+#if SNMP_DEDUP_CACHE_SIZE
+    uint32_t hash;   // request hash, the response is kept in case the request is retransmitted
+    uint16_t reqlen; // request length
+#endif
+};
+
+// struct snmpNotifyDestination is a manager notifications are sent to, see addNotifyDestination()
+struct snmpNotifyDestination
+{
+    IPAddress ip;                      // manager ip address
+    uint16_t port;                     // manager udp port, usually 162
+    bool inform;                       // send informs rather than traps
+    char community[MAX_COMSTR_SIZE];   // community string the notifications carry
+    byte tokens;                       // notifications that can be sent now, the rate limit
+    unsigned long refillTime;          // millis() when a token was last added
+};
+
+// struct snmpDelivery is the progress of a notification to one manager
+struct snmpDelivery
+{
+    byte state;         // SNMP_NOTIFY_STATE
+    byte retries;       // number of times an inform has been sent again
+    unsigned long time; // millis() when an inform was last sent
+    int32_t requestId;  // request id of an inform, it's response carries the same id
+};
+
+// struct snmpNotification is a notification in the outbound queue, the varbind list is encoded when it's raised
+struct snmpNotification
+{
+    uint16_t len;                                       // length of the encoded varbinds, 0 if the entry is free
+    uint16_t seq;                                       // order raised, notifications are sent oldest first
+    byte trapOid;                                       // offset of the snmpTrapOID value in varbinds, used to merge repeats
+    snmpDelivery delivery[SNMP_MAX_NOTIFY_DESTINATIONS]; // progress to each manager
+    byte varbinds[SNMP_NOTIFY_SIZE];                    // encoded varbinds, the contents of the varbind list
+};
+
+#if SNMP_STAGE_TIMING
+// struct SnmpStageTiming holds the times recorded for one stage, see stageTiming()
+// Times are counts of ESP.getCycleCount(), cpu cycles on an esp, on a Linux host time stamp counter ticks on x86 and ns elsewhere
+struct SnmpStageTiming
+{
+    uint32_t count;                        // number of times recorded
+    uint64_t total;                        // sum of the times
+    uint32_t max;                          // longest time
+    uint32_t buckets[SNMP_TIMING_BUCKETS]; // log scale histogram, bucket n counts times of 2^n to 2^(n+1)-1
+};
+#endif
+
+#if SNMP_REJECT_LOG_SIZE
+// struct SnmpRejectedPacket is a request that failed validation, kept in the reject log, see readRejected()
+struct SnmpRejectedPacket
+{
+    uint32_t seq;                   // order rejected, counts from 1, a gap means older packets were overwritten before being read
+    unsigned long time;             // millis() when it was rejected
+    uint32_t ip;                    // where it came from, as (uint32_t)IPAddress
+    uint16_t port;                  //
+    uint16_t len;                   // length of the packet received
+    byte error;                     // why it was rejected, a SNMP_PARSE_STAT_CODES value
+    byte data[SNMP_REJECT_CAPTURE]; // the start of the packet, the first len bytes up to SNMP_REJECT_CAPTURE
+};
+#endif
+
+// struct snmpTable describes a conceptual table registered with addTable(), one registry node answers for every cell
+// Cells are the table's entry oid followed by the column number and the row index, eg ifDescr.3 is 1.3.6.1.2.1.2.2.1.2.3
+struct snmpTable
+{
+    const byte *columns;                                          // column numbers in ascending order, can be in PROGMEM
+    byte columnCount;                                             // number of columns
+    int32_t (*nextRow)(int32_t after);                            // returns the first row index after after, -1 if there isn't one
+    bool (*readCell)(byte column, int32_t row, SnmpValue *value); // sets the value of a cell, returns false if it has no value
+};
+
+// struct snmpWalkPos is a position in the registry used by getnext and getbulk requests, a table node has a position for each cell
+struct snmpWalkPos
+{
+    uint16_t idx; // registry node, nodeCount once past the end of the registry
+    byte column;  // position in the table's column list
+    int32_t row;  // table row index
+};
+
+// class snmpNode is used to store the instance data, one entry is held in the registry for every oid to be supported
+// The registry is a contiguous array of nodes kept sorted in numeric oid order so lookups can use a binary search
 class snmpNode
 {
 public:
-    const char *oid;           // Pointer to command text to match, data is decoded into char *
-    void (*ROcommandAction)(); // pointer to function to read the value
+    byte *oid;                              // Pointer to the asn.1 encoded oid including the type and length bytes, this is the registry key
+    void (*ROcommandAction)();              // pointer to function to read the value
+    bool (*ROvalueAction)(SnmpValue *value); // pointer to function to read the value into a value slot, used instead of ROcommandAction if set
+    snmpCache *cache;                       // value cache, NULL unless enabled with setCacheTTL()
     void (*RWcommandAction)(); // pointer to function to set the value
-    snmpNode *next;            // Pointer to next instance
+    snmpTable *table;          // table the node answers for, NULL unless it was registered with addTable()
+    const volatile void *variable; // variable or encoded constant the value is read from without a read function, NULL unless bound with bindVariable() or bindConstant()
+    byte variableType;             // type the variable is sent as, SNMP_DATATYPE_NOTSET for an encoded constant
+    byte variableSize;             // size of the variable in bytes, SNMP_VARIABLE_SIGNED is set if it's a signed type
+};
+
+// struct snmpMibObject describes one object of a mib registered in one go, with registerMib() or with SNMP_MIB() in SnmpMib.h
+// Made with snmpObject(), snmpTableObject(), snmpVariable() or snmpConstant()
+struct snmpMibObject
+{
+    const char *oidtext;                     // oid text, can be in PROGMEM
+    void (*ROcommandAction)();               // function to read the value
+    bool (*ROvalueAction)(SnmpValue *value); // function to read the value into a value slot, used instead of ROcommandAction if set
+    void (*RWcommandAction)();               // function to set the value
+    const snmpTable *table;                  // table the object answers for
+    const volatile void *variable;           // variable or encoded constant the value is read from
+    byte variableType;                       // type the variable is sent as, SNMP_DATATYPE_NOTSET for an encoded constant
+    byte variableSize;                       // size of the variable, SNMP_VARIABLE_SIGNED is set if it's a signed type
+};
+
+// An object read with sendResponse(), and written by write if it's set
+constexpr snmpMibObject snmpObject(const char *oidtext, void (*read)(), void (*write)() = NULL)
+{
+    return {oidtext, read, NULL, write, NULL, NULL, SNMP_DATATYPE_NOTSET, 0};
+}
+
+// An object read with a value callback, and written by write if it's set
+constexpr snmpMibObject snmpObject(const char *oidtext, bool (*read)(SnmpValue *value), void (*write)() = NULL)
+{
+    return {oidtext, NULL, read, write, NULL, NULL, SNMP_DATATYPE_NOTSET, 0};
+}
+
+// A conceptual table, entryoid and table are as for SimpleSNMP::addTable()
+constexpr snmpMibObject snmpTableObject(const char *entryoid, const snmpTable *table)
+{
+    return {entryoid, NULL, NULL, NULL, table, NULL, SNMP_DATATYPE_NOTSET, 0};
+}
 
-    snmpNode(const char *oidtext, void (*action)()); // Default constructor
+// An object read straight from an integer variable, as for SimpleSNMP::bindVariable()
+template <typename T>
+constexpr snmpMibObject snmpVariable(const char *oidtext, const volatile T *variable, SNMP_DATA_TYPE type)
+{
+    static_assert((T)0.5 == 0 && sizeof(T) <= 8, "snmpVariable() needs an integer variable");
+    return {oidtext, NULL, NULL, NULL, NULL, variable, (byte)type, (byte)(sizeof(T) | ((T)-1 < (T)0 ? SNMP_VARIABLE_SIGNED : 0))};
+}
+
+// An object read straight from a string, it can change but must stay where it is
+constexpr snmpMibObject snmpVariable(const char *oidtext, const char *string)
+{
+    return {oidtext, NULL, NULL, NULL, NULL, string, SNMP_DATATYPE_OCTETSTRING, 0};
+}
+
+// An object with a constant value, encoded as an asn.1 object including the type and length, it can be in PROGMEM
+constexpr snmpMibObject snmpConstant(const char *oidtext, const byte *encoded)
+{
+    return {oidtext, NULL, NULL, NULL, NULL, encoded, SNMP_DATATYPE_NOTSET, 0};
+}
+
+// struct snmpKeyBlock heads a block of the registry's encoded oids, the keys follow it in the same allocation
+struct snmpKeyBlock
+{
+    snmpKeyBlock *next; // the block filled before this one, the blocks are freed together
 };
 
 // class mysnmp is the main worker class
 class SimpleSNMP
 {
+    friend class SnmpBenchmark; // examples/LinuxBenchmark.cpp times the request stages one at a time
+
 public:
-    SimpleSNMP(void);  // Default constructor
-    ~SimpleSNMP(void); // Default destructor
+#ifdef ARDUINO
+    SimpleSNMP(void); // Default constructor, listens on udp port 161 over WiFi
+#endif
+    SimpleSNMP(SnmpTransport *transport);                       // Uses a transport the caller has set up, eg a SnmpPosixUdp on Linux
+    SimpleSNMP(SnmpTransport *transport, SimpleSNMP *registry); // A worker serving the oids registered with registry
+    ~SimpleSNMP(void);                                          // Default destructor
+
+    static SimpleSNMP *serving(void); // Returns the instance processing the current request
 
     // Request functions
     void action(void);                                       // Called regularly from main() to process the snmp subsystem
     void setROcommunity(const char *name);                   // Set the RO community name
     void setRWcommunity(const char *name);                   // Set the RW community name
-    void insertNode(const char *oidtext, void (*action)());  // Function to insert a node at the end of the linked list
+    void insertNode(const char *oidtext, void (*action)());  // Function to insert a node into the registry in oid order
+    void insertNode(const char *oidtext, bool (*action)(SnmpValue *value)); // Function to insert a node with a value callback into the registry in oid order
     bool addRWaction(const char *oidfind, void (*action)()); // Function to add a RW action to a node
+    bool addTable(const char *entryoid, const byte *columns, byte columnCount, int32_t (*nextRow)(int32_t after),
+                  bool (*readCell)(byte column, int32_t row, SnmpValue *value)); // Registers a table answered by row and cell callbacks
+    bool setCacheTTL(const char *oidtext, unsigned long ttl, uint16_t size); // Caches the value of a node for ttl ms, values up to size bytes are cached
+    const byte *registeredOid(const char *oidtext);                          // Returns the registry's encoded copy of an oid, NULL if it isn't registered
+    bool registerMib(const snmpMibObject *objects, uint16_t count);          // Registers a list of objects, the registry is sized for them all at once
+    template <typename T>
+    bool bindVariable(const char *oidtext, const volatile T *variable, SNMP_DATA_TYPE type) // Answers an oid straight from an integer variable
+    {
+        static_assert((T)0.5 == 0 && sizeof(T) <= 8, "bindVariable() needs an integer variable");
+        return bindNode(oidtext, variable, type, sizeof(T) | ((T)-1 < (T)0 ? SNMP_VARIABLE_SIGNED : 0));
+    }
+    bool bindVariable(const char *oidtext, const char *string);             // Answers an oid straight from a string
+    bool bindConstant(const char *oidtext, const byte *encoded);            // Answers an oid with an encoded constant
+    bool useMib(const snmpNode *mibNodes, uint16_t count);                   // Serves a read only registry built by the compiler, see SnmpMib.h
+    bool exportStatistics(const char *subtree = SNMP_STATS_OID);            // Registers the snmp group counters and the agent's own counters, and counts requests for each oid
+    void setActionBudget(byte maxPackets, unsigned long maxMicros, byte maxShare = SNMP_ACTION_CPU_SHARE); // Sets the most requests, time in us and share of the cpu action() can use
+#if SNMP_RATE_SOURCES
+    void setRateLimit(uint16_t sourceRate, uint16_t sourceBurst, uint16_t globalRate); // Sets the packets per second accepted from each source and from all of them
+#endif
+    bool addPriorityManager(IPAddress ip);                                   // Get requests from this manager are processed ahead of other requests
+    void setValueOverride(const byte *(*lookup)(void *context, const byte *oidasn1), void *context); // Sets a function that can supply values in place of the read functions
 
     // Reply functions
     void sendResponse(long long value, SNMP_DATA_TYPE type);              // Sends an int, length is the length of the value
@@ -120,14 +562,85 @@ public:
     void sendResponse(ASNTYPE *value);                                    // Sends an encoded object buffer, used to send an oid or a null field, used gpbuff
     void sendResponse(IPAddress value);                                   // Sends an encoded object buffer, used to send an oid or a null field, used gpbuff
     byte getUserData(byte *asn, byte *buff, byte len);                    // Copies the user data to buff, returns the length of the source data field
+    uint16_t encodeValue(const SnmpValue *value, byte *buff, uint16_t size); // Encodes a value as an asn.1 object in buff, returns it's length, 0 if it doesn't fit
+#if SNMP_DEFER_TABLE_SIZE
+    SnmpHandle deferResponse(void);                                       // Called from a read or write function to answer the request later, returns 0 if it can't be deferred
+    bool completeResponse(SnmpHandle handle, const SnmpValue *value);     // Answers a deferred request with a value
+    bool failResponse(SnmpHandle handle, SNMP_ERROR_CODE errorno);        // Answers a deferred request with an error
+#endif
+#if SNMP_NOTIFY_QUEUE_SIZE
+    // Notification functions
+    bool addNotifyDestination(IPAddress ip, uint16_t port = 162, const char *community = "public", bool inform = false); // Sends notifications to a manager
+    void setNotifyRate(byte burst, unsigned long interval);                // Sets the most notifications sent to a manager back to back, then one every interval ms
+    bool sendNotification(const char *trapoid, const SnmpVarbind *varbinds, byte count); // Queues a notification for every manager, returns false if it couldn't be queued
+#endif
+#if SNMP_REJECT_LOG_SIZE
+    bool readRejected(SnmpRejectedPacket *packet);                         // Copies out the oldest rejected packet not yet read, returns false if there isn't one
+#endif
+#if SNMP_STAGE_TIMING
+    // Timing functions
+    const SnmpStageTiming *stageTiming(SNMP_STAGE stage);                  // Returns the times recorded for a stage
+    void resetStageTiming(void);                                           // Clears the times recorded for every stage
+    void dumpStageTiming(void);                                            // Logs the count, mean, longest time and histogram of each stage
+#endif
 
-    unsigned long snmpPacketsSent = 0; // Count of packets sent to snmp
-    unsigned long snmpPacketsRecv = 0; // Count of packets received from snmp
-    struct pdudata workingpdu;         // Exposes the current request data for use by oid support functions
+    unsigned long snmpPacketsSent = 0;     // Count of packets sent to snmp
+    unsigned long snmpPacketsRecv = 0;     // Count of packets received from snmp
+    unsigned long snmpPacketsOversize = 0; // Count of packets dropped for being larger than SNMP_MAX_PACKET_SIZE
+    unsigned long snmpRateDrops = 0;       // Count of packets dropped unparsed because their source was over it's rate limit
+    unsigned long snmpGlobalRateDrops = 0; // Count of packets dropped unparsed because all the sources together were over the global rate limit
+    unsigned long snmpQueueDrops = 0;      // Count of queued bulk requests dropped to make room for a new request
+    unsigned int snmpQueueDepth = 0;       // Number of requests waiting in the ingress queue
+    unsigned int snmpQueueMaxDepth = 0;    // Most requests that have been waiting in the ingress queue
+    unsigned long snmpPacketsRetransmit = 0; // Count of retransmitted requests answered with the response already sent
+    unsigned long snmpDeferTimeouts = 0;   // Count of deferred requests answered with genErr because they weren't completed in time
+    unsigned long snmpDeferFull = 0;       // Count of requests that couldn't be deferred because the pending table was full
+    unsigned long snmpCacheHits = 0;       // Count of values served from a node cache
+    unsigned long snmpCacheMisses = 0;     // Count of values read for a node with a cache because the cached value was missing or expired
+    unsigned long snmpNotifySent = 0;      // Count of traps and informs sent, retries included
+    unsigned long snmpNotifyMerged = 0;    // Count of notifications merged into an identical one that hadn't been sent yet
+    unsigned long snmpNotifyDrops = 0;     // Count of notifications dropped because the queue was full
+    unsigned long snmpInformRetries = 0;   // Count of informs sent again because they weren't acknowledged in time
+    unsigned long snmpInformFailures = 0;  // Count of informs given up on after SNMP_INFORM_RETRIES retries
+    unsigned long snmpParseResults[SNMP_TOO_MANY_VARBINDS + 1] = {}; // Count of requests parsed, by result, indexed by SNMP_PARSE_STAT_CODES
+    unsigned long snmpInPdus[8] = {};      // Count of pdus accepted, by type, indexed by the low 3 bits of the SNMP_TYPE_CODE
+    unsigned long snmpInBadCommunityUses = 0; // Count of set requests rejected because they carried the read only community
+    unsigned long snmpInTotalReqVars = 0;  // Count of values read by get, getnext and getbulk requests answered without an error
+    unsigned long snmpInTotalSetVars = 0;  // Count of values written by set requests answered without an error
+    unsigned long snmpOutErrors[SNMP_NOTWRITABLE + 1] = {}; // Count of responses sent, by error status, indexed by SNMP_ERROR_CODE
+    struct pdudata workingpdu;             // Exposes the current request data for use by oid support functions
 
 private:
     // Request functions
+    void initialise(SnmpTransport *snmpTransport);             // Sets the default values, shared by the constructors
+    void receivePackets(void);                                 // Reads waiting frames into the ingress queue
+    int nextQueued(void);                                      // Returns the receive buffer of the next request to process, -1 if none
+    byte getPriority(byte *pdu, uint16_t len, IPAddress ip);   // Returns the priority class of a received frame
+#if SNMP_RATE_SOURCES
+    bool admitPacket(IPAddress ip);                       // Takes a token from the source's and the global bucket, returns false if the packet is to be dropped
+    bool takeToken(uint32_t *tokens, unsigned long *last, uint16_t rate, uint16_t burst, unsigned long now); // Refills a token bucket and takes a token if there is one
+#endif
+    byte peekRequestType(byte *pdu, uint16_t len);             // Returns the pdu type of a received frame without parsing it
+    void processPacket(int slot);                              // Processes the request in a receive buffer and sends the response
+#if SNMP_DEFER_TABLE_SIZE
+    snmpDeferred *findDeferred(SnmpHandle handle);             // Returns the pending table entry for a handle, NULL if it isn't pending
+    bool isDeferred(void);                                     // Checks if the request is a retransmit of a deferred request
+    void sendDeferredResponses(void);                          // Sends completed and timed out deferred responses
+    bool saveASN1(byte *dest, byte *src, uint16_t size);       // Copies an asn.1 object if it fits
+#endif
+#if SNMP_NOTIFY_QUEUE_SIZE
+    void sendNotifications(void);                              // Sends queued notifications as the rate limits allow and retries informs
+    bool sendNotificationTo(snmpNotification *entry, byte dest); // Sends a notification to one manager
+    void receiveInformResponse(byte *pdu, uint16_t len);       // Matches a received response to the inform it answers
+#endif
+#if SNMP_DEDUP_CACHE_SIZE
+    uint32_t hashPacket(const byte *buff, uint16_t len);       // Returns a hash of a received packet
+    bool sendDuplicateResponse(uint32_t hash, uint16_t len);   // Resends the response to a retransmitted request, returns false if it isn't one
+    void storeDuplicateResponse(uint32_t hash, uint16_t reqlen, byte *response, uint16_t len); // Keeps a response in case the request is retransmitted
+#endif
     SNMP_PARSE_STAT_CODES parsepdu(byte *oid, uint16_t rxlen); // Processes the received frame
+    byte *readASNhdr(byte *pos, byte *end, uint16_t *len);     // Reads an asn.1 header, returns the data field or NULL if it runs past end
+    byte *checkASN(byte *pos, byte *end, byte type, uint16_t minlen, uint16_t maxlen); // Checks an asn.1 field, returns the following field or NULL if it's invalid
     long decodeInt(byte *msg);                                 // Reads an encoded integer and returns the value
     unsigned long decodeUnsignedInt(byte *msg);                // Reads an encoded integer and returns the value
     long long decodeInt64(byte *msg);                          // Reads an encoded 64 bit integer and returns the value
@@ -137,52 +650,202 @@ private:
     long decodeOidInt(byte *msg);                              // Reads an OID encoded integer and returns the contents
     bool oid2char(void);                                       // Converts an oid data buffer to a char string, puts result into gpbuff, converts the working comstr field
     bool oid2char(byte *pdu);                                  // Converts an oid data buffer to a char string, puts result into gpbuff
-    bool getoid(byte *pdu);                                    // extracts the oid from a udp frame and siores it into the oid buffer
-    bool getcomstr(byte *pdu);                                 // Stores the pointer to the ASN.1 community string
     char *decodeComStr(byte *asn);                             // Returns a pointer to the community string formatted as a null terminated string, uses gpbuff
     char *decodeComStr(void);                                  // Returns a pointer to the community string formatted as a null terminated string, uses gpbuff, converts the working comstr field
-    bool getversion(byte *pdu);                                // extracts the snmp version from a udp frame and stores it into the version buffer
-    bool getType(byte *pdu);                                   // Gets the SNMP record type
     bool checkROcomstr(void);                                  // Checks the last received record for a community string match
     bool checkRWcomstr(void);                                  // Checks the last received record for a community string match
-    byte *findOid(byte *pdu);                                  // Searches a pdu for the oid data type record
-    byte appendASN1(byte *dest, byte *src);                    // Appends an asn.1 object to the end of an existing asn.1 object
+    bool compareComStr(const char *name);                      // Compares the received asn.1 community string in place with name
     const char *getErrorText(byte errno);                      // Returns a pointer to the error text
-    byte getASNlen(byte *asn);                                 // Returns the length of the data element from an asn.1 buffer
+    uint16_t getASNlen(byte *asn);                             // Returns the length of the data element from an asn.1 buffer
     byte getASNhdrlen(byte *asn);                              // Returns the length of the asn header
 
     // Response functions
-    void buildResponseBuffer(byte *responseBuffer, byte *valueBuffer); // Builds the snmp response frame at responsebuffer
-    bool sendResponseBuffer(byte *responseBuffer);                     // Sends the snmp response frame at responsebuffer, returns true if ok
-    byte addSnmpResponsePDU(byte *responseBuffer, byte *valueBuffer);  // addd response pdu
-    byte addSnmpVBlist(byte *responseBuffer, byte *valueBuffer);       // addd response pdu
-    byte addSnmpVBtype(byte *responseBuffer, byte *valueBuffer);       // addd response pdu
+    bool beginResponse(void);                                                          // Starts a response with an empty varbind list, returns false if the headers won't fit
+    uint16_t finishResponse(byte **start);                                             // Writes the message headers in front of the varbind list, returns the message length
+    bool sendResponseBuffer(byte *responseBuffer, uint16_t len);                       // Sends the snmp response frame at responsebuffer, returns true if ok
+    bool appendVarbind(byte *oidasn1, byte *valueBuffer);                              // Appends a varbind to the response frame, returns false if it doesn't fit
+    byte *appendVarbind(const byte *oidasn1, byte type, const byte *data, uint16_t len); // Appends a varbind to the response frame, returns a pointer to the value or NULL if it doesn't fit
+    byte *putVarbind(byte *pos, const byte *oidasn1, byte type, const byte *data, uint16_t len); // Writes a varbind at pos, returns a pointer to the value
+    uint16_t getVarbindSize(const byte *oidasn1, uint16_t len);                        // Returns the encoded size of a varbind with a value of len bytes
+    bool addResponseValue(byte *valueBuffer);                                          // Adds a support function value to the response frame
+    bool addResponseValue(byte type, const byte *data, uint16_t len);                  // Adds a support function value to the response frame, data can be in PROGMEM
+    bool addResponseValue(const SnmpValue *value);                                     // Encodes a value callback value and adds it to the response frame
+    const byte *getValueData(const SnmpValue *value, byte *buff, uint16_t *len);       // Returns the encoded data field for a value callback value
+    byte *encodeInteger(byte *end, uint64_t value, bool isSigned);                     // Writes an integer in front of end using the fewest bytes, returns a pointer to it
+    byte getASNhdrsize(uint16_t len);                                                  // Returns the size of an asn.1 header for a data field of len bytes
+    byte *putASNhdr(byte *pos, byte type, uint16_t len);                               // Writes an asn.1 header at pos, returns a pointer to the data field
+    byte *pushASNhdr(byte *pos, byte type, uint16_t len);                              // Writes an asn.1 header in front of pos, returns a pointer to the header
+    byte *pushASN1(byte *pos, byte *src);                                              // Copies an asn.1 object in front of pos, returns a pointer to the copy
+    byte *pushInt(byte *pos, uint16_t value);                                          // Writes an encoded integer in front of pos, returns a pointer to it
     // void sendResponse(long long value, int length);                    // Sends an int, length is the length of the value
-    void sendErrorResponse(SNMP_ERROR_CODE errorno); // Sends an error response
-
-    // List processing functions
-    byte nextoid[MAX_OID_SIZE];                           // buffer holding the asn.1 formatted oid for the next oid, used by getnextreq
-    bool processGetRequest(const char *oidfind);          // Function to process the linked list. command parameter is the oid to be found
-    bool processGetNextRequest(const char *oidfind);      // Function to process the linked list. command parameter is the oid to be found, supports partial match
-    bool processSetRequest(const char *oidfind);          // Function to process the linked list. command parameter is the oid to be found
-    bool compareStr_P(const char *o1, const char *o2);    // Compares two strings PROGMEM safe
-    bool comparepStr_P(const char *o1, const char *o2);   // Compares two strings PROGMEM safe, returns true if o1 matches the start of o2
-    byte *char2oid(const char *oidtext);                  // Converts a char oid string to an encoded asn.1 field, puts result into respoid buffer
+    void sendErrorResponse(SNMP_ERROR_CODE errorno, byte errorindex); // Turns the response into an error response
+
+    // Registry processing functions
+    bool processGetRequest(void);                         // Looks up each varbind oid in the registry and calls the read function
+    bool processGetNextRequest(void);                     // Looks up the first registered oid following each varbind oid and calls its read function
+    bool processSetRequest(void);                         // Looks up each varbind oid in the registry and calls the write function
+    bool callReadAction(uint16_t idx, byte vbindex);      // Calls a node read function and checks it responded
+    bool checkReadAction(byte vbindex);                   // Checks a read function responded, sets a tooBig or genErr error if not
+    void runReadAction(uint16_t idx);                     // Calls a node read function, a value callback's value is added to the response
+    bool bindNode(const char *oidtext, const volatile void *variable, byte type, byte size); // Binds an oid to a variable or constant
+    void addBoundValue(const snmpNode *node);             // Adds the value of a bound variable or constant to the response
+    uint64_t readVariable(const volatile void *variable, byte size); // Reads a bound integer variable
+    static int32_t nextScalarRow(int32_t after);          // Row callback for the statistics groups, they only have row 0
+    static bool readSnmpGroup(byte column, int32_t row, SnmpValue *value);     // Cell callback for the snmp group, 1.3.6.1.2.1.11
+    static bool readParseResults(byte column, int32_t row, SnmpValue *value);  // Cell callback for the parse result counters
+    static bool readAgentCounters(byte column, int32_t row, SnmpValue *value); // Cell callback for the agent's other counters
+    static int32_t nextHitRow(int32_t after);             // Row callback for the oid hit table, a row for each registry node
+    static bool readOidHits(byte column, int32_t row, SnmpValue *value);       // Cell callback for the oid hit table
+#if SNMP_REJECT_LOG_SIZE
+    static int32_t nextRejectRow(int32_t after);          // Row callback for the reject log table, a row for each packet still held
+    static bool readRejectLog(byte column, int32_t row, SnmpValue *value);     // Cell callback for the reject log table
+    void storeRejected(byte error, const byte *packet, uint16_t len); // Keeps a rejected packet in the reject log, replacing the oldest
+#if SNMP_LOG_LEVEL >= SNMP_LOG_WARN
+    void logRejected(void);                               // Logs the oldest rejected packet not yet read
+#endif
+#endif
+    void storeCacheValue(snmpCache *cache, byte *valueasn1); // Stores an encoded value into a node cache
+    snmpNode *addNode(const char *oidtext);               // Finds or inserts the registry node for an oid, NULL if it couldn't be added
+    byte *selectVarbind(byte vb);                         // Points the workingpdu oid fields at a received varbind, returns it's oid
+    bool isInstanceOf(uint16_t idx, const byte *oidasn1); // Checks if an unregistered oid is an instance of a registered object
+    bool processGetBulkRequest(void);                     // Runs the repeated getnext lookups for a getbulkreq
+    bool addBulkVarbind(snmpWalkPos *pos, byte *oidasn1); // Adds one getbulkreq result to the response
+    void seekNext(const byte *oidasn1, snmpWalkPos *pos); // Finds the first registered oid or table cell after an oid
+    void seekNode(snmpWalkPos *pos);                      // Moves to the first oid or table cell from the start of a node
+    bool seekTableCell(snmpWalkPos *pos, const byte *oidasn1); // Finds the first cell of a table after an oid, returns false if there isn't one
+    void stepNext(snmpWalkPos *pos);                      // Moves on to the following registered oid or table cell
+    void readPosition(snmpWalkPos *pos);                  // Adds the value at a walk position to the response
+    bool inTable(uint16_t idx, const byte *oidasn1);      // Checks if an oid is a cell of a table node
+    byte getTableCell(uint16_t idx, const byte *oidasn1); // Adds a table cell's value for a getreq, returns the exception if it can't
+    byte *tableCellOid(uint16_t idx, byte column, int32_t row); // Builds the oid of a table cell in cellOid
+    bool decodeSubid(const byte **pos, const byte *end, uint32_t *value); // Reads one oid sub identifier
+    byte *varbindOid(byte vb);                            // Returns the oid of a received varbind, vb counts from 0
+    uint16_t findNode(const byte *oidasn1, bool *exact);  // Binary search of the registry, returns the index of the first node >= oid, exact set if it matched
+    bool growRegistry(uint16_t extra);                    // Increases the registry capacity by extra entries
+    bool copyMib(void);                                   // Copies a compile time mib into a registry of our own so oids can be added
+    bool reserveKeys(uint32_t len);                       // Makes room for len bytes of encoded oids
+    int compareOid(const byte *o1, const byte *o2);       // Compares two asn.1 oids in numeric order, returns <0, 0 or >0 like strcmp
+    byte *char2oid(const char *oidtext, byte *oidasn1);   // Converts a char oid string to an encoded asn.1 field, puts result into oidasn1
     long atol_P(const char *s);                           // Converts a string to long, PROOGMEM safe
     const char *findTok_P(const char *s, char delimiter); // finds delim, returns a pointer to the next char after delim, PROGMEM safe
 
-    // Debug functions
+#if SNMP_LOG_LEVEL >= SNMP_LOG_DEBUG
+    // Debug functions, only built for SNMP_LOG_DEBUG
     void dumpStruct(void);                            // Dumps the workingpdu structure contents
-    void dumpRaw(byte *oid);                          // Dumps an asn.1 object as a hex string for cutting and pasting into a decoder
+    void dumpRaw(byte *pdu, uint16_t len);            // Dumps len bytes as a hex string for cutting and pasting into a decoder
     void dumpData(byte *oid);                         // Lists the encoded data fields
     void dumpData(byte *oid, byte oidlen, int level); // Lists the encoded data fields
     void dumpField(byte *msg);                        // Breaks down an asn.1 object into it's omponent parts
-    bool dumpList(void);                              // Dumps the contents of the linked list
-    bool dumpList(snmpNode *element, byte level);     // Dumps the contents of the linked list
+    bool dumpList(void);                              // Dumps the contents of the registry
+#endif
+#if SNMP_STAGE_TIMING
+    void recordStage(byte stage, uint32_t cycles);    // Adds a time to a stage's histogram
+#endif
 
     // variables
     uint16_t port;                     // Stores the SNMP port, usually 161
-    snmpNode *head;                    // pointer to first element of the linked list
+    snmpNode *nodes;                   // the registry, a contiguous array of nodes sorted in oid order
+    uint16_t nodeCount;                // number of nodes in use in the registry
+    uint16_t nodeCapacity;             // number of nodes allocated to the registry
     char ROcommunity[MAX_COMSTR_SIZE]; // RO community
     char RWcommunity[MAX_COMSTR_SIZE]; // RW community
+    SnmpTransport *transport;          // where requests come from and responses go, NULL if we only hold a registry
+    bool ownRegistry;                  // false if nodes belongs to another instance
+    bool registryShared;               // the registry is read only, workers are using it or it was built by the compiler, the value caches aren't used
+    bool mibRegistry;                  // the registry is a compile time mib no workers are using yet, exportStatistics() can copy it
+    snmpKeyBlock *keyBlocks;           // blocks holding the registry's encoded oids, most recent first
+    byte *keyFree;                     // next free byte for an encoded oid
+    byte *keyEnd;                      // end of the space for encoded oids
+    uint32_t *nodeHits;                // requests answered by each registry node, in registry order, NULL until exportStatistics()
+#if SNMP_REGISTRY_POOL_SIZE
+    snmpNode nodePool[SNMP_REGISTRY_POOL_SIZE];  // the fixed size registry
+    byte keyPool[SNMP_REGISTRY_POOL_KEYS];       // encoded oids of the fixed size registry
+#endif
+    byte gpbuff[MAX_OID_SIZE];         // General purpose buffer space, always assume it's invalid before use
+    uint16_t vbindex[SNMP_MAX_REQUEST_VARBINDS]; // offset of each received varbind's oid from workingpdu.rxdata, filled by parsepdu()
+    byte cellOid[MAX_OID_SIZE];        // oid of the table cell being returned
+#ifdef ARDUINO
+    SnmpWiFiUdp wifiTransport; // the transport used by the default constructor
+#endif
+
+    // Receive buffer pool, preallocated so no memory is allocated while running, the buffers in use form the ingress queue
+    byte rxPool[SNMP_RX_POOL_SIZE][SNMP_MAX_PACKET_SIZE]; // receive buffers
+    snmpRxEntry rxQueue[SNMP_RX_POOL_SIZE];               // request held in each receive buffer
+    uint16_t rxSeq;                                       // arrival count, orders the queue
+    byte actionMaxPackets;                                // most requests processed per call to action()
+    unsigned long actionMaxMicros;                        // time each call to action() can use, 0 for no limit
+    byte actionMaxShare;                                  // most percent of the time action() can use, 100 for no limit
+    long actionCredit;                                    // us of processing action() has earned under actionMaxShare
+    unsigned long actionLastEnd;                          // micros() when action() last returned
+    IPAddress priorityManagers[SNMP_MAX_PRIORITY_MANAGERS]; // managers whose get requests are processed first
+    byte priorityManagerCount;                            // number of priority managers
+    IPAddress requestIP;                                  // where the request being processed came from, the response is sent here
+    uint16_t requestPort;                                 //
+    uint16_t requestEndpoint;                             // transport endpoint it arrived on, the response goes out the same way
+    const byte *(*valueOverride)(void *context, const byte *oidasn1); // supplies values in place of the read functions, NULL if not used
+    void *overrideContext;                                // passed to valueOverride
+#if SNMP_DEDUP_CACHE_SIZE
+    uint32_t requestHash; // hash of the request being processed
+    uint16_t requestLen;  // length of the request being processed
+#endif
+
+#if SNMP_DEFER_TABLE_SIZE
+    // Deferred requests waiting to be answered
+    snmpDeferred deferTable[SNMP_DEFER_TABLE_SIZE]; // pending table
+    SnmpHandle deferSeq;                            // last handle given out
+#endif
+    bool responseDeferred; // set when the request being processed has been deferred
+
+#if SNMP_RATE_SOURCES
+    // Admission control, token buckets checked before a packet is queued
+    snmpRateBucket rateBuckets[SNMP_RATE_SOURCES]; // bucket of each recent source, a hash table
+    uint16_t sourceRate;                           // packets per second accepted from each source, 0 for no limit
+    uint16_t sourceBurst;                          // packets a source can send back to back
+    uint16_t globalRate;                           // packets per second accepted from all sources, 0 for no limit
+    uint32_t globalTokens;                         // packets that can be accepted now from all sources, in 1/1000ths
+    unsigned long globalLast;                      // millis() when the global bucket was last refilled
+#endif
+
+#if SNMP_REJECT_LOG_SIZE
+    // Recent rejected packets, packet n is held in entry n % SNMP_REJECT_LOG_SIZE
+    SnmpRejectedPacket rejectLog[SNMP_REJECT_LOG_SIZE]; // reject log
+    uint32_t rejectSeq;                                 // last rejected packet stored
+    uint32_t rejectRead;                                // last rejected packet read or logged
+#endif
+
+#if SNMP_STAGE_TIMING
+    // Request stage times
+    SnmpStageTiming stageTimes[SNMP_STAGE_COUNT]; // times recorded for each stage
+    uint32_t callbackCycles;                      // time spent in the read and write functions by the request being processed
+#endif
+
+#if SNMP_NOTIFY_QUEUE_SIZE
+    // Outbound notifications
+    snmpNotifyDestination notifyDestinations[SNMP_MAX_NOTIFY_DESTINATIONS]; // managers notifications are sent to
+    byte notifyDestinationCount;                          // number of managers
+    snmpNotification notifyQueue[SNMP_NOTIFY_QUEUE_SIZE]; // notifications waiting to be sent or acknowledged
+    byte notifyQueued;                                    // number of notifications in the queue
+    uint16_t notifySeq;                                   // order notifications were raised
+    int32_t notifyRequestId;                              // last inform request id
+    byte notifyBurst;                                     // most notifications sent to a manager back to back
+    unsigned long notifyInterval;                         // ms between notifications to a manager once the burst is used
+#endif
+
+#if SNMP_DEDUP_CACHE_SIZE
+    // Recent responses, replaced oldest first
+    snmpDedupEntry dedupCache[SNMP_DEDUP_CACHE_SIZE]; // responses kept for retransmitted requests
+    byte dedupNext;                                   // entry to be replaced next
+#endif
+
+    // Response frame under construction, the varbinds are added forwards from SNMP_TX_HEADROOM and the headers written back to front in front of them
+    byte txBuffer[SNMP_TX_HEADROOM + SNMP_MAX_PACKET_SIZE]; // response frame buffer
+    byte *responseEnd;          // end of the varbinds added so far, NULL when no response is being built
+    byte *responseLimit;        // varbinds can't be added past here, keeps the message within SNMP_MAX_PACKET_SIZE
+    byte responseErrorStatus;   // error status written into the response
+    byte responseErrorIndex;    // error index written into the response
+    uint16_t responseVarbinds;  // number of varbinds added to the response
+    byte *responseOid;          // oid of the varbind last added to the response
+    bool responseFull;          // set when a varbind didn't fit in the response
+    bool valueAdded;            // set when the current varbind has been given a value
+    bool valueSkipped;          // set when a Counter64 value was held back from a v1 client
 };
@@ -0,0 +1,53 @@
+#ifndef ARDUINO
+#include "SnmpHost.h"
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * SnmpHost.cpp
+ *
+ * Arduino timing functions for host builds, see SnmpHost.h
+ **/
+
+EspClass ESP;
+
+static uint64_t hostMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Time of the first call, the times returned count from here
+static uint64_t hostStartMicros(void)
+{
+    static uint64_t start = hostMicros();
+    return start;
+}
+
+unsigned long millis(void)
+{
+    return micros() / 1000;
+}
+
+unsigned long micros(void)
+{
+    uint64_t start = hostStartMicros(); // First, so the first call doesn't return a time before the start
+    return hostMicros() - start;
+}
+
+// The low 32 bits of the time stamp counter, it counts at a fixed rate close to the cpu clock on current x86 cpus
+// Elsewhere ns from the monotonic clock, either way it wraps so only short intervals can be measured
+uint32_t EspClass::getCycleCount(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+#endif
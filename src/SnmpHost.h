@@ -0,0 +1,58 @@
+#pragma once
+#ifndef ARDUINO
+/**
+ * SnmpHost.h
+ *
+ * The parts of the Arduino framework used by SimpleSNMP, so the library can be built and run on a host such as Linux
+ * Only used when ARDUINO isn't defined
+ **/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+// There's no separate flash memory on a host, the PROGMEM functions are the normal ones
+#define PROGMEM
+#define PSTR(s) (s)
+#define FPSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define snprintf_P snprintf
+
+#ifndef myLog_P
+#define myLog_P printf
+#endif
+
+unsigned long millis(void); // ms since the program started
+unsigned long micros(void); // us since the program started
+
+// class EspClass stands in for the esp core's ESP object, only the cycle counter is provided
+class EspClass
+{
+public:
+    uint32_t getCycleCount(void); // A fast free running count, the time stamp counter on x86, otherwise ns
+};
+extern EspClass ESP;
+
+// class IPAddress holds an IPv4 address, a cut down version of the Arduino class
+class IPAddress
+{
+public:
+    IPAddress(void) { addr = 0; }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { addr = (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24); }
+    IPAddress(uint32_t address) { addr = address; } // network byte order, as held in a sockaddr_in
+    operator uint32_t() const { return addr; }
+    bool operator==(const IPAddress &other) const { return addr == other.addr; }
+    uint8_t operator[](int index) const { return (addr >> (index * 8)) & 0xFF; }
+
+private:
+    uint32_t addr; // network byte order
+};
+#endif
@@ -0,0 +1,226 @@
+#pragma once
+#include "SimpleSNMP.h"
+
+/**
+ * SnmpMib.h
+ *
+ * Declares a whole mib at compile time, the oid text is encoded, sorted and checked by the compiler
+ * The objects are made with snmpObject(), snmpTableObject(), snmpVariable() and snmpConstant(), the same list
+ * SimpleSNMP::registerMib() registers at run time
+ * The result is a read only registry, SimpleSNMP::useMib() serves it without copying so nothing is allocated and
+ * there's no registration at startup
+ *
+ *   SNMP_MIB(mib, snmpObject("1.3.6.1.2.1.1.1.0", getSystemDescription),
+ *                 snmpObject("1.3.6.1.2.1.1.5.0", getSystemName, setSystemName));
+ *   snmp.useMib(mib.nodes, mib.count);
+ *
+ * SNMP_MIB() declares the mib constexpr so it's built by the compiler, an invalid, duplicate or overlong oid stops the
+ * build with an error naming one of the SNMP_MIB_ functions below
+ * On ESP32 and Linux the mib is in flash or read only memory, on ESP8266 .rodata is held in RAM but it still uses no heap,
+ * it can't be PROGMEM there because the lookups read the oids a byte at a time
+ * Needs C++17, the default for the ESP8266 core
+ *
+ * snmpEncodedString() and snmpEncodedOid() encode constants for SimpleSNMP::bindConstant() and snmpConstant() at compile time
+ *
+ *   constexpr auto sysObjectID PROGMEM = snmpEncodedOid("1.3.6.1.4.1.8072.3.2.10");
+ *   snmp.bindConstant("1.3.6.1.2.1.1.2.0", sysObjectID.asn1);
+ **/
+
+#if __cplusplus < 201703L
+#error "SnmpMib.h needs C++17"
+#endif
+
+#ifndef SNMP_MIB_OID_SIZE
+#define SNMP_MIB_OID_SIZE 32 // Space for each encoded oid in a compile time mib, type and length bytes included
+#endif
+
+// Never defined, a mib being built by the compiler calls one of these to stop the build with the problem in the error message
+void SNMP_MIB_INVALID_OID(void);   // the oid text isn't 1.3. followed by numbers separated by dots
+void SNMP_MIB_OID_TOO_LONG(void);  // the encoded oid doesn't fit SNMP_MIB_OID_SIZE, or a table oid has no room for it's cells
+void SNMP_MIB_DUPLICATE_OID(void); // the same oid is listed twice
+void SNMP_MIB_OID_IN_TABLE(void);  // an oid is below a table's entry oid, the table answers for all of them
+void SNMP_MIB_INVALID_TYPE(void);  // a variable is bound to a type it can't be sent as
+
+// Encodes oid text the same way as SimpleSNMP::char2oid() into size bytes, but stricter as it's only done at compile time
+constexpr void snmpMibEncodeOid(const char *text, byte *oid, size_t size)
+{
+    if (text[0] != '1' || text[1] != '.' || text[2] != '3' || text[3] != '.')
+        SNMP_MIB_INVALID_OID();
+    oid[0] = SNMP_DATATYPE_OID;
+    oid[1] = 1;
+    oid[2] = 0x2B; // "1.3." static encoding
+    text += 4;
+    while (true)
+    {
+        if (*text < '0' || *text > '9')
+            SNMP_MIB_INVALID_OID();
+        uint64_t value = 0;
+        for (; *text >= '0' && *text <= '9'; text++)
+        {
+            value = value * 10 + (*text - '0');
+            if (value > 0xFFFFFFFF) // Sub identifiers are 32 bit
+                SNMP_MIB_INVALID_OID();
+        }
+        byte len = 1; // Bytes needed, 7 bits in each
+        for (uint64_t rest = value >> 7; rest; rest >>= 7)
+            len++;
+        if ((size_t)(oid[1] + 2 + len) > size || oid[1] + len > 127) // The length has to fit one byte
+            SNMP_MIB_OID_TOO_LONG();
+        for (byte i = 0; i < len; i++) // Most significant 7 bits first, all but the last byte have the top bit set
+            oid[2 + oid[1] + i] = ((value >> (7 * (len - 1 - i))) & 0x7F) | (i < len - 1 ? 0x80 : 0);
+        oid[1] += len;
+        if (*text == 0)
+            return;
+        if (*text++ != '.')
+            SNMP_MIB_INVALID_OID();
+    }
+}
+
+// An asn.1 encoded constant, type and length included, pass asn1 to SimpleSNMP::bindConstant() or snmpConstant()
+template <size_t N>
+struct snmpEncoded
+{
+    byte asn1[N];
+};
+
+// Encodes a string literal as an OCTET STRING
+template <size_t N>
+constexpr snmpEncoded<N + 2> snmpEncodedString(const char (&text)[N])
+{
+    static_assert(N - 1 <= 255, "snmpEncodedString() is limited to 255 characters");
+    snmpEncoded<N + 2> encoded{};
+    size_t hdr = N - 1 < 128 ? 2 : 3; // Lengths from 128 take a length of length byte
+    encoded.asn1[0] = SNMP_DATATYPE_OCTETSTRING;
+    encoded.asn1[1] = hdr == 2 ? N - 1 : 0x81;
+    encoded.asn1[hdr - 1] = N - 1;
+    for (size_t i = 0; i < N - 1; i++)
+        encoded.asn1[hdr + i] = text[i];
+    return encoded;
+}
+
+// Encodes oid text as an OBJECT IDENTIFIER, eg for sysObjectID, the encoding is never longer than the text
+template <size_t N>
+constexpr snmpEncoded<N> snmpEncodedOid(const char (&text)[N])
+{
+    snmpEncoded<N> encoded{};
+    snmpMibEncodeOid(text, encoded.asn1, N);
+    return encoded;
+}
+
+// class SnmpMib is a registry built by the compiler, N is the number of objects, SNMP_MIB() counts them
+template <size_t N>
+class SnmpMib
+{
+public:
+    template <class... T>
+    constexpr SnmpMib(T... objects) : oids{}, nodes{}
+    {
+        static_assert(sizeof...(T) == N, "SnmpMib<N> needs N objects");
+        const snmpMibObject list[N] = {objects...};
+        for (size_t i = 0; i < N; i++) // Encode each oid and insert it at it's place in oid order
+        {
+            byte oid[SNMP_MIB_OID_SIZE] = {};
+            snmpMibEncodeOid(list[i].oidtext, oid, SNMP_MIB_OID_SIZE);
+            if (list[i].table && oid[1] + 2 + 6 > MAX_OID_SIZE) // Room for a column and a 5 byte row index
+                SNMP_MIB_OID_TOO_LONG();
+            if (list[i].variable && !validType(list[i].variableType, list[i].variableSize))
+                SNMP_MIB_INVALID_TYPE();
+            size_t j = i;
+            for (; j > 0 && compare(oids[j - 1], oid) > 0; j--)
+            {
+                copy(oids[j], oids[j - 1]);
+                nodes[j] = nodes[j - 1];
+            }
+            copy(oids[j], oid);
+            nodes[j] = {NULL, list[i].ROcommandAction, list[i].ROvalueAction, NULL, list[i].RWcommandAction,
+                        const_cast<snmpTable *>(list[i].table), list[i].variable, list[i].variableType, list[i].variableSize};
+        }
+        for (size_t i = 0; i < N; i++)
+        {
+            if (i && compare(oids[i - 1], oids[i]) == 0)
+                SNMP_MIB_DUPLICATE_OID();
+            if (i && nodes[i - 1].table && within(oids[i], oids[i - 1]))
+                SNMP_MIB_OID_IN_TABLE();
+            nodes[i].oid = const_cast<byte *>(oids[i]); // The registry key, the node is never written while the mib is in use
+        }
+    }
+
+    static constexpr uint16_t count = N; // number of objects
+    byte oids[N][SNMP_MIB_OID_SIZE];     // asn.1 encoded oids including the type and length bytes, in oid order
+    snmpNode nodes[N];                   // the registry, passed to SimpleSNMP::useMib()
+
+private:
+    // Compares two encoded oids in numeric order, the same order as SimpleSNMP::compareOid()
+    // Each sub identifier is minimally encoded so a longer one is larger, equal lengths compare byte by byte
+    static constexpr int compare(const byte *o1, const byte *o2)
+    {
+        int i = 2;
+        for (; i < o1[1] + 2 && i < o2[1] + 2; i++)
+        {
+            int e1 = i;
+            while (o1[e1] & 0x80)
+                e1++;
+            int e2 = i;
+            while (o2[e2] & 0x80)
+                e2++;
+            if (e1 != e2)
+                return e1 - e2;
+            for (; i < e1; i++)
+            {
+                if (o1[i] != o2[i])
+                    return o1[i] - o2[i];
+            }
+            if (o1[i] != o2[i])
+                return o1[i] - o2[i];
+        }
+        return o1[1] - o2[1]; // all common sub identifiers match, shorter oid is first
+    }
+
+    // Returns true if oid is below entry, sub identifiers are self delimiting so matching bytes are enough
+    static constexpr bool within(const byte *oid, const byte *entry)
+    {
+        if (oid[1] <= entry[1])
+            return false;
+        for (int i = 2; i < entry[1] + 2; i++)
+        {
+            if (oid[i] != entry[i])
+                return false;
+        }
+        return true;
+    }
+
+    // Returns true if a bound variable can be sent as type, the same types SimpleSNMP::bindVariable() accepts
+    static constexpr bool validType(byte type, byte size)
+    {
+        switch (type)
+        {
+        case SNMP_DATATYPE_INTEGER:
+        case SNMP_DATATYPE_COUNTER32:
+        case SNMP_DATATYPE_GAUGE32:
+        case SNMP_DATATYPE_TIMETICKS:
+        case SNMP_DATATYPE_COUNTER64:
+            return size & ~SNMP_VARIABLE_SIGNED;
+        case SNMP_DATATYPE_OCTETSTRING:
+        case SNMP_DATATYPE_NOTSET:
+            return true;
+        }
+        return false;
+    }
+
+    static constexpr void copy(byte *to, const byte *from)
+    {
+        for (int i = 0; i < SNMP_MIB_OID_SIZE; i++)
+            to[i] = from[i];
+    }
+};
+
+// Returns the number of objects passed, used by SNMP_MIB() to size the mib
+template <class... T>
+constexpr size_t snmpMibCount(T...)
+{
+    return sizeof...(T);
+}
+
+// Declares a compile time mib called name holding the objects listed
+// The size is given rather than deduced, gcc places a constexpr object with a deduced type in .data instead of read only memory
+#define SNMP_MIB(name, ...) constexpr SnmpMib<snmpMibCount(__VA_ARGS__)> name(__VA_ARGS__)
@@ -0,0 +1,326 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include "SnmpPosixUdp.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+/**
+ * SnmpPosixUdp.cpp
+ *
+ * SnmpTransport over Linux udp sockets, so SimpleSNMP can run on a host
+ * recvmmsg() and sendmmsg() move a batch of datagrams per system call, received datagrams are handed out one at a time
+ * and responses are queued until flush(), which SimpleSNMP::action() calls before it returns
+ * With several endpoints epoll finds the sockets with datagrams waiting, each batch comes from one socket
+ **/
+
+SnmpPosixUdp::SnmpPosixUdp(void)
+{
+    fds = NULL;
+    fdCount = 0;
+    fdCapacity = 0;
+    epfd = -1;
+    eventCount = 0;
+    eventNext = 0;
+    rxCount = 0;
+    rxNext = 0;
+    rxEndpoint = 0;
+    lastEndpoint = 0;
+    txCount = 0;
+    txEndpoint = 0;
+    txQueued = 0;
+    recvCalls = 0;
+    sendCalls = 0;
+    for (int i = 0; i < SNMP_POSIX_BATCH; i++) // The buffers never move, point the message headers at them once
+    {
+        rxIov[i].iov_base = rxBuff[i];
+        rxIov[i].iov_len = SNMP_MAX_PACKET_SIZE;
+        memset(&rxMsg[i], 0, sizeof(rxMsg[i]));
+        rxMsg[i].msg_hdr.msg_iov = &rxIov[i];
+        rxMsg[i].msg_hdr.msg_iovlen = 1;
+        rxMsg[i].msg_hdr.msg_name = &rxAddr[i];
+
+        txIov[i].iov_base = txBuff[i];
+        memset(&txMsg[i], 0, sizeof(txMsg[i]));
+        txMsg[i].msg_hdr.msg_iov = &txIov[i];
+        txMsg[i].msg_hdr.msg_iovlen = 1;
+        txMsg[i].msg_hdr.msg_name = &txAddr[i];
+        txMsg[i].msg_hdr.msg_namelen = sizeof(txAddr[i]);
+    }
+}
+
+SnmpPosixUdp::~SnmpPosixUdp(void)
+{
+    stop();
+    delete[] fds;
+}
+
+// Starts listening on port on all addresses, returns true if ok
+bool SnmpPosixUdp::begin(uint16_t port)
+{
+    return begin(NULL, port);
+}
+
+// Starts listening on port on address, all addresses if address is NULL, returns true if ok
+// Any endpoints already listening are closed first
+bool SnmpPosixUdp::begin(const char *address, uint16_t port, bool shared)
+{
+    stop();
+    return addEndpoint(address, port, shared) >= 0;
+}
+
+// Listens on port on address as well as any endpoints already listening, all addresses if address is NULL
+// Several shared sockets can listen on the same port, eg one per worker thread, each request goes to one of them
+// The kernel picks the socket from a hash of the manager's address and port so a manager's requests always go to the same one
+// Returns the endpoint number, -1 if it failed
+int SnmpPosixUdp::addEndpoint(const char *address, uint16_t port, bool shared)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (address && inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        myLog_P(PSTR("SnmpPosixUdp: invalid address %s\n"), address);
+        return -1;
+    }
+    if (fdCount == 0xFFFF) // Endpoint numbers are 16 bit
+        return -1;
+    if (fdCount == fdCapacity) // Make room, double the size each time so adding thousands of endpoints isn't slow
+    {
+        uint16_t capacity = fdCapacity ? (fdCapacity > 0x7FFF ? 0xFFFF : fdCapacity * 2) : 1;
+        int *grown = new int[capacity];
+        if (!grown)
+            return -1;
+        if (fds)
+            memcpy(grown, fds, fdCount * sizeof(int));
+        delete[] fds;
+        fds = grown;
+        fdCapacity = capacity;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        myLog_P(PSTR("SnmpPosixUdp: socket() failed, %s\n"), strerror(errno));
+        return -1;
+    }
+    int on = 1;
+    if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        myLog_P(PSTR("SnmpPosixUdp: SO_REUSEPORT failed, %s\n"), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        myLog_P(PSTR("SnmpPosixUdp: bind() to port %u failed, %s\n"), port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (fdCount == 1 && epfd < 0) // Going from one socket to several, start watching them with epoll
+    {
+        epfd = epoll_create1(0);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = 0;
+        if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &event) < 0)
+        {
+            myLog_P(PSTR("SnmpPosixUdp: epoll failed, %s\n"), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (epfd >= 0)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = fdCount;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            myLog_P(PSTR("SnmpPosixUdp: epoll failed, %s\n"), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    fds[fdCount] = fd;
+    return fdCount++;
+}
+
+// Sends anything queued and closes all the sockets
+void SnmpPosixUdp::stop(void)
+{
+    flush();
+    for (uint16_t i = 0; i < fdCount; i++)
+        close(fds[i]);
+    fdCount = 0;
+    if (epfd >= 0)
+        close(epfd);
+    epfd = -1;
+    eventCount = 0;
+    eventNext = 0;
+    rxCount = 0;
+    rxNext = 0;
+    txEndpoint = 0;
+}
+
+// Waits up to timeout ms for a datagram, -1 for ever, returns true if one is waiting
+// Lets a host main loop sleep between requests instead of spinning on action()
+bool SnmpPosixUdp::wait(int timeout)
+{
+    if (rxNext < rxCount || eventNext < eventCount)
+        return true;
+    if (!fdCount)
+        return false;
+    if (epfd >= 0)
+    {
+        eventCount = epoll_wait(epfd, events, SNMP_POSIX_EVENTS, timeout);
+        eventNext = 0;
+        if (eventCount < 0)
+            eventCount = 0;
+        return eventCount > 0;
+    }
+    struct pollfd pfd;
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout) > 0;
+}
+
+// Finds the sockets with datagrams waiting when there are several endpoints, never blocks
+// Returns true if there are any left to read
+bool SnmpPosixUdp::ready(void)
+{
+    if (eventNext < eventCount)
+        return true;
+    eventCount = epoll_wait(epfd, events, SNMP_POSIX_EVENTS, 0);
+    eventNext = 0;
+    if (eventCount < 0)
+        eventCount = 0;
+    return eventCount > 0;
+}
+
+// Reads the next batch of datagrams if the last one has been used, never blocks
+// Returns true if a datagram is waiting
+bool SnmpPosixUdp::fill(void)
+{
+    if (rxNext < rxCount)
+        return true;
+    rxCount = 0;
+    rxNext = 0;
+    if (!fdCount)
+        return false;
+    for (int i = 0; i < SNMP_POSIX_BATCH; i++)
+        rxMsg[i].msg_hdr.msg_namelen = sizeof(rxAddr[i]);
+    while (true)
+    {
+        uint16_t endpoint = 0;
+        if (epfd >= 0) // Several sockets, read the next one epoll found ready
+        {
+            if (!ready())
+                return false;
+            endpoint = events[eventNext++].data.u32;
+        }
+        // MSG_TRUNC reports the real length of a datagram too big for the buffer so it's counted as oversize, not processed truncated
+        int count = recvmmsg(fds[endpoint], rxMsg, SNMP_POSIX_BATCH, MSG_DONTWAIT | MSG_TRUNC, NULL);
+        if (count > 0)
+        {
+            recvCalls++;
+            rxCount = count;
+            rxEndpoint = endpoint;
+            return true;
+        }
+        if (epfd < 0) // The only socket has nothing waiting
+            return false;
+    }
+}
+
+// Returns the length of the next datagram, 0 if none
+int SnmpPosixUdp::available(void)
+{
+    if (!fill())
+        return 0;
+    return rxMsg[rxNext].msg_len;
+}
+
+// Copies up to size bytes of the next datagram to buff and moves on to the following one
+int SnmpPosixUdp::receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port)
+{
+    if (!fill())
+        return 0;
+    int len = rxMsg[rxNext].msg_len;
+    if (len > SNMP_MAX_PACKET_SIZE) // Truncated, only the buffer was filled
+        len = SNMP_MAX_PACKET_SIZE;
+    if (len > size)
+        len = size;
+    if (len)
+        memcpy(buff, rxBuff[rxNext], len);
+    *ip = IPAddress(rxAddr[rxNext].sin_addr.s_addr);
+    *port = ntohs(rxAddr[rxNext].sin_port);
+    lastEndpoint = rxEndpoint;
+    rxNext++;
+    return len;
+}
+
+// Copies the start of the next datagram in the batch to buff without handing it out
+int SnmpPosixUdp::peek(byte *buff, uint16_t size, IPAddress *ip)
+{
+    if (!fill())
+        return 0;
+    int len = rxMsg[rxNext].msg_len;
+    if (len > SNMP_PEEK_SIZE)
+        len = SNMP_PEEK_SIZE;
+    if (len > size)
+        len = size;
+    memcpy(buff, rxBuff[rxNext], len);
+    *ip = IPAddress(rxAddr[rxNext].sin_addr.s_addr);
+    return len;
+}
+
+// Selects the endpoint the following responses go out of, the one the request arrived on
+void SnmpPosixUdp::setEndpoint(uint16_t endpoint)
+{
+    txEndpoint = endpoint;
+}
+
+// Queues a datagram to go with the next sendmmsg(), the queue is sent early if it fills or the endpoint changes
+bool SnmpPosixUdp::send(const byte *buff, uint16_t len, IPAddress ip, uint16_t port)
+{
+    if (txEndpoint >= fdCount || len > SNMP_MAX_PACKET_SIZE)
+        return false;
+    if (txCount == SNMP_POSIX_BATCH || (txCount && txQueued != txEndpoint))
+        flush();
+    txQueued = txEndpoint;
+    memcpy(txBuff[txCount], buff, len);
+    txIov[txCount].iov_len = len;
+    memset(&txAddr[txCount], 0, sizeof(txAddr[txCount]));
+    txAddr[txCount].sin_family = AF_INET;
+    txAddr[txCount].sin_addr.s_addr = (uint32_t)ip;
+    txAddr[txCount].sin_port = htons(port);
+    txCount++;
+    return true;
+}
+
+// Sends the queued datagrams, sendmmsg() may send fewer than asked so keep going until they're all gone
+// A datagram that can't be sent is dropped, udp gives no delivery guarantee anyway and the manager will retry
+void SnmpPosixUdp::flush(void)
+{
+    int sent = 0;
+    while (txQueued < fdCount && sent < txCount)
+    {
+        int count = sendmmsg(fds[txQueued], txMsg + sent, txCount - sent, 0);
+        sendCalls++;
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            myLog_P(PSTR("SnmpPosixUdp: sendmmsg() failed, %s\n"), strerror(errno));
+            count = 1; // skip the one that failed
+        }
+        sent += count;
+    }
+    txCount = 0;
+}
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+#if defined(__linux__) && !defined(ARDUINO)
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "SimpleSNMP.h"
+
+#ifndef SNMP_POSIX_BATCH
+#define SNMP_POSIX_BATCH 16 // Most datagrams received by one recvmmsg() or sent by one sendmmsg() call
+#endif
+#ifndef SNMP_POSIX_EVENTS
+#define SNMP_POSIX_EVENTS 64 // Most ready sockets collected by one epoll_wait() call when there are several endpoints
+#endif
+
+// class SnmpPosixUdp is the SnmpTransport for Linux hosts
+// Datagrams are received and sent in batches, one system call moves up to SNMP_POSIX_BATCH of them
+// It can listen on several addresses or ports at once, each is an endpoint, numbered from 0 in the order they're added
+class SnmpPosixUdp : public SnmpTransport
+{
+public:
+    SnmpPosixUdp(void);
+    ~SnmpPosixUdp(void);
+
+    bool begin(uint16_t port);                                        // Starts listening on port on all addresses, returns true if ok
+    bool begin(const char *address, uint16_t port, bool shared = false); // Starts listening on port on one address, eg "127.0.0.1", returns true if ok
+                                                                      // shared sockets use SO_REUSEPORT, the kernel spreads requests across all the sockets on the port
+    int addEndpoint(const char *address, uint16_t port, bool shared = false); // Listens on another address or port as well, returns it's endpoint number, -1 if it failed
+    void stop(void);                                                  // Sends anything queued and closes all the sockets
+    bool wait(int timeout);                                           // Waits up to timeout ms for a datagram, -1 for ever, returns true if one is waiting
+    uint16_t endpoints(void) { return fdCount; }                      // Returns the number of endpoints listening
+    uint16_t currentEndpoint(void) { return txEndpoint; }             // Returns the endpoint selected for the request being processed
+
+    int available(void);
+    int receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port);
+    int peek(byte *buff, uint16_t size, IPAddress *ip);
+    bool send(const byte *buff, uint16_t len, IPAddress ip, uint16_t port);
+    void flush(void);
+    uint16_t endpoint(void) { return lastEndpoint; }
+    void setEndpoint(uint16_t endpoint);
+
+    unsigned long recvCalls; // number of recvmmsg() calls that returned datagrams
+    unsigned long sendCalls; // number of sendmmsg() calls made
+
+private:
+    bool fill(void);  // Reads the next batch of datagrams if the last one has been used, returns true if one is waiting
+    bool ready(void); // Finds the sockets with datagrams waiting when there are several endpoints, returns true if there are any
+
+    int *fds;            // socket for each endpoint
+    uint16_t fdCount;    // number of endpoints
+    uint16_t fdCapacity; // size of fds
+    int epfd;            // epoll instance watching the sockets once there's more than one, -1 if not used
+
+    struct epoll_event events[SNMP_POSIX_EVENTS]; // sockets epoll_wait() found ready
+    int eventCount;                               // number found
+    int eventNext;                                // next one to read
+
+    byte rxBuff[SNMP_POSIX_BATCH][SNMP_MAX_PACKET_SIZE]; // received datagrams
+    struct sockaddr_in rxAddr[SNMP_POSIX_BATCH];         // and who sent them
+    struct iovec rxIov[SNMP_POSIX_BATCH];
+    struct mmsghdr rxMsg[SNMP_POSIX_BATCH];
+    int rxCount;           // datagrams in the last batch
+    int rxNext;            // next one to hand out
+    uint16_t rxEndpoint;   // endpoint the batch came from
+    uint16_t lastEndpoint; // endpoint of the datagram last handed out
+
+    byte txBuff[SNMP_POSIX_BATCH][SNMP_MAX_PACKET_SIZE]; // datagrams waiting for flush()
+    struct sockaddr_in txAddr[SNMP_POSIX_BATCH];         // and where they're going
+    struct iovec txIov[SNMP_POSIX_BATCH];
+    struct mmsghdr txMsg[SNMP_POSIX_BATCH];
+    int txCount;         // datagrams waiting, all for txQueued
+    uint16_t txEndpoint; // endpoint selected by setEndpoint(), send() uses it's socket
+    uint16_t txQueued;   // endpoint the waiting datagrams go out of
+};
+#endif
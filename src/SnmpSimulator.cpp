@@ -0,0 +1,139 @@
+#if defined(__linux__) && !defined(ARDUINO)
+#include "SnmpSimulator.h"
+
+/**
+ * SnmpSimulator.cpp
+ *
+ * Hosts many simulated SNMP agents in one process
+ * The agents' sockets are the endpoints of one SnmpPosixUdp and one SimpleSNMP worker answers for all of them,
+ * so the receive and response buffers are shared and an agent only needs a socket and an snmpSimAgent
+ * Overridden values are found by the registry's oid pointer, the read functions can call current() to return per agent values
+ **/
+
+SnmpSimulator::SnmpSimulator(SimpleSNMP *registry) : engine(&transport, registry)
+{
+    agentList = NULL;
+    agentCount = 0;
+    agentCapacity = 0;
+    engine.setActionBudget(SNMP_POSIX_BATCH, 0); // Work through a whole receive batch each call
+    engine.setValueOverride(lookup, this);
+}
+
+SnmpSimulator::~SnmpSimulator(void)
+{
+    for (uint16_t i = 0; i < agentCount; i++)
+    {
+        for (uint16_t j = 0; j < agentList[i].overrideCount; j++)
+            delete[] agentList[i].overrides[j].value;
+        delete[] agentList[i].overrides;
+    }
+    delete[] agentList;
+}
+
+// Adds an agent listening on port on address, eg 127.0.0.2, all addresses if address is NULL
+// Returns the agent number, -1 if the socket couldn't be opened
+int SnmpSimulator::addAgent(const char *address, uint16_t port)
+{
+    if (agentCount == agentCapacity) // Make room, double the size each time so adding thousands of agents isn't slow
+    {
+        uint16_t capacity = agentCapacity ? (agentCapacity > 0x7FFF ? 0xFFFF : agentCapacity * 2) : 16;
+        if (capacity == agentCapacity)
+            return -1;
+        snmpSimAgent *grown = new snmpSimAgent[capacity];
+        if (!grown)
+            return -1;
+        if (agentList)
+            memcpy(grown, agentList, agentCount * sizeof(snmpSimAgent));
+        delete[] agentList;
+        agentList = grown;
+        agentCapacity = capacity;
+    }
+    int endpoint = transport.addEndpoint(address, port);
+    if (endpoint < 0)
+        return -1;
+    agentList[endpoint].overrides = NULL;
+    agentList[endpoint].overrideCount = 0;
+    agentCount++;
+    return endpoint;
+}
+
+// Sets the value agent returns for a registered oid in place of calling the read function
+// A NULL value removes the override
+// Returns false if the agent or oid doesn't exist, or the value can't be encoded
+bool SnmpSimulator::setValue(uint16_t agent, const char *oidtext, const SnmpValue *value)
+{
+    const byte *oid = engine.registeredOid(oidtext);
+    if (agent >= agentCount || !oid)
+        return false;
+    snmpSimAgent *entry = agentList + agent;
+
+    uint16_t idx = 0; // Find the override, or where it goes
+    while (idx < entry->overrideCount && entry->overrides[idx].oid < oid)
+        idx++;
+    bool exists = idx < entry->overrideCount && entry->overrides[idx].oid == oid;
+
+    if (!value)
+    {
+        if (!exists)
+            return true;
+        delete[] entry->overrides[idx].value;
+        memmove(entry->overrides + idx, entry->overrides + idx + 1, (entry->overrideCount - idx - 1) * sizeof(snmpSimOverride));
+        entry->overrideCount--;
+        return true;
+    }
+
+    byte buff[SNMP_MAX_PACKET_SIZE];
+    uint16_t len = engine.encodeValue(value, buff, sizeof(buff));
+    if (!len)
+        return false;
+    byte *encoded = new byte[len];
+    if (!encoded)
+        return false;
+    memcpy(encoded, buff, len);
+    if (exists)
+    {
+        delete[] entry->overrides[idx].value;
+        entry->overrides[idx].value = encoded;
+        return true;
+    }
+
+    snmpSimOverride *grown = new snmpSimOverride[entry->overrideCount + 1]; // Overrides are set up front, keep them packed
+    if (!grown)
+    {
+        delete[] encoded;
+        return false;
+    }
+    memcpy(grown, entry->overrides, idx * sizeof(snmpSimOverride));
+    memcpy(grown + idx + 1, entry->overrides + idx, (entry->overrideCount - idx) * sizeof(snmpSimOverride));
+    grown[idx].oid = oid;
+    grown[idx].value = encoded;
+    delete[] entry->overrides;
+    entry->overrides = grown;
+    entry->overrideCount++;
+    return true;
+}
+
+// Value override function given to the engine, binary searches the current agent's overrides
+// Returns the encoded value, NULL if the agent uses the read function for this oid
+const byte *SnmpSimulator::lookup(void *context, const byte *oidasn1)
+{
+    SnmpSimulator *sim = (SnmpSimulator *)context;
+    uint16_t agent = sim->current();
+    if (agent >= sim->agentCount)
+        return NULL;
+    snmpSimAgent *entry = sim->agentList + agent;
+    uint16_t lo = 0;
+    uint16_t hi = entry->overrideCount;
+    while (lo < hi)
+    {
+        uint16_t mid = (lo + hi) / 2;
+        if (entry->overrides[mid].oid == oidasn1)
+            return entry->overrides[mid].value;
+        if (entry->overrides[mid].oid < oidasn1)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+#if defined(__linux__) && !defined(ARDUINO)
+#include "SimpleSNMP.h"
+#include "SnmpPosixUdp.h"
+
+// struct snmpSimOverride is a value one simulated agent returns in place of the registry's read function
+struct snmpSimOverride
+{
+    const byte *oid; // the registry's copy of the oid, overrides are kept sorted by this pointer
+    byte *value;     // encoded asn.1 value
+};
+
+// struct snmpSimAgent is one simulated device, it's socket is the transport endpoint with the same number
+struct snmpSimAgent
+{
+    snmpSimOverride *overrides; // values that differ from the registry's, NULL if none
+    uint16_t overrideCount;     // number of overrides
+};
+
+// class SnmpSimulator runs thousands of simulated agents in one process, eg for capacity testing a management system
+// Every agent answers from the same registry, each on it's own address or port, with it's own values where they're overridden
+// One SimpleSNMP serves all of them from a single event loop, an agent only costs it's socket and overrides
+class SnmpSimulator
+{
+public:
+    SnmpSimulator(SimpleSNMP *registry); // The agents answer with registry's oids, register them all first
+    ~SnmpSimulator(void);
+
+    int addAgent(const char *address, uint16_t port);                            // Adds an agent listening on address and port, returns it's number, -1 if it failed
+    bool setValue(uint16_t agent, const char *oidtext, const SnmpValue *value); // Sets the value one agent returns for a registered oid, NULL goes back to the read function
+    uint16_t agents(void) { return agentCount; }                                 // Returns the number of agents
+    uint16_t current(void) { return transport.currentEndpoint(); }               // Returns the agent the request being processed was sent to, for read functions
+    bool wait(int timeout) { return transport.wait(timeout); }                   // Waits up to timeout ms for a request to any agent, -1 for ever
+    void action(void) { engine.action(); }                                       // Processes waiting requests, call regularly
+
+    SnmpPosixUdp transport; // every agent's socket
+    SimpleSNMP engine;      // parses and answers the requests, it's counters cover all the agents
+
+private:
+    static const byte *lookup(void *context, const byte *oidasn1); // Finds the current agent's override for an oid
+
+    snmpSimAgent *agentList; // the agents, numbered as their endpoints
+    uint16_t agentCount;     // number of agents
+    uint16_t agentCapacity;  // size of agentList
+};
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include "SnmpHost.h"
+#endif
+
+#ifndef SNMP_PEEK_SIZE
+#define SNMP_PEEK_SIZE 48 // Bytes of a waiting datagram looked at before it's received, enough for the pdu type behind a 20 character community
+#endif
+
+// class SnmpTransport is the interface SimpleSNMP sends and receives datagrams through
+// SnmpWiFiUdp is used on Arduino boards and SnmpPosixUdp on Linux, other transports can be added by implementing these functions
+class SnmpTransport
+{
+public:
+    virtual ~SnmpTransport(void) {}
+
+    virtual int available(void) = 0;                                                    // Returns the length of the next waiting datagram without removing it, 0 if none
+    virtual int receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port) = 0;  // Removes the next datagram, copies up to size bytes of it to buff and returns the number copied
+    virtual int peek(byte *, uint16_t, IPAddress *) { return -1; }                       // Copies up to SNMP_PEEK_SIZE bytes of the next datagram without removing it, -1 if the transport can't
+    virtual bool send(const byte *buff, uint16_t len, IPAddress ip, uint16_t port) = 0; // Sends a datagram, or queues it until flush(), returns true if ok
+    virtual void flush(void) {}                                                         // Sends any queued datagrams, called at the end of each SimpleSNMP::action()
+
+    // Transports listening on several local addresses, eg a simulator, number them so responses go out the way the request came in
+    virtual uint16_t endpoint(void) { return 0; }      // Returns the endpoint the datagram last received arrived on
+    virtual void setEndpoint(uint16_t) {}              // Selects the endpoint for the request being processed, following send()s use it
+};
@@ -0,0 +1,83 @@
+#ifdef ARDUINO
+#include "SnmpWiFiUdp.h"
+
+/**
+ * SnmpWiFiUdp.cpp
+ *
+ * SnmpTransport over the Arduino WiFiUDP class, used by the default SimpleSNMP constructor
+ **/
+
+SnmpWiFiUdp::SnmpWiFiUdp(void)
+{
+    pending = 0;
+    headLen = -1;
+}
+
+// Starts listening on port, returns true if ok
+bool SnmpWiFiUdp::begin(uint16_t port)
+{
+    pending = 0;
+    return udp.begin(port);
+}
+
+// Stops listening
+void SnmpWiFiUdp::stop(void)
+{
+    udp.flush();
+    udp.stop();
+    pending = 0;
+}
+
+// Returns the length of the next datagram, parsePacket() is only called once until it's received
+int SnmpWiFiUdp::available(void)
+{
+    if (!pending)
+    {
+        pending = udp.parsePacket();
+        headLen = -1;
+    }
+    return pending;
+}
+
+// Copies up to size bytes of the next datagram to buff, anything left over is discarded by the next parsePacket()
+int SnmpWiFiUdp::receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port)
+{
+    int len = available();
+    if (!len)
+        return 0;
+    pending = 0;
+    *ip = udp.remoteIP();
+    *port = udp.remotePort();
+    if (len > size)
+        len = size;
+    if (!len)
+        return 0;
+    if (headLen < 0) // Not peeked at
+        return udp.read(buff, len);
+    int copied = headLen < len ? headLen : len; // The start has already been read into head
+    memcpy(buff, head, copied);
+    return copied < len ? copied + udp.read(buff + copied, len - copied) : copied;
+}
+
+// Copies the start of the next datagram to buff, it's read into head so receive() can still return the whole datagram
+int SnmpWiFiUdp::peek(byte *buff, uint16_t size, IPAddress *ip)
+{
+    int len = available();
+    if (!len)
+        return 0;
+    if (headLen < 0)
+        headLen = udp.read(head, len < SNMP_PEEK_SIZE ? len : SNMP_PEEK_SIZE);
+    *ip = udp.remoteIP();
+    len = headLen < size ? headLen : size;
+    memcpy(buff, head, len);
+    return len;
+}
+
+// Sends a datagram straight away, WiFiUDP has no way of batching them
+bool SnmpWiFiUdp::send(const byte *buff, uint16_t len, IPAddress ip, uint16_t port)
+{
+    udp.beginPacket(ip, port);
+    udp.write(buff, len);
+    return udp.endPacket();
+}
+#endif
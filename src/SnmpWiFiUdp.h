@@ -0,0 +1,27 @@
+#pragma once
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include "SnmpTransport.h"
+
+// class SnmpWiFiUdp is the SnmpTransport for Arduino WiFi boards, one datagram at a time through WiFiUDP
+class SnmpWiFiUdp : public SnmpTransport
+{
+public:
+    SnmpWiFiUdp(void);
+
+    bool begin(uint16_t port); // Starts listening on port, returns true if ok
+    void stop(void);           // Stops listening
+
+    int available(void);
+    int receive(byte *buff, uint16_t size, IPAddress *ip, uint16_t *port);
+    int peek(byte *buff, uint16_t size, IPAddress *ip);
+    bool send(const byte *buff, uint16_t len, IPAddress ip, uint16_t port);
+
+private:
+    WiFiUDP udp;
+    int pending; // length of the datagram parsePacket() found that hasn't been received yet, 0 if none
+    byte head[SNMP_PEEK_SIZE]; // start of the pending datagram, read by peek() as WiFiUDP can only peek a byte
+    int headLen;               // bytes in head, -1 until peek() has read them
+};
+#endif